@@ -1,4 +1,5 @@
 #include "mos6502.hpp"
+#include <algorithm>
 #include <cassert>
 namespace mos6502 {
 
@@ -11,27 +12,66 @@ namespace mos6502 {
 #define ZERO 0x02
 #define CARRY 0x01
 
-#define SET_NEGATIVE(x) (x ? (status |= NEGATIVE) : (status &= (~NEGATIVE)))
-#define SET_OVERFLOW(x) (x ? (status |= OVERFLOW) : (status &= (~OVERFLOW)))
+// N, V, Z and C are evaluated lazily, from the values that set them: N is bit
+// 7 of flagN, V is bit 7 of flagV, Z is set if flagZ is zero and C is flagC.
+// status holds the other flags, GetStatus and SetStatus convert
+#define SET_NZ(x) (flagN = flagZ = uint8_t(x))
+#define SET_OVERFLOW(x) (flagV = (x) ? 0x80 : 0)
 #define SET_CONSTANT(x) (x ? (status |= CONSTANT) : (status &= (~CONSTANT)))
 #define SET_BREAK(x) (x ? (status |= BREAK) : (status &= (~BREAK)))
 #define SET_DECIMAL(x) (x ? (status |= DECIMAL) : (status &= (~DECIMAL)))
 #define SET_INTERRUPT(x) (x ? (status |= INTERRUPT) : (status &= (~INTERRUPT)))
-#define SET_ZERO(x) (x ? (status |= ZERO) : (status &= (~ZERO)))
-#define SET_CARRY(x) (x ? (status |= CARRY) : (status &= (~CARRY)))
+#define SET_CARRY(x) (flagC = (x) ? 1 : 0)
 
-#define IF_NEGATIVE() ((status & NEGATIVE) ? true : false)
-#define IF_OVERFLOW() ((status & OVERFLOW) ? true : false)
+#define IF_NEGATIVE() ((flagN & 0x80) != 0)
+#define IF_OVERFLOW() ((flagV & 0x80) != 0)
 #define IF_CONSTANT() ((status & CONSTANT) ? true : false)
 #define IF_BREAK() ((status & BREAK) ? true : false)
 #define IF_DECIMAL() ((status & DECIMAL) ? true : false)
 #define IF_INTERRUPT() ((status & INTERRUPT) ? true : false)
-#define IF_ZERO() ((status & ZERO) ? true : false)
-#define IF_CARRY() ((status & CARRY) ? true : false)
+#define IF_ZERO() (flagZ == 0)
+#define IF_CARRY() (flagC != 0)
+
+// Base cycle counts of the documented NMOS opcodes, 0 for illegal ones
+static const uint8_t base_cycles[256] = {
+    7, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0, // 0x00
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 0x10
+    6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0, // 0x20
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 0x30
+    6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0, // 0x40
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 0x50
+    6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0, // 0x60
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 0x70
+    0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0, // 0x80
+    2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0, // 0x90
+    2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0, // 0xA0
+    2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0, // 0xB0
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // 0xC0
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 0xD0
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // 0xE0
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 0xF0
+};
+
+// Reads with abs,X, abs,Y or (zp),Y addressing take a cycle more when the
+// index crosses a page; stores and read-modify-write ops always take it
+static bool has_page_penalty(uint8_t op) {
+  uint8_t low = op & 0x1F;
+  if (low == 0x11 || low == 0x19 || low == 0x1D)
+    return (op & 0xE0) != 0x80; // not STA
+  return op == 0xBC || op == 0xBE; // LDY abs,X and LDX abs,Y
+}
+
+// Profiling counts real cycles, whatever the cycle method
+#ifdef OPENVTX_PROFILE
+static const bool profiling = true;
+#else
+static const bool profiling = false;
+#endif
 
 mos6502::mos6502(BusRead r, BusWrite w) {
   Write = (BusWrite)w;
   Read = (BusRead)r;
+  SetStatus(0);
   Instr instr;
 
   // fill jump table with ILLEGALs
@@ -552,6 +592,16 @@ mos6502::mos6502(BusRead r, BusWrite w) {
   instr.code = &mos6502::Op_TYA;
   InstrTable[0x98] = instr;
 
+  for (int i = 0; i < 256; i++) {
+    InstrTable[i].cycles = base_cycles[i];
+    InstrTable[i].pagePenalty = has_page_penalty(i);
+  }
+
+#ifdef OPENVTX_PROFILE
+  profile.reset(new Profile());
+  lastOpcode = -1;
+#endif
+
   // Reset();
 
   return;
@@ -633,6 +683,7 @@ uint16_t mos6502::Addr_ABX() {
   addrH = Read(pc++);
 
   addr = addrL + (addrH << 8) + X;
+  crossed = (addr & 0xFF00) != (addrH << 8);
   return addr;
 }
 
@@ -645,6 +696,7 @@ uint16_t mos6502::Addr_ABY() {
   addrH = Read(pc++);
 
   addr = addrL + (addrH << 8) + Y;
+  crossed = (addr & 0xFF00) != (addrH << 8);
   return addr;
 }
 
@@ -655,7 +707,7 @@ uint16_t mos6502::Addr_INX() {
 
   zeroL = (Read(pc++) + X) % 256;
   zeroH = (zeroL + 1) % 256;
-  addr = Read(zeroL) + (Read(zeroH) << 8);
+  addr = ReadZero(zeroL) + (ReadZero(zeroH) << 8);
 
   return addr;
 }
@@ -663,11 +715,14 @@ uint16_t mos6502::Addr_INX() {
 uint16_t mos6502::Addr_INY() {
   uint16_t zeroL;
   uint16_t zeroH;
+  uint16_t addrH;
   uint16_t addr;
 
   zeroL = Read(pc++);
   zeroH = (zeroL + 1) % 256;
-  addr = Read(zeroL) + (Read(zeroH) << 8) + Y;
+  addrH = ReadZero(zeroH);
+  addr = ReadZero(zeroL) + (addrH << 8) + Y;
+  crossed = (addr & 0xFF00) != (addrH << 8);
 
   return addr;
 }
@@ -692,7 +747,10 @@ void mos6502::Reset() {
 }
 
 void mos6502::StackPush(uint8_t byte) {
-  Write(0x0100 + sp, byte);
+  if (stackPage)
+    stackPage[sp] = byte;
+  else
+    Write(0x0100 + sp, byte);
   if (sp == 0x00)
     sp = 0xFF;
   else
@@ -704,7 +762,7 @@ uint8_t mos6502::StackPop() {
     sp = 0x00;
   else
     sp++;
-  return Read(0x0100 + sp);
+  return stackPage ? stackPage[sp] : Read(0x0100 + sp);
 }
 
 void mos6502::IRQ(uint16_t vectorH, uint16_t vectorL) {
@@ -712,9 +770,11 @@ void mos6502::IRQ(uint16_t vectorH, uint16_t vectorL) {
     SET_BREAK(0);
     StackPush((pc >> 8) & 0xFF);
     StackPush(pc & 0xFF);
-    StackPush(status);
+    StackPush(GetStatus());
     SET_INTERRUPT(1);
     pc = (Read(vectorH) << 8) + Read(vectorL);
+    if (cycleMethod == CYCLE_COUNT)
+      cycles += 7;
   }
   return;
 }
@@ -723,43 +783,205 @@ void mos6502::NMI() {
   SET_BREAK(0);
   StackPush((pc >> 8) & 0xFF);
   StackPush(pc & 0xFF);
-  StackPush(status);
+  StackPush(GetStatus());
   SET_INTERRUPT(1);
   pc = (Read(nmiVectorH) << 8) + Read(nmiVectorL);
+  if (cycleMethod == CYCLE_COUNT)
+    cycles += 7;
   return;
 }
 
-void mos6502::Run(uint32_t n) {
-  uint32_t start = cycles;
-  uint8_t opcode;
-  Instr instr;
+uint32_t mos6502::Run(uint32_t n) {
+  if (cycleMethod == CYCLE_COUNT) {
+    if (scramble)
+      return RunEngine<true, CYCLE_COUNT>(n);
+    else
+      return RunEngine<false, CYCLE_COUNT>(n);
+  } else {
+    if (scramble)
+      return RunEngine<true, INST_COUNT>(n);
+    else
+      return RunEngine<false, INST_COUNT>(n);
+  }
+}
 
-  while (start + n > cycles && !illegalOpcode) {
-    // fetch
-    opcode = Read(pc++);
-    if (scramble /*&& (pc >= 0x2000)*/) {
-      int b2 = (opcode & 0x04) >> 2;
-      int b7 = (opcode & 0x80) >> 7;
-      opcode = opcode & 0x7B;
-      opcode |= (b2 << 7);
-      opcode |= (b7 << 2);
-    }
+template <bool Scramble, CycleMethod Method>
+uint32_t mos6502::RunEngine(uint32_t n) {
+  if (engine == ENGINE_FUSED)
+    return RunFusedT<Scramble, Method>(n);
+  return RunT<Scramble, Method>(n);
+}
+
+template <bool Scramble> inline uint8_t mos6502::Fetch() {
+  uint8_t opcode = Read(pc++);
+  if (Scramble /*&& (pc >= 0x2000)*/) {
+    int b2 = (opcode & 0x04) >> 2;
+    int b7 = (opcode & 0x80) >> 7;
+    opcode = opcode & 0x7B;
+    opcode |= (b2 << 7);
+    opcode |= (b7 << 2);
+  }
+  return opcode;
+}
 
-    // decode
-    instr = InstrTable[opcode];
+template <CycleMethod Method>
+inline void mos6502::Retire(uint8_t opcode, const Instr &i) {
+#ifdef OPENVTX_PROFILE
+  Count(opcode, i);
+#endif
+  if (Method == CYCLE_COUNT)
+    cycles += i.cycles + (i.pagePenalty && crossed) + branchCycles;
+  else
+    cycles++;
+}
 
-    // execute
-    Exec(instr);
+template <CycleMethod Method> inline void mos6502::RunDecoded(uint8_t opcode) {
+  Instr instr = InstrTable[opcode];
+
+  if (Method == CYCLE_COUNT || profiling) {
+    crossed = false;
+    branchCycles = 0;
+  }
+  Exec(instr);
 
-    if (illegalOpcode) {
+  if (illegalOpcode) {
+    if (assertOnTrap) {
       cout << "illegal at pc=" << hex << (pc - 1) << endl;
       assert(false);
     }
+    // Stay on the illegal opcode
+    pc--;
+    return;
+  }
 
-    cycles++;
+  Retire<Method>(opcode, instr);
+}
+
+template <CycleMethod Method, mos6502::AddrExec Addr, mos6502::CodeExec Code>
+inline void mos6502::RunFixed(uint8_t opcode) {
+  if (Method == CYCLE_COUNT || profiling) {
+    crossed = false;
+    branchCycles = 0;
+  }
+  (this->*Code)((this->*Addr)());
+  Retire<Method>(opcode, InstrTable[opcode]);
+}
+
+template <bool Scramble, CycleMethod Method>
+uint32_t mos6502::RunT(uint32_t n) {
+  uint32_t start = cycles;
+  while (start + n > cycles && !illegalOpcode)
+    RunDecoded<Method>(Fetch<Scramble>());
+  return cycles - start;
+}
+
+template uint32_t mos6502::RunT<false, INST_COUNT>(uint32_t n);
+template uint32_t mos6502::RunT<true, INST_COUNT>(uint32_t n);
+template uint32_t mos6502::RunT<false, CYCLE_COUNT>(uint32_t n);
+template uint32_t mos6502::RunT<true, CYCLE_COUNT>(uint32_t n);
+
+// Fused engine. Common sequences are recognised as their opcodes are fetched,
+// and run with direct calls to their handlers instead of through the
+// instruction table. Each handler runs its first instruction, then fetches
+// the next opcode and runs it too, fused if it completes the sequence. The
+// bus accesses are the same as for the interpreter, in the same order, but
+// all in one call, so callers must keep the rest of the system from changing
+// while a sequence runs
+
+// LDA then STA, or AND # then BEQ
+template <bool Scramble, CycleMethod Method, mos6502::AddrExec Addr>
+void mos6502::FuseLoad(uint8_t opcode) {
+  RunFixed<Method, Addr, &mos6502::Op_LDA>(opcode);
+  uint8_t next = Fetch<Scramble>();
+  switch (next) {
+  case 0x85:
+    RunFixed<Method, &mos6502::Addr_ZER, &mos6502::Op_STA>(next);
+    break;
+  case 0x8D:
+    RunFixed<Method, &mos6502::Addr_ABS, &mos6502::Op_STA>(next);
+    break;
+  case 0x29:
+    // Polling a register for a bit
+    RunFixed<Method, &mos6502::Addr_IMM, &mos6502::Op_AND>(next);
+    next = Fetch<Scramble>();
+    if (next == 0xF0)
+      RunFixed<Method, &mos6502::Addr_REL, &mos6502::Op_BEQ>(next);
+    else
+      RunDecoded<Method>(next);
+    break;
+  default:
+    RunDecoded<Method>(next);
+    break;
+  }
+}
+
+// CMP then BEQ or BNE
+template <bool Scramble, CycleMethod Method, mos6502::AddrExec Addr>
+void mos6502::FuseCompare(uint8_t opcode) {
+  RunFixed<Method, Addr, &mos6502::Op_CMP>(opcode);
+  uint8_t next = Fetch<Scramble>();
+  if (next == 0xF0)
+    RunFixed<Method, &mos6502::Addr_REL, &mos6502::Op_BEQ>(next);
+  else if (next == 0xD0)
+    RunFixed<Method, &mos6502::Addr_REL, &mos6502::Op_BNE>(next);
+  else
+    RunDecoded<Method>(next);
+}
+
+// DEX or DEY then BNE, for loops
+template <bool Scramble, CycleMethod Method, mos6502::CodeExec Code>
+void mos6502::FuseDecrement(uint8_t opcode) {
+  RunFixed<Method, &mos6502::Addr_IMP, Code>(opcode);
+  uint8_t next = Fetch<Scramble>();
+  if (next == 0xD0)
+    RunFixed<Method, &mos6502::Addr_REL, &mos6502::Op_BNE>(next);
+  else
+    RunDecoded<Method>(next);
+}
+
+template <bool Scramble, CycleMethod Method>
+uint32_t mos6502::RunFusedT(uint32_t n) {
+  uint32_t start = cycles;
+  while (start + n > cycles && !illegalOpcode) {
+    uint8_t opcode = Fetch<Scramble>();
+    switch (opcode) {
+    case 0xA9:
+      FuseLoad<Scramble, Method, &mos6502::Addr_IMM>(opcode);
+      break;
+    case 0xA5:
+      FuseLoad<Scramble, Method, &mos6502::Addr_ZER>(opcode);
+      break;
+    case 0xAD:
+      FuseLoad<Scramble, Method, &mos6502::Addr_ABS>(opcode);
+      break;
+    case 0xC9:
+      FuseCompare<Scramble, Method, &mos6502::Addr_IMM>(opcode);
+      break;
+    case 0xC5:
+      FuseCompare<Scramble, Method, &mos6502::Addr_ZER>(opcode);
+      break;
+    case 0xCD:
+      FuseCompare<Scramble, Method, &mos6502::Addr_ABS>(opcode);
+      break;
+    case 0xCA:
+      FuseDecrement<Scramble, Method, &mos6502::Op_DEX>(opcode);
+      break;
+    case 0x88:
+      FuseDecrement<Scramble, Method, &mos6502::Op_DEY>(opcode);
+      break;
+    default:
+      RunDecoded<Method>(opcode);
+      break;
+    }
   }
+  return cycles - start;
 }
 
+template uint32_t mos6502::RunFusedT<false, INST_COUNT>(uint32_t n);
+template uint32_t mos6502::RunFusedT<true, INST_COUNT>(uint32_t n);
+template uint32_t mos6502::RunFusedT<false, CYCLE_COUNT>(uint32_t n);
+template uint32_t mos6502::RunFusedT<true, CYCLE_COUNT>(uint32_t n);
+
 void mos6502::Exec(Instr i) {
   uint16_t src = (this->*i.addr)();
   (this->*i.code)(src);
@@ -767,22 +989,28 @@ void mos6502::Exec(Instr i) {
 
 void mos6502::Op_ILLEGAL(uint16_t src) { illegalOpcode = true; }
 
+// Take a branch, which costs a cycle, or two if it crosses a page
+inline void mos6502::Branch(uint16_t src) {
+  branchCycles = ((pc ^ src) & 0xFF00) ? 2 : 1;
+  pc = src;
+}
+
 void mos6502::Op_ADC(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   unsigned int tmp = m + A + (IF_CARRY() ? 1 : 0);
-  SET_ZERO(!(tmp & 0xFF));
+  flagZ = tmp;
   if (IF_DECIMAL()) {
     if (((A & 0xF) + (m & 0xF) + (IF_CARRY() ? 1 : 0)) > 9)
       tmp += 6;
-    SET_NEGATIVE(tmp & 0x80);
-    SET_OVERFLOW(!((A ^ m) & 0x80) && ((A ^ tmp) & 0x80));
+    flagN = tmp;
+    flagV = ~(A ^ m) & (A ^ tmp);
     if (tmp > 0x99) {
       tmp += 96;
     }
     SET_CARRY(tmp > 0x99);
   } else {
-    SET_NEGATIVE(tmp & 0x80);
-    SET_OVERFLOW(!((A ^ m) & 0x80) && ((A ^ tmp) & 0x80));
+    flagN = tmp;
+    flagV = ~(A ^ m) & (A ^ tmp);
     SET_CARRY(tmp > 0xFF);
   }
 
@@ -791,22 +1019,20 @@ void mos6502::Op_ADC(uint16_t src) {
 }
 
 void mos6502::Op_AND(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   uint8_t res = m & A;
-  SET_NEGATIVE(res & 0x80);
-  SET_ZERO(!res);
+  SET_NZ(res);
   A = res;
   return;
 }
 
 void mos6502::Op_ASL(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   SET_CARRY(m & 0x80);
   m <<= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
-  Write(src, m);
+  SET_NZ(m);
+  WriteData(src, m);
   return;
 }
 
@@ -815,70 +1041,71 @@ void mos6502::Op_ASL_ACC(uint16_t src) {
   SET_CARRY(m & 0x80);
   m <<= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
 
 void mos6502::Op_BCC(uint16_t src) {
   if (!IF_CARRY()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
 
 void mos6502::Op_BCS(uint16_t src) {
   if (IF_CARRY()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
 
 void mos6502::Op_BEQ(uint16_t src) {
   if (IF_ZERO()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
 
 void mos6502::Op_BIT(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   uint8_t res = m & A;
-  SET_NEGATIVE(res & 0x80);
-  status = (status & 0x3F) | (uint8_t)(m & 0xC0);
-  SET_ZERO(!res);
+  flagN = m;
+  flagV = m << 1;
+  flagZ = res;
   return;
 }
 
 void mos6502::Op_BMI(uint16_t src) {
   if (IF_NEGATIVE()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
 
 void mos6502::Op_BNE(uint16_t src) {
   if (!IF_ZERO()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
 
 void mos6502::Op_BPL(uint16_t src) {
   if (!IF_NEGATIVE()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
 
 void mos6502::Op_BRK(uint16_t src) {
-  cout << "BRK!!!" << endl;
-  assert(false);
+  if (assertOnTrap) {
+    cout << "BRK!!!" << endl;
+    assert(false);
+  }
   pc++;
   StackPush((pc >> 8) & 0xFF);
   StackPush(pc & 0xFF);
-  StackPush(status | BREAK);
+  StackPush(GetStatus() | BREAK);
   SET_INTERRUPT(1);
   pc = (Read(brkVectorH) << 8) + Read(brkVectorL);
   return;
@@ -886,14 +1113,14 @@ void mos6502::Op_BRK(uint16_t src) {
 
 void mos6502::Op_BVC(uint16_t src) {
   if (!IF_OVERFLOW()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
 
 void mos6502::Op_BVS(uint16_t src) {
   if (IF_OVERFLOW()) {
-    pc = src;
+    Branch(src);
   }
   return;
 }
@@ -919,43 +1146,38 @@ void mos6502::Op_CLV(uint16_t src) {
 }
 
 void mos6502::Op_CMP(uint16_t src) {
-  unsigned int tmp = A - Read(src);
+  unsigned int tmp = A - ReadData(src);
   SET_CARRY(tmp < 0x100);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
+  SET_NZ(tmp);
   return;
 }
 
 void mos6502::Op_CPX(uint16_t src) {
-  unsigned int tmp = X - Read(src);
+  unsigned int tmp = X - ReadData(src);
   SET_CARRY(tmp < 0x100);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
+  SET_NZ(tmp);
   return;
 }
 
 void mos6502::Op_CPY(uint16_t src) {
-  unsigned int tmp = Y - Read(src);
+  unsigned int tmp = Y - ReadData(src);
   SET_CARRY(tmp < 0x100);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
+  SET_NZ(tmp);
   return;
 }
 
 void mos6502::Op_DEC(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   m = (m - 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
-  Write(src, m);
+  SET_NZ(m);
+  WriteData(src, m);
   return;
 }
 
 void mos6502::Op_DEX(uint16_t src) {
   uint8_t m = X;
   m = (m - 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
   return;
 }
@@ -963,41 +1185,36 @@ void mos6502::Op_DEX(uint16_t src) {
 void mos6502::Op_DEY(uint16_t src) {
   uint8_t m = Y;
   m = (m - 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Y = m;
   return;
 }
 
 void mos6502::Op_EOR(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   m = A ^ m;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
 }
 
 void mos6502::Op_INC(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   m = (m + 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
-  Write(src, m);
+  SET_NZ(m);
+  WriteData(src, m);
 }
 
 void mos6502::Op_INX(uint16_t src) {
   uint8_t m = X;
   m = (m + 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
 }
 
 void mos6502::Op_INY(uint16_t src) {
   uint8_t m = Y;
   m = (m + 1) % 256;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Y = m;
 }
 
@@ -1011,51 +1228,45 @@ void mos6502::Op_JSR(uint16_t src) {
 }
 
 void mos6502::Op_LDA(uint16_t src) {
-  uint8_t m = Read(src);
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  uint8_t m = ReadData(src);
+  SET_NZ(m);
   A = m;
 }
 
 void mos6502::Op_LDX(uint16_t src) {
-  uint8_t m = Read(src);
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  uint8_t m = ReadData(src);
+  SET_NZ(m);
   X = m;
 }
 
 void mos6502::Op_LDY(uint16_t src) {
-  uint8_t m = Read(src);
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  uint8_t m = ReadData(src);
+  SET_NZ(m);
   Y = m;
 }
 
 void mos6502::Op_LSR(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   SET_CARRY(m & 0x01);
   m >>= 1;
-  SET_NEGATIVE(0);
-  SET_ZERO(!m);
-  Write(src, m);
+  SET_NZ(m);
+  WriteData(src, m);
 }
 
 void mos6502::Op_LSR_ACC(uint16_t src) {
   uint8_t m = A;
   SET_CARRY(m & 0x01);
   m >>= 1;
-  SET_NEGATIVE(0);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
 }
 
 void mos6502::Op_NOP(uint16_t src) { return; }
 
 void mos6502::Op_ORA(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   m = A | m;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
 }
 
@@ -1065,33 +1276,31 @@ void mos6502::Op_PHA(uint16_t src) {
 }
 
 void mos6502::Op_PHP(uint16_t src) {
-  StackPush(status | BREAK);
+  StackPush(GetStatus() | BREAK);
   return;
 }
 
 void mos6502::Op_PLA(uint16_t src) {
   A = StackPop();
-  SET_NEGATIVE(A & 0x80);
-  SET_ZERO(!A);
+  SET_NZ(A);
   return;
 }
 
 void mos6502::Op_PLP(uint16_t src) {
-  status = StackPop();
+  SetStatus(StackPop());
   SET_CONSTANT(1);
   return;
 }
 
 void mos6502::Op_ROL(uint16_t src) {
-  uint16_t m = Read(src);
+  uint16_t m = ReadData(src);
   m <<= 1;
   if (IF_CARRY())
     m |= 0x01;
   SET_CARRY(m > 0xFF);
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
-  Write(src, m);
+  SET_NZ(m);
+  WriteData(src, m);
   return;
 }
 
@@ -1102,22 +1311,20 @@ void mos6502::Op_ROL_ACC(uint16_t src) {
     m |= 0x01;
   SET_CARRY(m > 0xFF);
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
 
 void mos6502::Op_ROR(uint16_t src) {
-  uint16_t m = Read(src);
+  uint16_t m = ReadData(src);
   if (IF_CARRY())
     m |= 0x100;
   SET_CARRY(m & 0x01);
   m >>= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
-  Write(src, m);
+  SET_NZ(m);
+  WriteData(src, m);
   return;
 }
 
@@ -1128,8 +1335,7 @@ void mos6502::Op_ROR_ACC(uint16_t src) {
   SET_CARRY(m & 0x01);
   m >>= 1;
   m &= 0xFF;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
@@ -1137,7 +1343,7 @@ void mos6502::Op_ROR_ACC(uint16_t src) {
 void mos6502::Op_RTI(uint16_t src) {
   uint8_t lo, hi;
 
-  status = StackPop();
+  SetStatus(StackPop());
 
   lo = StackPop();
   hi = StackPop();
@@ -1157,11 +1363,10 @@ void mos6502::Op_RTS(uint16_t src) {
 }
 
 void mos6502::Op_SBC(uint16_t src) {
-  uint8_t m = Read(src);
+  uint8_t m = ReadData(src);
   unsigned int tmp = A - m - (IF_CARRY() ? 0 : 1);
-  SET_NEGATIVE(tmp & 0x80);
-  SET_ZERO(!(tmp & 0xFF));
-  SET_OVERFLOW(((A ^ tmp) & 0x80) && ((A ^ m) & 0x80));
+  SET_NZ(tmp);
+  flagV = (A ^ tmp) & (A ^ m);
 
   if (IF_DECIMAL()) {
     if (((A & 0x0F) - (IF_CARRY() ? 0 : 1)) < (m & 0x0F))
@@ -1191,48 +1396,44 @@ void mos6502::Op_SEI(uint16_t src) {
 }
 
 void mos6502::Op_STA(uint16_t src) {
-  Write(src, A);
+  WriteData(src, A);
   return;
 }
 
 void mos6502::Op_STX(uint16_t src) {
-  Write(src, X);
+  WriteData(src, X);
   return;
 }
 
 void mos6502::Op_STY(uint16_t src) {
-  Write(src, Y);
+  WriteData(src, Y);
   return;
 }
 
 void mos6502::Op_TAX(uint16_t src) {
   uint8_t m = A;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
   return;
 }
 
 void mos6502::Op_TAY(uint16_t src) {
   uint8_t m = A;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   Y = m;
   return;
 }
 
 void mos6502::Op_TSX(uint16_t src) {
   uint8_t m = sp;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   X = m;
   return;
 }
 
 void mos6502::Op_TXA(uint16_t src) {
   uint8_t m = X;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
@@ -1244,11 +1445,222 @@ void mos6502::Op_TXS(uint16_t src) {
 
 void mos6502::Op_TYA(uint16_t src) {
   uint8_t m = Y;
-  SET_NEGATIVE(m & 0x80);
-  SET_ZERO(!m);
+  SET_NZ(m);
   A = m;
   return;
 }
 
 uint16_t mos6502::GetPC() { return pc; }
+
+static const char *const engine_names[ENGINE_COUNT] = {"interp", "fused"};
+
+const char *EngineName(Engine e) { return engine_names[e]; }
+
+bool ParseEngine(const string &name, Engine &e) {
+  for (int i = 0; i < ENGINE_COUNT; i++) {
+    if (name == engine_names[i]) {
+      e = Engine(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifdef OPENVTX_PROFILE
+static const char *const mnemonics[256] = {
+    "BRK", "ORA", "???", "???", "???", "ORA", "ASL", "???", // 0x00
+    "PHP", "ORA", "ASL", "???", "???", "ORA", "ASL", "???",
+    "BPL", "ORA", "???", "???", "???", "ORA", "ASL", "???", // 0x10
+    "CLC", "ORA", "???", "???", "???", "ORA", "ASL", "???",
+    "JSR", "AND", "???", "???", "BIT", "AND", "ROL", "???", // 0x20
+    "PLP", "AND", "ROL", "???", "BIT", "AND", "ROL", "???",
+    "BMI", "AND", "???", "???", "???", "AND", "ROL", "???", // 0x30
+    "SEC", "AND", "???", "???", "???", "AND", "ROL", "???",
+    "RTI", "EOR", "???", "???", "???", "EOR", "LSR", "???", // 0x40
+    "PHA", "EOR", "LSR", "???", "JMP", "EOR", "LSR", "???",
+    "BVC", "EOR", "???", "???", "???", "EOR", "LSR", "???", // 0x50
+    "CLI", "EOR", "???", "???", "???", "EOR", "LSR", "???",
+    "RTS", "ADC", "???", "???", "???", "ADC", "ROR", "???", // 0x60
+    "PLA", "ADC", "ROR", "???", "JMP", "ADC", "ROR", "???",
+    "BVS", "ADC", "???", "???", "???", "ADC", "ROR", "???", // 0x70
+    "SEI", "ADC", "???", "???", "???", "ADC", "ROR", "???",
+    "???", "STA", "???", "???", "STY", "STA", "STX", "???", // 0x80
+    "DEY", "???", "TXA", "???", "STY", "STA", "STX", "???",
+    "BCC", "STA", "???", "???", "STY", "STA", "STX", "???", // 0x90
+    "TYA", "STA", "TXS", "???", "???", "STA", "???", "???",
+    "LDY", "LDA", "LDX", "???", "LDY", "LDA", "LDX", "???", // 0xA0
+    "TAY", "LDA", "TAX", "???", "LDY", "LDA", "LDX", "???",
+    "BCS", "LDA", "???", "???", "LDY", "LDA", "LDX", "???", // 0xB0
+    "CLV", "LDA", "TSX", "???", "LDY", "LDA", "LDX", "???",
+    "CPY", "CMP", "???", "???", "CPY", "CMP", "DEC", "???", // 0xC0
+    "INY", "CMP", "DEX", "???", "CPY", "CMP", "DEC", "???",
+    "BNE", "CMP", "???", "???", "???", "CMP", "DEC", "???", // 0xD0
+    "CLD", "CMP", "???", "???", "???", "CMP", "DEC", "???",
+    "CPX", "SBC", "???", "???", "CPX", "SBC", "INC", "???", // 0xE0
+    "INX", "SBC", "NOP", "???", "CPX", "SBC", "INC", "???",
+    "BEQ", "SBC", "???", "???", "???", "SBC", "INC", "???", // 0xF0
+    "SED", "SBC", "???", "???", "???", "SBC", "INC", "???",
+};
+
+void mos6502::Count(uint8_t opcode, const Instr &i) {
+  profile->count[opcode]++;
+  profile->cycles[opcode] +=
+      i.cycles + (i.pagePenalty && crossed) + branchCycles;
+  if (lastOpcode >= 0)
+    profile->pairs[lastOpcode][opcode]++;
+  lastOpcode = opcode;
+}
+
+static const int n_modes = 13;
+
+int mos6502::ModeIndex(uint8_t opcode) const {
+  static const AddrExec modes[n_modes] = {
+      &mos6502::Addr_IMP, &mos6502::Addr_ACC, &mos6502::Addr_IMM,
+      &mos6502::Addr_ZER, &mos6502::Addr_ZEX, &mos6502::Addr_ZEY,
+      &mos6502::Addr_ABS, &mos6502::Addr_ABX, &mos6502::Addr_ABY,
+      &mos6502::Addr_INX, &mos6502::Addr_INY, &mos6502::Addr_ABI,
+      &mos6502::Addr_REL};
+  for (int i = 0; i < n_modes; i++)
+    if (InstrTable[opcode].addr == modes[i])
+      return i;
+  assert(false);
+  return 0;
+}
+
+void mos6502::ModeTotals(uint64_t *count, uint64_t *cycles) const {
+  fill(count, count + n_modes, 0);
+  fill(cycles, cycles + n_modes, 0);
+  for (int op = 0; op < 256; op++) {
+    if (profile->count[op] == 0)
+      continue;
+    int m = ModeIndex(op);
+    count[m] += profile->count[op];
+    cycles[m] += profile->cycles[op];
+  }
+}
+
+// Without commas, so they can go in CSV as they are
+static const char *const mode_names[n_modes] = {
+    "imp", "acc", "imm", "zp", "zpx", "zpy", "abs",
+    "absx", "absy", "indx", "indy", "ind", "rel"};
+
+vector<uint16_t> mos6502::TopPairs(int n) const {
+  vector<uint16_t> pairs;
+  for (int i = 0; i < 0x10000; i++)
+    if (profile->pairs[i >> 8][i & 0xFF] != 0)
+      pairs.push_back(i);
+  n = min<int>(n, pairs.size());
+  partial_sort(pairs.begin(), pairs.begin() + n, pairs.end(),
+               [this](uint16_t a, uint16_t b) {
+                 return profile->pairs[a >> 8][a & 0xFF] >
+                        profile->pairs[b >> 8][b & 0xFF];
+               });
+  pairs.resize(n);
+  return pairs;
+}
+
+static void print_opcode(ostream &os, uint8_t opcode) {
+  static const char digits[] = "0123456789ABCDEF";
+  os << digits[opcode >> 4] << digits[opcode & 0xF];
+}
+
+void mos6502::WriteProfileCSV(ostream &os, const char *name,
+                              int top_pairs) const {
+  for (int op = 0; op < 256; op++) {
+    if (profile->count[op] == 0)
+      continue;
+    int m = ModeIndex(op);
+    os << name << ",opcode,";
+    print_opcode(os, op);
+    os << "," << mnemonics[op] << "," << mode_names[m] << ","
+       << profile->count[op] << "," << profile->cycles[op] << "\n";
+  }
+  uint64_t mode_count[n_modes], mode_cycles[n_modes];
+  ModeTotals(mode_count, mode_cycles);
+  for (int m = 0; m < n_modes; m++) {
+    if (mode_count[m] != 0)
+      os << name << ",mode,,," << mode_names[m] << "," << mode_count[m] << ","
+         << mode_cycles[m] << "\n";
+  }
+  for (uint16_t p : TopPairs(top_pairs)) {
+    uint8_t a = p >> 8, b = p & 0xFF;
+    os << name << ",pair,";
+    print_opcode(os, a);
+    os << " ";
+    print_opcode(os, b);
+    os << "," << mnemonics[a] << " " << mnemonics[b] << ","
+       << mode_names[ModeIndex(a)] << " " << mode_names[ModeIndex(b)] << ","
+       << profile->pairs[a][b] << ",\n";
+  }
+}
+
+void mos6502::WriteProfileJSON(ostream &os, int top_pairs) const {
+  uint64_t mode_count[n_modes], mode_cycles[n_modes];
+  ModeTotals(mode_count, mode_cycles);
+  uint64_t total_count = 0, total_cycles = 0;
+  for (int m = 0; m < n_modes; m++) {
+    total_count += mode_count[m];
+    total_cycles += mode_cycles[m];
+  }
+  os << "{\"instructions\": " << total_count << ", \"cycles\": " << total_cycles
+     << ",\n \"opcodes\": [";
+  const char *sep = "\n  ";
+  for (int op = 0; op < 256; op++) {
+    if (profile->count[op] == 0)
+      continue;
+    os << sep << "{\"opcode\": \"";
+    print_opcode(os, op);
+    os << "\", \"mnemonic\": \"" << mnemonics[op] << "\", \"mode\": \""
+       << mode_names[ModeIndex(op)] << "\", \"count\": " << profile->count[op]
+       << ", \"cycles\": " << profile->cycles[op] << "}";
+    sep = ",\n  ";
+  }
+  os << "],\n \"modes\": [";
+  sep = "\n  ";
+  for (int m = 0; m < n_modes; m++) {
+    if (mode_count[m] == 0)
+      continue;
+    os << sep << "{\"mode\": \"" << mode_names[m]
+       << "\", \"count\": " << mode_count[m]
+       << ", \"cycles\": " << mode_cycles[m] << "}";
+    sep = ",\n  ";
+  }
+  os << "],\n \"pairs\": [";
+  sep = "\n  ";
+  for (uint16_t p : TopPairs(top_pairs)) {
+    uint8_t a = p >> 8, b = p & 0xFF;
+    os << sep << "{\"first\": \"";
+    print_opcode(os, a);
+    os << "\", \"second\": \"";
+    print_opcode(os, b);
+    os << "\", \"mnemonics\": \"" << mnemonics[a] << " " << mnemonics[b]
+       << "\", \"count\": " << profile->pairs[a][b] << "}";
+    sep = ",\n  ";
+  }
+  os << "]}";
+}
+#endif
+
+mos6502::State mos6502::GetState() const {
+  State s;
+  s.A = A;
+  s.X = X;
+  s.Y = Y;
+  s.sp = sp;
+  s.status = GetStatus();
+  s.pc = pc;
+  s.cycles = cycles;
+  return s;
+}
+
+void mos6502::SetState(const State &s) {
+  A = s.A;
+  X = s.X;
+  Y = s.Y;
+  sp = s.sp;
+  SetStatus(s.status);
+  pc = s.pc;
+  cycles = s.cycles;
+  illegalOpcode = false;
+}
 } // namespace mos6502
@@ -8,11 +8,28 @@
 
 // Modified for use in OpenVTx
 
+#ifndef MOS6502_H
+#define MOS6502_H
+
 #include <iostream>
+#include <memory>
 #include <stdint.h>
+#include <string>
+#include <vector>
 using namespace std;
 namespace mos6502 {
 
+// How Run counts: one per instruction (as the VT168 CPU is clocked), or real
+// 6502 cycles including page crossing and branch penalties
+enum CycleMethod { INST_COUNT, CYCLE_COUNT };
+
+// Execution engines, which must all give the same results. Run uses the one
+// selected by mos6502::engine
+enum Engine { ENGINE_INTERP, ENGINE_FUSED, ENGINE_COUNT };
+const char *EngineName(Engine e);
+// Parse an engine name, returning false if not recognised
+bool ParseEngine(const string &name, Engine &e);
+
 class mos6502 {
 private:
   // registers
@@ -26,8 +43,22 @@ private:
   // program counter
   uint16_t pc;
 
-  // status register
+  // status register, except for N, V, Z and C which are evaluated lazily from
+  // the values that set them (see SET_NZ)
   uint8_t status;
+  uint8_t flagN, flagV, flagZ, flagC;
+
+  uint8_t GetStatus() const {
+    return (status & 0x3C) | (flagN & 0x80) | ((flagV & 0x80) >> 1) |
+           (flagZ ? 0 : 0x02) | flagC;
+  }
+  void SetStatus(uint8_t p) {
+    status = p;
+    flagN = p;
+    flagV = p << 1;
+    flagZ = ~p & 0x02;
+    flagC = p & 0x01;
+  }
 
   // consumed clock cycles
   uint32_t cycles;
@@ -38,6 +69,10 @@ private:
   struct Instr {
     AddrExec addr;
     CodeExec code;
+    // base cycle count, plus one if pagePenalty and the indexed address
+    // crosses a page
+    uint8_t cycles;
+    bool pagePenalty;
   };
 
   Instr InstrTable[256];
@@ -46,6 +81,10 @@ private:
 
   bool illegalOpcode;
 
+  // Set by the addressing modes and branches, for CYCLE_COUNT
+  bool crossed;
+  uint8_t branchCycles;
+
   // addressing modes
   uint16_t Addr_ACC(); // ACCUMULATOR
   uint16_t Addr_IMM(); // IMMEDIATE
@@ -135,12 +174,69 @@ private:
 
   void Op_ILLEGAL(uint16_t src);
 
+  inline void Branch(uint16_t src);
+
+  template <bool Scramble, CycleMethod Method> uint32_t RunEngine(uint32_t n);
+  template <bool Scramble> inline uint8_t Fetch();
+  // Count an instruction that has just run
+  template <CycleMethod Method>
+  inline void Retire(uint8_t opcode, const Instr &i);
+  // Run an instruction through the instruction table
+  template <CycleMethod Method> inline void RunDecoded(uint8_t opcode);
+  // Run an instruction with its handlers known at compile time
+  template <CycleMethod Method, AddrExec Addr, CodeExec Code>
+  inline void RunFixed(uint8_t opcode);
+
+  // Fused sequences, starting with the given opcode
+  template <bool Scramble, CycleMethod Method, AddrExec Addr>
+  void FuseLoad(uint8_t opcode);
+  template <bool Scramble, CycleMethod Method, AddrExec Addr>
+  void FuseCompare(uint8_t opcode);
+  template <bool Scramble, CycleMethod Method, CodeExec Code>
+  void FuseDecrement(uint8_t opcode);
+
   // read/write callbacks
   typedef void (*BusWrite)(uint16_t, uint8_t);
   typedef uint8_t (*BusRead)(uint16_t);
   BusRead Read;
   BusWrite Write;
 
+  // Direct pointers to the zero page and the stack page, when the bus maps
+  // them to plain RAM, so that accesses to them skip the callbacks
+  uint8_t *zeroPage = nullptr;
+  uint8_t *stackPage = nullptr;
+
+  // Operand accesses, which may be to the zero page
+  uint8_t ReadData(uint16_t addr) {
+    return (addr < 0x100 && zeroPage) ? zeroPage[addr] : Read(addr);
+  }
+  void WriteData(uint16_t addr, uint8_t data) {
+    if (addr < 0x100 && zeroPage)
+      zeroPage[addr] = data;
+    else
+      Write(addr, data);
+  }
+  uint8_t ReadZero(uint8_t addr) {
+    return zeroPage ? zeroPage[addr] : Read(addr);
+  }
+
+#ifdef OPENVTX_PROFILE
+  // Instruction mix counters, in builds made with PROFILE=1
+  struct Profile {
+    uint64_t count[256];
+    uint64_t cycles[256];
+    // Indexed by opcode then the opcode that followed it
+    uint64_t pairs[256][256];
+  };
+  unique_ptr<Profile> profile;
+  int lastOpcode;
+  void Count(uint8_t opcode, const Instr &i);
+  int ModeIndex(uint8_t opcode) const;
+  void ModeTotals(uint64_t *count, uint64_t *cycles) const;
+  // The n most common opcode pairs, as first << 8 | second
+  vector<uint16_t> TopPairs(int n) const;
+#endif
+
   // stack operations
   inline void StackPush(uint8_t byte);
   inline uint8_t StackPop();
@@ -150,7 +246,18 @@ public:
   void NMI();
   void IRQ(uint16_t vectorH, uint16_t vectorL);
   void Reset();
-  void Run(uint32_t n);
+  // Run for at least n counts of cycleMethod with the selected engine,
+  // returning the count actually run
+  uint32_t Run(uint32_t n);
+  // Run the interpreter with scrambling and cycle counting fixed at compile
+  // time, for per-platform hot loops
+  template <bool Scramble, CycleMethod Method = INST_COUNT>
+  uint32_t RunT(uint32_t n);
+  // The same for the fused engine, which runs fused sequences of up to
+  // FusedMax instructions as a whole, so can run past n
+  template <bool Scramble, CycleMethod Method = INST_COUNT>
+  uint32_t RunFusedT(uint32_t n);
+  static const uint32_t FusedMax = 3;
 
   // reset, NMI vectors
   uint16_t brkVectorH = 0xFFFF;
@@ -161,8 +268,61 @@ public:
   uint16_t nmiVectorL = 0xFFFA;
 
   uint16_t GetPC();
+  // Counts of cycleMethod run so far
+  uint32_t GetCycles() const { return cycles; }
+
+  // Replace the bus callbacks, for tools that watch the CPU's accesses. This
+  // drops any direct pages, so that every access goes through the callbacks
+  void SetBus(BusRead r, BusWrite w) {
+    Read = r;
+    Write = w;
+    zeroPage = stackPage = nullptr;
+  }
+
+  // Access the zero page and the stack page (0x0000..0x01FF) through these
+  // pointers rather than the bus callbacks. The callbacks must have no side
+  // effects for those addresses. nullptr goes back to the callbacks
+  void SetDirectPages(uint8_t *zp, uint8_t *stack) {
+    zeroPage = zp;
+    stackPage = stack;
+  }
+
+  // Register state, for tests and tools
+  struct State {
+    uint8_t A, X, Y, sp, status;
+    uint16_t pc;
+    uint32_t cycles;
+  };
+  State GetState() const;
+  void SetState(const State &s);
+
+  // True if Run stopped at an illegal opcode. SetState clears it, so saved
+  // states set it back after
+  bool IsHalted() const { return illegalOpcode; }
+  void SetHalted(bool halted) { illegalOpcode = halted; }
+
+#ifdef OPENVTX_PROFILE
+  // Write the instruction mix: per-opcode and per-addressing mode counts and
+  // cycles, and the top_pairs most common opcode pairs. The CSV rows have the
+  // columns cpu,kind,opcode,mnemonic,mode,count,cycles with kind one of
+  // opcode, mode or pair, and name in the cpu column
+  void WriteProfileCSV(ostream &os, const char *name, int top_pairs) const;
+  // The same as a JSON object
+  void WriteProfileJSON(ostream &os, int top_pairs) const;
+#endif
 
   // MiWi2 style scrambling
   bool scramble = false;
+
+  CycleMethod cycleMethod = INST_COUNT;
+
+  Engine engine = ENGINE_INTERP;
+
+  // Stop with an assertion on BRK or an illegal opcode, which VT168 code isn't
+  // expected to execute. If false, BRK executes normally and an illegal
+  // opcode just stops Run
+  bool assertOnTrap = true;
 };
 } // namespace mos6502
+
+#endif /* end of include guard: MOS6502_H */
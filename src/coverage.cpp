@@ -0,0 +1,150 @@
+#include "coverage.hpp"
+#include "vt168.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+namespace VTxx {
+
+// The whole external memory space
+static const uint32_t space_size = 32 * 1024 * 1024;
+static const uint32_t map_size = space_size / 8;
+static uint8_t maps[COVERAGE_KINDS][map_size];
+
+// Heatmap page counts, with writes after the coverage kinds
+static const int page_shift = 13;
+static const int n_pages = space_size >> page_shift;
+static const int heat_write = COVERAGE_KINDS;
+static uint64_t page_counts[COVERAGE_KINDS + 1][n_pages];
+static uint32_t bank_writes = 0;
+static vector<uint32_t> frame_bank_writes;
+
+static const char magic[8] = {'O', 'V', 'T', 'X', 'C', 'O', 'V', '1'};
+// Saved maps are a multiple of an 8KB page
+static const uint32_t page_bytes = 8192 / 8;
+
+// Add len bytes from pa to the page counts, split where they cross pages
+static void count(int kind, uint32_t pa, uint32_t len) {
+  uint32_t end = min(pa + len, space_size);
+  while (pa < end) {
+    uint32_t page_end = min(((pa >> page_shift) + 1) << page_shift, end);
+    page_counts[kind][pa >> page_shift] += page_end - pa;
+    pa = page_end;
+  }
+}
+
+void coverage_mark(CoverageKind kind, uint32_t pa, uint32_t len) {
+  uint8_t *map = maps[kind];
+  count(kind, pa, len);
+  for (uint32_t end = min(pa + len, space_size); pa < end; pa++)
+    map[pa >> 3] |= (1 << (pa & 7));
+}
+
+void coverage_cpu_read(uint16_t addr, uint32_t pa) {
+  bool fetch = (addr == uint16_t(vt168_cpu().GetPC() - 1));
+  coverage_mark(fetch ? COVERAGE_EXEC : COVERAGE_DATA, pa);
+}
+
+bool coverage_test(CoverageKind kind, uint32_t pa) {
+  return pa < space_size && ((maps[kind][pa >> 3] >> (pa & 7)) & 1);
+}
+
+void coverage_clear() {
+  memset(maps, 0, sizeof(maps));
+  memset(page_counts, 0, sizeof(page_counts));
+  bank_writes = 0;
+  frame_bank_writes.clear();
+}
+
+void coverage_write(uint32_t pa, uint32_t len) { count(heat_write, pa, len); }
+
+void coverage_bank_write() { bank_writes++; }
+
+void coverage_frame() {
+  frame_bank_writes.push_back(bank_writes);
+  bank_writes = 0;
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static void write_le32(ostream &os, uint32_t x) {
+  uint8_t b[4] = {uint8_t(x), uint8_t(x >> 8), uint8_t(x >> 16),
+                  uint8_t(x >> 24)};
+  os.write(reinterpret_cast<char *>(b), 4);
+}
+
+bool coverage_load(const string &filename) {
+  ifstream in(filename, ios::binary);
+  uint8_t header[16];
+  if (!in.read(reinterpret_cast<char *>(header), 16) ||
+      memcmp(header, magic, 8) != 0)
+    return false;
+  uint32_t kinds = read_le32(header + 8), size = read_le32(header + 12);
+  // Maps are never bigger than the space, and kinds are only ever added a few
+  // at a time
+  if (size > map_size || kinds > 2 * COVERAGE_KINDS)
+    return false;
+  // Merge nothing until the whole file has been read. Maps added since the
+  // file was written are left as they are, and ones this build doesn't know
+  // are skipped
+  uint32_t known = min(kinds, uint32_t(COVERAGE_KINDS));
+  vector<uint8_t> buf(size_t(known) * size);
+  if (!in.read(reinterpret_cast<char *>(buf.data()), buf.size()))
+    return false;
+  for (uint32_t k = known; k < kinds; k++)
+    if (!in.ignore(size) || in.gcount() != streamsize(size))
+      return false;
+  for (uint32_t k = 0; k < known; k++) {
+    const uint8_t *map = buf.data() + size_t(k) * size;
+    for (uint32_t i = 0; i < size; i++)
+      maps[k][i] |= map[i];
+  }
+  return true;
+}
+
+bool coverage_save(const string &filename) {
+  uint32_t size = 0;
+  for (int k = 0; k < COVERAGE_KINDS; k++) {
+    uint32_t last = map_size;
+    while (last > size && maps[k][last - 1] == 0)
+      last--;
+    size = max(size, last);
+  }
+  size = (size + page_bytes - 1) / page_bytes * page_bytes;
+  ofstream out(filename, ios::binary);
+  out.write(magic, 8);
+  write_le32(out, COVERAGE_KINDS);
+  write_le32(out, size);
+  for (int k = 0; k < COVERAGE_KINDS; k++)
+    out.write(reinterpret_cast<const char *>(maps[k]), size);
+  return bool(out);
+}
+
+bool coverage_save_heatmap(const string &filename) {
+  ofstream out(filename);
+  out << "page,address,exec,data,tile,dma,write" << endl;
+  for (int pg = 0; pg < n_pages; pg++) {
+    bool any = false;
+    for (int k = 0; k <= heat_write; k++)
+      any |= (page_counts[k][pg] != 0);
+    if (!any)
+      continue;
+    out << pg << ",0x" << hex << (uint32_t(pg) << page_shift) << dec;
+    for (int k = 0; k <= heat_write; k++)
+      out << "," << page_counts[k][pg];
+    out << "\n";
+  }
+  return bool(out);
+}
+
+bool coverage_save_bank_writes(const string &filename) {
+  ofstream out(filename);
+  out << "frame,bank_writes" << endl;
+  for (size_t i = 0; i < frame_bank_writes.size(); i++)
+    out << i << "," << frame_bank_writes[i] << "\n";
+  return bool(out);
+}
+} // namespace VTxx
@@ -0,0 +1,56 @@
+#ifndef COVERAGE_H
+#define COVERAGE_H
+#include <cstdint>
+#include <string>
+using namespace std;
+
+namespace VTxx {
+// Physical memory coverage: a bit per byte for each kind of access, recorded
+// in builds made with COVERAGE=1. EXEC is opcodes and operands the main CPU
+// fetched, DATA other main CPU reads, TILE character data read by the PPU and
+// DMA the sources of external memory DMA
+enum CoverageKind {
+  COVERAGE_EXEC,
+  COVERAGE_DATA,
+  COVERAGE_TILE,
+  COVERAGE_DMA,
+  COVERAGE_KINDS
+};
+
+// Mark len bytes from physical address pa. TILE is only marked by the render
+// thread and the others by the emulation thread, so they don't share a map
+void coverage_mark(CoverageKind kind, uint32_t pa, uint32_t len = 1);
+// A main CPU read of external memory at virtual address addr, physical
+// address pa. It is a fetch if it is the byte before the CPU's PC, as the CPU
+// moves PC past each opcode and operand byte as it reads it
+void coverage_cpu_read(uint16_t addr, uint32_t pa);
+
+bool coverage_test(CoverageKind kind, uint32_t pa);
+void coverage_clear();
+
+// A heatmap of the same builds: bytes accessed per 8KB page of external
+// memory, for each coverage kind and for writes (by the CPU and DMA), and the
+// number of bank register writes in each frame
+void coverage_write(uint32_t pa, uint32_t len = 1);
+void coverage_bank_write();
+// Called at the start of each VBLANK, ending the frame's bank write count
+void coverage_frame();
+// Write the heatmap as CSV, a row for each page with any accesses with the
+// columns page,address,exec,data,tile,dma,write
+bool coverage_save_heatmap(const string &filename);
+// Write the bank register writes per frame as CSV, with the columns
+// frame,bank_writes
+bool coverage_save_bank_writes(const string &filename);
+
+// Merge a coverage file into the current maps, returning false, with the maps
+// as they were, if it can't be read or isn't one. Saving then gives the union
+// of the runs
+bool coverage_load(const string &filename);
+// Save the maps, up to the last 8KB page with anything covered. The file is
+// "OVTXCOV1", the number of maps and the bytes per map (both 32-bit little
+// endian), then the maps in CoverageKind order, bit n of byte i for physical
+// address 8 * i + n
+bool coverage_save(const string &filename);
+} // namespace VTxx
+
+#endif /* end of include guard: COVERAGE_H */
@@ -0,0 +1,377 @@
+#include "debug.hpp"
+#include "mmu.hpp"
+#include "platform.hpp"
+#include "ppu.hpp"
+#include "scpu_mem.hpp"
+#include "vt168.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace VTxx {
+
+typedef VT168Traits Map;
+
+static vector<DebugPoint> points;
+static int next_id = 1;
+
+// Per-CPU state
+struct CPUDebug {
+  // The access kinds of the points in each 256 byte page of the CPU's space.
+  // These reject almost all accesses with one lookup
+  uint8_t pages[256];
+  // PC of the instruction being run
+  uint16_t pc;
+  // Set on resume from a breakpoint, so that it doesn't hit again straight
+  // away
+  bool skip_exec;
+  // Pause after the next instruction
+  bool step;
+};
+static CPUDebug dbg[2];
+
+// The same for the physical space, in 64KB pages, and for all of VRAM and
+// SPRAM
+static uint8_t phys_pages[512];
+static uint8_t phys_any, vram_any, spram_any;
+
+static bool hit_pending = false;
+static DebugHit last_hit;
+
+static void hit(DebugCPU cpu, uint8_t access, uint32_t addr, uint8_t data) {
+  last_hit.access = access;
+  last_hit.addr = addr;
+  last_hit.data = data;
+  last_hit.cpu = cpu;
+  last_hit.pc = dbg[int(cpu)].pc;
+  last_hit.clock = cpu_clock;
+  hit_pending = true;
+  vt168_request_pause();
+}
+
+static void check(DebugCPU cpu, DebugSpace space, uint32_t addr, uint8_t data,
+                  uint8_t access) {
+  if (hit_pending)
+    return;
+  for (const DebugPoint &p : points) {
+    if (p.space == space && (p.access & access) && addr >= p.start &&
+        addr <= p.end) {
+      last_hit.point = p;
+      hit(cpu, access, addr, data);
+      return;
+    }
+  }
+}
+
+static void check_bus(uint16_t addr, uint8_t data, uint8_t access) {
+  const DebugCPU c = DebugCPU::MAIN;
+  if (dbg[0].pages[addr >> 8] & access)
+    check(c, DebugSpace::CPU, addr, data, access);
+  if ((phys_any & access) && addr >= Map::rom_base) {
+    uint32_t pa = decode_address(addr);
+    if (phys_pages[(pa >> 16) & 0x1FF] & access)
+      check(c, DebugSpace::PHYSICAL, pa, data, access);
+  }
+  // The data ports, before a write moves them on
+  if ((vram_any & access) && addr == Map::ppu_base + 0x07)
+    check(c, DebugSpace::VRAM, ppu_vram_addr(), data, access);
+  if ((spram_any & access) && addr == Map::ppu_base + 0x04)
+    check(c, DebugSpace::SPRAM, ppu_spram_addr(), data, access);
+}
+
+static uint8_t debug_read(uint16_t addr) {
+  uint8_t data = vt168_platform().cpu_read(addr);
+  check_bus(addr, data, DEBUG_READ);
+  return data;
+}
+
+static void debug_write(uint16_t addr, uint8_t data) {
+  check_bus(addr, data, DEBUG_WRITE);
+  vt168_platform().cpu_write(addr, data);
+}
+
+static uint8_t debug_scpu_read(uint16_t addr) {
+  uint8_t data = vt168_platform().scpu_read(addr);
+  if (dbg[1].pages[addr >> 8] & DEBUG_READ)
+    check(DebugCPU::SCPU, DebugSpace::SCPU, addr, data, DEBUG_READ);
+  return data;
+}
+
+static void debug_scpu_write(uint16_t addr, uint8_t data) {
+  if (dbg[1].pages[addr >> 8] & DEBUG_WRITE)
+    check(DebugCPU::SCPU, DebugSpace::SCPU, addr, data, DEBUG_WRITE);
+  vt168_platform().scpu_write(addr, data);
+}
+
+static void check_exec(DebugCPU cpu, uint16_t pc) {
+  if (cpu == DebugCPU::SCPU) {
+    if (dbg[1].pages[pc >> 8] & DEBUG_EXEC)
+      check(cpu, DebugSpace::SCPU, pc, debug_peek(DebugSpace::SCPU, pc),
+            DEBUG_EXEC);
+    return;
+  }
+  if (dbg[0].pages[pc >> 8] & DEBUG_EXEC)
+    check(cpu, DebugSpace::CPU, pc, debug_peek(DebugSpace::CPU, pc),
+          DEBUG_EXEC);
+  if ((phys_any & DEBUG_EXEC) && pc >= Map::rom_base) {
+    uint32_t pa = decode_address(pc);
+    if (phys_pages[(pa >> 16) & 0x1FF] & DEBUG_EXEC)
+      check(cpu, DebugSpace::PHYSICAL, pa, read_mem_physical(pa), DEBUG_EXEC);
+  }
+}
+
+template <DebugCPU C> static uint32_t debug_step(mos6502::mos6502 &cpu) {
+  CPUDebug &d = dbg[int(C)];
+  d.pc = cpu.GetPC();
+  if (!d.skip_exec)
+    check_exec(C, d.pc);
+  // Stop before the instruction, which then runs in the same clock on resume
+  if (hit_pending)
+    return 0;
+  d.skip_exec = false;
+  // Always one interpreted instruction, as the fused engine would run a whole
+  // sequence without checking the instructions after the first
+  uint32_t ran = cpu.scramble ? cpu.RunT<true>(1) : cpu.RunT<false>(1);
+  if (d.step) {
+    d.step = false;
+    last_hit.point = DebugPoint();
+    hit(C, DEBUG_STEP, cpu.GetPC(), 0);
+  }
+  return ran;
+}
+
+// Rebuild the page flags, and install or remove the checks
+static void update() {
+  for (CPUDebug &d : dbg)
+    fill(d.pages, d.pages + 256, 0);
+  fill(phys_pages, phys_pages + 512, 0);
+  phys_any = vram_any = spram_any = 0;
+  // Access kinds used by each CPU's points
+  uint8_t used[2] = {0, 0};
+  for (const DebugPoint &p : points) {
+    switch (p.space) {
+    case DebugSpace::CPU:
+    case DebugSpace::SCPU: {
+      uint8_t *pages = dbg[p.space == DebugSpace::SCPU].pages;
+      for (uint32_t pg = p.start >> 8; pg <= (p.end >> 8) && pg < 256; pg++)
+        pages[pg] |= p.access;
+      break;
+    }
+    case DebugSpace::PHYSICAL:
+      for (uint32_t pg = p.start >> 16; pg <= (p.end >> 16) && pg < 512; pg++)
+        phys_pages[pg] |= p.access;
+      phys_any |= p.access;
+      break;
+    case DebugSpace::VRAM:
+      vram_any |= p.access;
+      break;
+    case DebugSpace::SPRAM:
+      spram_any |= p.access;
+      break;
+    }
+    used[p.space == DebugSpace::SCPU] |= p.access;
+  }
+
+  bool main_on = used[0] != 0 || dbg[0].step;
+  bool scpu_on = used[1] != 0 || dbg[1].step;
+  vt168_set_cpu_step(main_on ? debug_step<DebugCPU::MAIN> : nullptr);
+  vt168_set_scpu_step(scpu_on ? debug_step<DebugCPU::SCPU> : nullptr);
+  // Execution breakpoints alone don't need the bus handlers, so keep the
+  // direct zero page and stack if possible
+  if (used[0] & (DEBUG_READ | DEBUG_WRITE))
+    vt168_set_cpu_bus(debug_read, debug_write);
+  else
+    vt168_set_cpu_bus(nullptr, nullptr);
+  if (used[1] & (DEBUG_READ | DEBUG_WRITE))
+    vt168_set_scpu_bus(debug_scpu_read, debug_scpu_write);
+  else
+    vt168_set_scpu_bus(nullptr, nullptr);
+}
+
+int debug_add(DebugSpace space, uint32_t start, uint32_t end, uint8_t access) {
+  DebugPoint p;
+  p.id = next_id++;
+  p.space = space;
+  p.start = start;
+  p.end = max(start, end);
+  p.access = access;
+  points.push_back(p);
+  update();
+  return p.id;
+}
+
+bool debug_remove(int id) {
+  for (auto it = points.begin(); it != points.end(); ++it) {
+    if (it->id == id) {
+      points.erase(it);
+      update();
+      return true;
+    }
+  }
+  return false;
+}
+
+void debug_clear() {
+  points.clear();
+  for (CPUDebug &d : dbg)
+    d.step = false;
+  update();
+}
+
+const vector<DebugPoint> &debug_points() { return points; }
+
+bool debug_last_hit(DebugHit &hit) {
+  if (hit_pending)
+    hit = last_hit;
+  return hit_pending;
+}
+
+void debug_resume() {
+  if (hit_pending && last_hit.access == DEBUG_EXEC)
+    dbg[int(last_hit.cpu)].skip_exec = true;
+  hit_pending = false;
+  // Drop the hooks for a step that has finished
+  update();
+  vt168_resume();
+}
+
+void debug_step(DebugCPU cpu) {
+  dbg[int(cpu)].step = true;
+  debug_resume();
+}
+
+uint8_t debug_peek(DebugSpace space, uint32_t addr) {
+  switch (space) {
+  case DebugSpace::CPU:
+    addr &= 0xFFFF;
+    if (addr < Map::ram_end)
+      return cpu_ram[addr];
+    else if (addr >= Map::rom_base)
+      return read_mem_physical(decode_address(addr));
+    else if (addr >= Map::ppu_base && addr < Map::sys_base)
+      return ppu_peek_reg(addr & 0xFF);
+    else if (addr >= Map::sys_base && addr < Map::sys_base + 0x100)
+      return control_reg[addr & 0xFF];
+    return 0xFF;
+  case DebugSpace::PHYSICAL:
+    return read_mem_physical(addr & 0x1FFFFFF);
+  case DebugSpace::VRAM:
+    return ppu_peek_vram(addr);
+  case DebugSpace::SPRAM:
+    return ppu_peek_spram(addr);
+  case DebugSpace::SCPU:
+    addr &= 0xFFFF;
+    if (addr < Map::scpu_ram_end)
+      return cpu_ram[Map::scpu_ram_window |
+                     (addr & (Map::scpu_ram_window - 1))];
+    else if (addr >= Map::sys_base && addr < Map::sys_base + 0x100)
+      return scpu_control_reg[addr & 0xFF];
+    return 0xFF;
+  }
+  return 0xFF;
+}
+
+static const char *const space_names[] = {"cpu", "phys", "vram", "spram",
+                                          "scpu"};
+
+bool parse_debug_point(const string &str, uint8_t default_access,
+                       DebugPoint &point) {
+  string s = str;
+  point.id = 0;
+  point.space = DebugSpace::CPU;
+  for (int i = 0; i < 5; i++) {
+    string prefix = string(space_names[i]) + ":";
+    if (s.substr(0, prefix.size()) == prefix) {
+      point.space = DebugSpace(i);
+      s = s.substr(prefix.size());
+      break;
+    }
+  }
+
+  point.access = default_access;
+  size_t colon = s.find(':');
+  if (colon != string::npos) {
+    point.access = 0;
+    for (char c : s.substr(colon + 1)) {
+      if (c == 'r')
+        point.access |= DEBUG_READ;
+      else if (c == 'w')
+        point.access |= DEBUG_WRITE;
+      else if (c == 'x')
+        point.access |= DEBUG_EXEC;
+      else
+        return false;
+    }
+    s = s.substr(0, colon);
+  }
+  if (point.access == 0)
+    return false;
+  if ((point.access & DEBUG_EXEC) &&
+      (point.space == DebugSpace::VRAM || point.space == DebugSpace::SPRAM))
+    return false;
+
+  size_t dash = s.find('-');
+  string start = s.substr(0, dash);
+  string end = (dash == string::npos) ? start : s.substr(dash + 1);
+  char *p1, *p2;
+  point.start = strtoul(start.c_str(), &p1, 16);
+  point.end = strtoul(end.c_str(), &p2, 16);
+  return !start.empty() && !end.empty() && *p1 == '\0' && *p2 == '\0' &&
+         point.end >= point.start;
+}
+
+static void print_hex(ostream &os, unsigned x, int w) {
+  char buf[12];
+  snprintf(buf, sizeof(buf), "%0*X", w, x);
+  os << buf;
+}
+
+static void print_cpu(ostream &os, const char *name, mos6502::mos6502 &cpu,
+                      bool banked) {
+  mos6502::mos6502::State s = cpu.GetState();
+  os << name << " PC=";
+  print_hex(os, s.pc, 4);
+  if (banked && s.pc >= Map::rom_base) {
+    os << " (";
+    print_hex(os, decode_address(s.pc), 6);
+    os << ")";
+  }
+  os << " A=";
+  print_hex(os, s.A, 2);
+  os << " X=";
+  print_hex(os, s.X, 2);
+  os << " Y=";
+  print_hex(os, s.Y, 2);
+  os << " S=";
+  print_hex(os, s.sp, 2);
+  os << " P=";
+  print_hex(os, s.status, 2);
+  os << endl;
+}
+
+void debug_print_state(ostream &os) {
+  print_cpu(os, "cpu: ", vt168_cpu(), true);
+  print_cpu(os, "scpu:", vt168_scpu(), false);
+  os << "clock=" << cpu_clock << endl;
+  if (!hit_pending)
+    return;
+  const DebugHit &h = last_hit;
+  const char *cpu_name = (h.cpu == DebugCPU::SCPU) ? "scpu" : "cpu";
+  if (h.access == DEBUG_STEP) {
+    os << "stepped " << cpu_name << " from PC=";
+    print_hex(os, h.pc, 4);
+    os << endl;
+    return;
+  }
+  os << "hit #" << h.point.id << ": "
+     << (h.access == DEBUG_EXEC ? "exec"
+                                : (h.access == DEBUG_READ ? "read" : "write"))
+     << " " << space_names[int(h.point.space)] << ":";
+  print_hex(os, h.addr, 4);
+  os << "=";
+  print_hex(os, h.data, 2);
+  os << " by " << cpu_name << " PC=";
+  print_hex(os, h.pc, 4);
+  os << endl;
+}
+} // namespace VTxx
@@ -0,0 +1,83 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+// Breakpoints, watchpoints and single stepping. With none set, the emulator
+// runs exactly as it does without them: the checks are in a CPU step function
+// and bus handlers which are only installed while there are points to check.
+// A hit pauses the scheduler once the current tick is done (see
+// vt168_paused), debug_resume continues
+
+// Address spaces. CPU is the main CPU's view, including the PPU and system
+// registers at 0x2000..0x21FF. PHYSICAL is external memory, as seen through
+// the CPU's banked window. SCPU is the SCPU's view
+enum class DebugSpace { CPU, PHYSICAL, VRAM, SPRAM, SCPU };
+
+enum class DebugCPU { MAIN, SCPU };
+
+// Access kinds, a mask of these. DEBUG_STEP is only used for hits, at the end
+// of a single step
+const uint8_t DEBUG_EXEC = 0x01;
+const uint8_t DEBUG_READ = 0x02;
+const uint8_t DEBUG_WRITE = 0x04;
+const uint8_t DEBUG_STEP = 0x08;
+
+struct DebugPoint {
+  int id;
+  DebugSpace space;
+  // Inclusive address range
+  uint32_t start, end;
+  uint8_t access;
+};
+
+struct DebugHit {
+  // Not set for a step
+  DebugPoint point;
+  // The access that hit, and its address in point.space. For execution
+  // breakpoints data is the opcode. For a step, addr is the new PC
+  uint8_t access;
+  uint32_t addr;
+  uint8_t data;
+  // The CPU making the access, and the PC of its instruction
+  DebugCPU cpu;
+  uint16_t pc;
+  uint64_t clock;
+};
+
+// Add a point, returning its id. Points are added after vt168_init. VRAM and
+// SPRAM points can't be execution breakpoints
+int debug_add(DebugSpace space, uint32_t start, uint32_t end, uint8_t access);
+// Remove a point, returning false if there is none with that id
+bool debug_remove(int id);
+void debug_clear();
+const vector<DebugPoint> &debug_points();
+
+// The hit that caused the current pause, returning false if there is none
+// (the pause was requested some other way)
+bool debug_last_hit(DebugHit &hit);
+// Continue after a pause. An execution breakpoint at the current PC doesn't
+// hit again until another instruction has run
+void debug_resume();
+// Continue for one instruction of cpu, then pause. If the SCPU is stopped
+// this doesn't pause until it is started
+void debug_step(DebugCPU cpu);
+
+// Read memory without side effects
+uint8_t debug_peek(DebugSpace space, uint32_t addr);
+
+// Parse a point given as [space:]start[-end][:access], where space is cpu
+// (the default), phys, vram, spram or scpu, the addresses are hex and access
+// is any of r, w and x. The default access is used if none is given
+bool parse_debug_point(const string &str, uint8_t default_access,
+                       DebugPoint &point);
+
+// Print the state of both CPUs and the hit, if any
+void debug_print_state(ostream &os);
+} // namespace VTxx
+
+#endif /* end of include guard: DEBUG_H */
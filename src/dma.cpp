@@ -1,5 +1,7 @@
 #include "dma.hpp"
+#include "coverage.hpp"
 #include "mmu.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include <cassert>
 #include <iostream>
@@ -54,6 +56,16 @@ void DMACtrl::do_xfer() {
     len = 512;
   if (vram_dest)
     cout << "VDMA " << len << " " << get_dst_addr() << endl;
+  if (trace_on)
+    trace_begin(TraceThread::MAIN, "DMA", cpu_clock,
+                "\"src\": " + trace_hex(srcaddr_c) + ", \"dst\": " +
+                    trace_hex(dstaddr_c) + ", \"len\": " + to_string(len));
+#ifdef OPENVTX_COVERAGE
+  if (is_extsrc)
+    coverage_mark(COVERAGE_DMA, srcaddr_c, len);
+  if (is_extdst)
+    coverage_write(dstaddr_c, len);
+#endif
   for (int i = 0; i < len; i++) {
     uint8_t dat =
         is_extsrc ? read_mem_physical(srcaddr_c) : cpu_ram[srcaddr_c & 0x1FFF];
@@ -68,6 +80,13 @@ void DMACtrl::do_xfer() {
       dstaddr_c++;
     srcaddr_c++;
   }
+  if (trace_on)
+    trace_end(TraceThread::MAIN, "DMA", cpu_clock);
+}
+
+void DMACtrl::state(StateIO &io) {
+  io.pod(waiting_vblank);
+  io.bytes(dma_regs, sizeof(dma_regs));
 }
 
 void DMACtrl::vblank_notify() {
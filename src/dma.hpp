@@ -1,5 +1,6 @@
 #ifndef DMA_HPP
 #define DMA_HPP
+#include "state.hpp"
 #include <cstdint>
 using namespace std;
 namespace VTxx {
@@ -12,6 +13,7 @@ public:
   uint8_t read(uint8_t addr);
 
   void vblank_notify(); // notify the DMA engine of the start of VBLANK
+  void state(StateIO &io);
 
 private:
   bool waiting_vblank = false;
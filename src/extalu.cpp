@@ -30,6 +30,13 @@ uint8_t ExtALU::read(uint8_t addr) {
   return result[addr_ofs];
 }
 
+void ExtALU::state(StateIO &io) {
+  io.bytes(operand, sizeof(operand));
+  io.bytes(mul_operand, sizeof(mul_operand));
+  io.bytes(div_operand, sizeof(div_operand));
+  io.bytes(result, sizeof(result));
+}
+
 void ExtALU::do_mul() {
   uint32_t op1 = (mul_operand[1] << 8UL) | (mul_operand[0]);
   uint32_t op2 = (operand[1] << 8UL) | (operand[0]);
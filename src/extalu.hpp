@@ -1,6 +1,7 @@
 #ifndef EXTALU_H
 #define EXTALU_H
 
+#include "state.hpp"
 #include <cstdint>
 using namespace std;
 
@@ -16,6 +17,7 @@ public:
   void write(uint8_t addr,
              uint8_t data); // address is 0..F  , relative to 0x2130
   uint8_t read(uint8_t addr);
+  void state(StateIO &io);
 
 private:
   void do_mul();
@@ -0,0 +1,510 @@
+#include "gdbstub.hpp"
+#include "debug.hpp"
+#include "platform.hpp"
+#include "vt168.hpp"
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+namespace VTxx {
+
+static int listen_fd = -1, client_fd = -1;
+// Connections are accepted by a thread, so that polling for one each frame
+// is only a load. new_fd holds one until gdb_poll takes it, and the thread
+// waits while conn_busy for that debugger to go before accepting another
+static atomic<int> new_fd(-1);
+static mutex conn_m;
+static condition_variable conn_cv;
+static bool conn_busy = false;
+static bool no_ack = false;
+// Set when the debugger continues or steps, as a stop reply is then owed
+static bool running = false;
+// Thread for register and memory accesses and breakpoints (Hg), and to step
+// (Hc, 0 for the same as Hg)
+static DebugCPU cur_thread = DebugCPU::MAIN;
+static int step_thread = 0;
+// Points set by Z packets, by space and the packet's type, address and kind
+static map<string, int> z_points;
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<feature name=\"org.openvtx.6502\">"
+    "<reg name=\"a\" bitsize=\"8\" regnum=\"0\"/>"
+    "<reg name=\"x\" bitsize=\"8\"/>"
+    "<reg name=\"y\" bitsize=\"8\"/>"
+    "<reg name=\"s\" bitsize=\"8\"/>"
+    "<reg name=\"p\" bitsize=\"8\"/>"
+    "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+    "</feature>"
+    "</target>";
+
+static const int n_regs = 6;
+
+static mos6502::mos6502 &thread_cpu(DebugCPU t) {
+  return (t == DebugCPU::SCPU) ? vt168_scpu() : vt168_cpu();
+}
+
+static DebugSpace thread_space(DebugCPU t) {
+  return (t == DebugCPU::SCPU) ? DebugSpace::SCPU : DebugSpace::CPU;
+}
+
+static int thread_id(DebugCPU t) { return (t == DebugCPU::SCPU) ? 2 : 1; }
+
+static string hex_byte(uint8_t x) {
+  static const char digits[] = "0123456789abcdef";
+  return string(1, digits[x >> 4]) + digits[x & 0xF];
+}
+
+static string hex_num(uint32_t x) {
+  char buf[12];
+  snprintf(buf, sizeof(buf), "%x", x);
+  return buf;
+}
+
+static int hex_digit(int c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Parse hex bytes, returning false if str isn't
+static bool parse_bytes(const string &str, string &bytes) {
+  if (str.size() % 2 != 0)
+    return false;
+  bytes.clear();
+  for (size_t i = 0; i < str.size(); i += 2) {
+    int h = hex_digit(str[i]), l = hex_digit(str[i + 1]);
+    if (h < 0 || l < 0)
+      return false;
+    bytes += char(h << 4 | l);
+  }
+  return true;
+}
+
+static void close_client() {
+  if (client_fd >= 0)
+    close(client_fd);
+  client_fd = -1;
+  no_ack = false;
+  running = false;
+  z_points.clear();
+  debug_clear();
+  {
+    lock_guard<mutex> lk(conn_m);
+    conn_busy = false;
+  }
+  conn_cv.notify_one();
+}
+
+static void accept_loop() {
+  while (true) {
+    {
+      unique_lock<mutex> lk(conn_m);
+      conn_cv.wait(lk, [] { return !conn_busy; });
+    }
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+    {
+      lock_guard<mutex> lk(conn_m);
+      conn_busy = true;
+    }
+    new_fd.store(fd, memory_order_release);
+  }
+}
+
+bool gdb_listen(const string &addr) {
+  if (addr.substr(0, 5) == "unix:") {
+    string path = addr.substr(5);
+    sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(sa.sun_path))
+      return false;
+    strcpy(sa.sun_path, path.c_str());
+    unlink(path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&sa, sizeof(sa)) != 0)
+      return false;
+  } else {
+    char *end;
+    long port = strtol(addr.c_str(), &end, 10);
+    if (addr.empty() || *end != '\0' || port <= 0 || port > 65535)
+      return false;
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (listen_fd < 0)
+      return false;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (sockaddr *)&sa, sizeof(sa)) != 0)
+      return false;
+  }
+  if (listen(listen_fd, 1) != 0)
+    return false;
+  thread(accept_loop).detach();
+  return true;
+}
+
+void gdb_poll() {
+  if (client_fd < 0) {
+    if (new_fd.load(memory_order_acquire) < 0)
+      return;
+    client_fd = new_fd.exchange(-1);
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    cur_thread = DebugCPU::MAIN;
+    step_thread = 0;
+    // The debugger expects the target to be stopped, and asks why with ?
+    vt168_request_pause();
+    return;
+  }
+  // Anything but an interrupt (ctrl-C) while running is a stray ack
+  uint8_t c;
+  ssize_t n;
+  while ((n = recv(client_fd, &c, 1, MSG_DONTWAIT)) == 1) {
+    if (c == 0x03)
+      vt168_request_pause();
+  }
+  if (n == 0)
+    close_client();
+}
+
+bool gdb_attached() { return client_fd >= 0; }
+
+static int read_byte() {
+  uint8_t c;
+  return (recv(client_fd, &c, 1, 0) == 1) ? c : -1;
+}
+
+// Read a packet, returning false if the connection is closed
+static bool get_packet(string &pkt) {
+  while (true) {
+    int c;
+    // Skip acks and interrupts, which mean nothing while stopped
+    do {
+      c = read_byte();
+      if (c < 0)
+        return false;
+    } while (c != '$');
+    pkt.clear();
+    uint8_t sum = 0;
+    while ((c = read_byte()) != '#') {
+      if (c < 0)
+        return false;
+      pkt += char(c);
+      sum += c;
+    }
+    int h = hex_digit(read_byte()), l = hex_digit(read_byte());
+    bool ok = (h >= 0 && l >= 0 && (h << 4 | l) == sum);
+    if (!no_ack)
+      send(client_fd, ok ? "+" : "-", 1, MSG_NOSIGNAL);
+    if (ok)
+      return true;
+  }
+}
+
+static void put_packet(const string &data) {
+  uint8_t sum = 0;
+  for (char c : data)
+    sum += c;
+  string out = "$" + data + "#" + hex_byte(sum);
+  send(client_fd, out.data(), out.size(), MSG_NOSIGNAL);
+}
+
+static string stop_reply() {
+  DebugHit h;
+  if (!debug_last_hit(h))
+    return "T02thread:" + hex_num(thread_id(cur_thread)) + ";";
+  cur_thread = h.cpu;
+  string r = "T05";
+  if (h.access == DEBUG_READ || h.access == DEBUG_WRITE) {
+    if ((h.point.access & DEBUG_READ) && (h.point.access & DEBUG_WRITE))
+      r += "awatch:";
+    else
+      r += (h.access == DEBUG_READ) ? "rwatch:" : "watch:";
+    r += hex_num(h.addr) + ";";
+  }
+  return r + "thread:" + hex_num(thread_id(h.cpu)) + ";";
+}
+
+static uint8_t *reg_ptr(mos6502::mos6502::State &s, int n) {
+  uint8_t *regs[n_regs - 1] = {&s.A, &s.X, &s.Y, &s.sp, &s.status};
+  return regs[n];
+}
+
+static string read_reg(const mos6502::mos6502::State &s, int n) {
+  if (n == n_regs - 1)
+    return hex_byte(s.pc & 0xFF) + hex_byte(s.pc >> 8);
+  return hex_byte(*reg_ptr(const_cast<mos6502::mos6502::State &>(s), n));
+}
+
+// Set register n from its little-endian bytes
+static bool write_reg(mos6502::mos6502::State &s, int n, const string &v) {
+  if (n == n_regs - 1) {
+    if (v.size() != 2)
+      return false;
+    s.pc = uint8_t(v[0]) | uint8_t(v[1]) << 8;
+  } else {
+    if (v.size() != 1)
+      return false;
+    *reg_ptr(s, n) = v[0];
+  }
+  return true;
+}
+
+static string handle_regs(const string &pkt) {
+  mos6502::mos6502 &cpu = thread_cpu(cur_thread);
+  mos6502::mos6502::State s = cpu.GetState();
+  if (pkt[0] == 'g') {
+    string r;
+    for (int i = 0; i < n_regs; i++)
+      r += read_reg(s, i);
+    return r;
+  }
+  string bytes;
+  if (pkt[0] == 'G') {
+    if (!parse_bytes(pkt.substr(1), bytes) || bytes.size() != n_regs + 1)
+      return "E01";
+    for (int i = 0; i < n_regs - 1; i++)
+      write_reg(s, i, bytes.substr(i, 1));
+    write_reg(s, n_regs - 1, bytes.substr(n_regs - 1, 2));
+    cpu.SetState(s);
+    return "OK";
+  }
+  char *end;
+  int n = strtol(pkt.c_str() + 1, &end, 16);
+  if (n < 0 || n >= n_regs)
+    return "E01";
+  if (pkt[0] == 'p')
+    return read_reg(s, n);
+  if (*end != '=' || !parse_bytes(end + 1, bytes) || !write_reg(s, n, bytes))
+    return "E01";
+  cpu.SetState(s);
+  return "OK";
+}
+
+static string handle_memory(const string &pkt) {
+  char *end;
+  uint32_t addr = strtoul(pkt.c_str() + 1, &end, 16);
+  if (*end != ',')
+    return "E01";
+  uint32_t len = strtoul(end + 1, &end, 16);
+  if (pkt[0] == 'm') {
+    string r;
+    for (uint32_t i = 0; i < len && i < 0x800; i++)
+      r += hex_byte(debug_peek(thread_space(cur_thread), (addr + i) & 0xFFFF));
+    return r;
+  }
+  string bytes;
+  if (*end != ':' || !parse_bytes(end + 1, bytes) || bytes.size() != len)
+    return "E01";
+  // Straight to the bus, so as not to hit any watchpoints
+  const PlatformDesc &plat = vt168_platform();
+  WriteHandler write =
+      (cur_thread == DebugCPU::SCPU) ? plat.scpu_write : plat.cpu_write;
+  for (uint32_t i = 0; i < len; i++)
+    write((addr + i) & 0xFFFF, bytes[i]);
+  return "OK";
+}
+
+static string handle_point(const string &pkt) {
+  string args = pkt.substr(1, pkt.find(';') - 1);
+  char *end;
+  int type = strtol(args.c_str(), &end, 16);
+  if (*end != ',')
+    return "E01";
+  uint32_t addr = strtoul(end + 1, &end, 16);
+  if (*end != ',')
+    return "E01";
+  uint32_t len = strtoul(end + 1, &end, 16);
+  static const uint8_t access[] = {DEBUG_EXEC, DEBUG_EXEC, DEBUG_WRITE,
+                                   DEBUG_READ, DEBUG_READ | DEBUG_WRITE};
+  if (type < 0 || type > 4)
+    return "";
+  DebugSpace space = thread_space(cur_thread);
+  string key = to_string(int(space)) + ":" + args;
+  if (pkt[0] == 'z') {
+    auto it = z_points.find(key);
+    if (it == z_points.end())
+      return "E01";
+    debug_remove(it->second);
+    z_points.erase(it);
+    return "OK";
+  }
+  if (z_points.count(key) == 0) {
+    uint32_t last = (access[type] == DEBUG_EXEC || len == 0) ? addr
+                                                            : addr + len - 1;
+    z_points[key] = debug_add(space, addr, last, access[type]);
+  }
+  return "OK";
+}
+
+static string handle_query(const string &pkt) {
+  if (pkt.substr(0, 10) == "qSupported")
+    return "PacketSize=1000;qXfer:features:read+;QStartNoAckMode+;"
+           "vContSupported+";
+  if (pkt == "qAttached")
+    return "1";
+  if (pkt == "qC")
+    return "QC" + hex_num(thread_id(cur_thread));
+  if (pkt == "qfThreadInfo")
+    return "m1,2";
+  if (pkt == "qsThreadInfo")
+    return "l";
+  if (pkt.substr(0, 17) == "qThreadExtraInfo,") {
+    string name = (pkt.substr(17) == "2") ? "SCPU" : "main CPU";
+    string r;
+    for (char c : name)
+      r += hex_byte(c);
+    return r;
+  }
+  const string xfer = "qXfer:features:read:target.xml:";
+  if (pkt.substr(0, xfer.size()) == xfer) {
+    char *end;
+    size_t off = strtoul(pkt.c_str() + xfer.size(), &end, 16);
+    size_t len = strtoul(end + 1, nullptr, 16);
+    string xml = target_xml;
+    if (off >= xml.size())
+      return "l";
+    string part = xml.substr(off, len);
+    return ((off + part.size() >= xml.size()) ? "l" : "m") + part;
+  }
+  if (pkt == "QStartNoAckMode") {
+    put_packet("OK");
+    no_ack = true;
+    return string();
+  }
+  return "";
+}
+
+// Parse a thread id, returning false for 0 or -1 (any or all threads)
+static bool parse_thread(const string &str, DebugCPU &t) {
+  long id = strtol(str.c_str(), nullptr, 16);
+  if (id != 1 && id != 2)
+    return false;
+  t = (id == 2) ? DebugCPU::SCPU : DebugCPU::MAIN;
+  return true;
+}
+
+static DebugCPU step_cpu() {
+  if (step_thread == 0)
+    return cur_thread;
+  return (step_thread == 2) ? DebugCPU::SCPU : DebugCPU::MAIN;
+}
+
+bool gdb_serve() {
+  if (client_fd < 0)
+    return true;
+  if (running) {
+    put_packet(stop_reply());
+    running = false;
+  }
+  string pkt;
+  while (get_packet(pkt)) {
+    string reply;
+    DebugCPU t;
+    switch (pkt.empty() ? 0 : pkt[0]) {
+    case '?':
+      reply = stop_reply();
+      break;
+    case 'g':
+    case 'G':
+    case 'p':
+    case 'P':
+      reply = handle_regs(pkt);
+      break;
+    case 'm':
+    case 'M':
+      reply = handle_memory(pkt);
+      break;
+    case 'Z':
+    case 'z':
+      reply = handle_point(pkt);
+      break;
+    case 'H':
+      if (pkt.size() < 3) {
+        reply = "E01";
+      } else if (pkt[1] == 'g') {
+        parse_thread(pkt.substr(2), cur_thread);
+        reply = "OK";
+      } else {
+        step_thread = parse_thread(pkt.substr(2), t) ? thread_id(t) : 0;
+        reply = "OK";
+      }
+      break;
+    case 'T':
+      reply = parse_thread(pkt.substr(1), t) ? "OK" : "E01";
+      break;
+    case 'q':
+    case 'Q':
+      reply = handle_query(pkt);
+      if (pkt == "QStartNoAckMode")
+        continue;
+      break;
+    case 'c':
+      debug_resume();
+      running = true;
+      return true;
+    case 's':
+      debug_step(step_cpu());
+      running = true;
+      return true;
+    case 'v':
+      if (pkt == "vCont?") {
+        reply = "vCont;c;s";
+      } else if (pkt.substr(0, 6) == "vCont;") {
+        // Step if any thread is to be stepped, otherwise continue
+        size_t s = pkt.find(";s");
+        if (s == string::npos) {
+          debug_resume();
+        } else {
+          size_t colon = pkt.find(':', s);
+          bool given = colon == s + 2 && parse_thread(pkt.substr(s + 3), t);
+          debug_step(given ? t : step_cpu());
+        }
+        running = true;
+        return true;
+      }
+      break;
+    case 'D':
+      put_packet("OK");
+      close_client();
+      debug_resume();
+      return true;
+    case 'k':
+      close_client();
+      return false;
+    }
+    put_packet(reply);
+  }
+  // The connection was closed
+  close_client();
+  debug_resume();
+  return true;
+}
+} // namespace VTxx
@@ -0,0 +1,31 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+#include <string>
+using namespace std;
+
+namespace VTxx {
+// GDB remote serial protocol stub. The main CPU is thread 1 and the SCPU is
+// thread 2, each with the registers a, x, y, s, p (8 bits) and pc (16 bits),
+// described by target.xml. Memory accesses are in the selected thread's view.
+// Breakpoints and watchpoints are set with Z packets in the selected thread's
+// view, using the debugger (see debug.hpp)
+
+// Listen for a debugger on addr, either a TCP port on localhost or
+// unix:PATH, returning false on failure
+bool gdb_listen(const string &addr);
+
+// While running, check for a new connection or an interrupt from the
+// debugger. This is meant to be called once per frame, and costs a load while
+// no debugger is connected. A new connection pauses the emulation
+void gdb_poll();
+
+// True while a debugger is connected
+bool gdb_attached();
+
+// While paused, report the stop to the debugger and serve its requests until
+// it continues, steps or detaches. Returns false if the debugger asked for the
+// emulator to be killed
+bool gdb_serve();
+} // namespace VTxx
+
+#endif /* end of include guard: GDBSTUB_H */
@@ -1,16 +1,28 @@
 #ifndef INPUT_HPP
 #define INPUT_HPP
 
-#include "SDL2/SDL.h"
+#include "state.hpp"
 #include <cstdint>
 using namespace std;
 
 namespace VTxx {
+// Button bits, in the order they are shifted out
+const uint8_t BTN_A = 0x01;
+const uint8_t BTN_B = 0x02;
+const uint8_t BTN_SELECT = 0x04;
+const uint8_t BTN_START = 0x08;
+const uint8_t BTN_UP = 0x10;
+const uint8_t BTN_DOWN = 0x20;
+const uint8_t BTN_LEFT = 0x40;
+const uint8_t BTN_RIGHT = 0x80;
+
 class InputDev {
 public:
   void write(uint8_t addr, uint8_t data);
   uint8_t read(uint8_t addr);
-  void process_event(SDL_Event *ev);
+  // Set the buttons currently held, as a mask of BTN_*
+  void set_buttons(uint8_t state);
+  void state(StateIO &io);
 
 private:
   uint8_t btn_state = 0;
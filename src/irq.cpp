@@ -1,12 +1,14 @@
 #include "irq.hpp"
 #include "6502/mos6502.hpp"
+#include "mmu.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include <cassert>
 #include <iostream>
 namespace VTxx {
 IRQController::IRQController(const vector<IRQVector> &_v,
-                             mos6502::mos6502 *_cpu)
-    : n(_v.size()), vectors(_v), cpu(_cpu) {
+                             mos6502::mos6502 *_cpu, const char *_name)
+    : n(_v.size()), vectors(_v), cpu(_cpu), name(_name) {
   status.resize(n, false);
 };
 
@@ -17,6 +19,15 @@ void IRQController::write(uint8_t address, uint8_t data) {
       status[i] = false;
 }
 uint8_t IRQController::read(uint8_t address) { return msk_reg; }
+void IRQController::state(StateIO &io) {
+  io.pod(msk_reg);
+  for (int i = 0; i < n; i++) {
+    bool s = status[i];
+    io.pod(s);
+    status[i] = s;
+  }
+}
+
 void IRQController::set_irq(int idx, bool new_status) {
   assert(idx < n);
   if (!new_status) {
@@ -27,6 +38,10 @@ void IRQController::set_irq(int idx, bool new_status) {
         status[idx] = true;
         cout << "--- IRQ " << idx << " (0x" << hex << vectors[idx].h << ", 0x"
              << vectors[idx].l << ")" << endl;
+        if (trace_on)
+          trace_instant(TraceThread::MAIN,
+                        string(name) + " IRQ " + to_string(idx), cpu_clock,
+                        "\"vector\": " + trace_hex(vectors[idx].l));
         cpu->IRQ(vectors[idx].h, vectors[idx].l);
       }
     }
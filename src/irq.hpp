@@ -1,5 +1,6 @@
 #ifndef IRQ_H
 #define IRQ_H
+#include "state.hpp"
 #include <cstdint>
 #include <vector>
 using namespace std;
@@ -16,11 +17,14 @@ struct IRQVector {
 
 class IRQController {
 public:
-  IRQController(const vector<IRQVector> &_v, mos6502::mos6502 *_cpu);
+  // name identifies the CPU in traces
+  IRQController(const vector<IRQVector> &_v, mos6502::mos6502 *_cpu,
+                const char *_name);
   // Only 1 address, 0 is the mask register
   void write(uint8_t address, uint8_t data);
   uint8_t read(uint8_t address);
   void set_irq(int idx, bool new_status);
+  void state(StateIO &io);
 
 private:
   uint8_t msk_reg = 0;
@@ -28,6 +32,7 @@ private:
   vector<IRQVector> vectors;
   vector<bool> status;
   mos6502::mos6502 *cpu;
+  const char *name;
 };
 
 }; // namespace VTxx
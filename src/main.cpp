@@ -1,70 +1,325 @@
 #include "SDL2/SDL.h"
+#include "debug.hpp"
+#include "gdbstub.hpp"
+#include "input.hpp"
 #include "mmu.hpp"
+#include "movie.hpp"
+#include "platform.hpp"
+#include "postproc.hpp"
 #include "ppu.hpp"
+#include "savefile.hpp"
+#include "trace.hpp"
 
 #include "vt168.hpp"
+#include <cstdlib>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <string>
+#include <vector>
 using namespace std;
 using namespace VTxx;
 
 SDL_Window *ppu_window;
 SDL_Renderer *ppuwin_renderer;
 
+// Map keys to input bits
+static const map<SDL_Scancode, uint8_t> keys = {
+    {SDL_SCANCODE_X, BTN_A},         {SDL_SCANCODE_Z, BTN_B},
+    {SDL_SCANCODE_RSHIFT, BTN_SELECT}, {SDL_SCANCODE_RETURN, BTN_START},
+    {SDL_SCANCODE_UP, BTN_UP},       {SDL_SCANCODE_DOWN, BTN_DOWN},
+    {SDL_SCANCODE_LEFT, BTN_LEFT},   {SDL_SCANCODE_RIGHT, BTN_RIGHT}};
+
+static void process_event(SDL_Event *ev, uint8_t &buttons) {
+  switch (ev->type) {
+  case SDL_KEYDOWN:
+    if (keys.find(ev->key.keysym.scancode) != keys.end())
+      buttons |= keys.at(ev->key.keysym.scancode);
+    break;
+  case SDL_KEYUP:
+    if (keys.find(ev->key.keysym.scancode) != keys.end())
+      buttons &= ~keys.at(ev->key.keysym.scancode);
+    break;
+  }
+}
+
+// Stop the render, save and trace threads, which must be done before
+// returning from main once they have started
+static void stop_threads() {
+  ppu_stop();
+  save_close();
+  trace_close();
+}
+
+static int quit(const InputMovie &recording, const string &record_file) {
+  stop_threads();
+  if (!record_file.empty() && !recording.save(record_file))
+    cerr << "Failed to save input movie " << record_file << endl;
+  return 0;
+}
+
+// Parse a hex START-END physical address range, END inclusive
+static bool parse_save_region(const string &s, SaveRegion &r) {
+  size_t dash = s.find('-');
+  if (dash == string::npos)
+    return false;
+  string start = s.substr(0, dash), end = s.substr(dash + 1);
+  char *p1, *p2;
+  r.start = strtoul(start.c_str(), &p1, 16);
+  r.end = strtoul(end.c_str(), &p2, 16) + 1;
+  return !start.empty() && !end.empty() && *p1 == '\0' && *p2 == '\0' &&
+         r.end > r.start && r.end <= 32 * 1024 * 1024;
+}
+
+// Wait while paused by the debugger, returning false if the window is closed
+static bool wait_resume() {
+  SDL_Event event;
+  while (SDL_WaitEvent(&event)) {
+    if (event.type == SDL_QUIT)
+      return false;
+    if (event.type == SDL_KEYDOWN &&
+        event.key.keysym.scancode == SDL_SCANCODE_F5)
+      return true;
+  }
+  return false;
+}
+
+static void usage() {
+  cerr << "Usage: " << endl;
+  cerr << "openvtx [options] platform rom.bin" << endl << endl;
+  cerr << "Options:" << endl;
+  cerr << "  --pal, --ntsc         video timing" << endl;
+  cerr << "  --scale=N             integer output scale" << endl;
+  cerr << "  --filter=NAME         nearest, scale2x or scale3x" << endl;
+  cerr << "  --scanlines           darken every scaled line" << endl;
+  cerr << "  --record-input=FILE   save the input to a movie file on exit"
+       << endl;
+  cerr << "  --play-input=FILE     play the input from a movie file" << endl;
+  cerr << "  --cpu=ENGINE          CPU engine, interp or fused" << endl;
+  cerr << "  --break=[SPACE:]ADDR  pause before running the instruction at ADDR"
+       << endl;
+  cerr << "  --watch=[SPACE:]START[-END][:rw]" << endl;
+  cerr << "                        pause on an access to START..END, writes by"
+       << endl;
+  cerr << "                        default" << endl;
+  cerr << "  --gdb=PORT|unix:PATH  listen for a GDB remote connection" << endl;
+  cerr << "  --trace-events=FILE   write a Chrome trace of emulator events"
+       << endl;
+  cerr << "  --save=FILE           save file for written external memory"
+       << endl;
+  cerr << "                        (default: the ROM path with .sav)" << endl;
+  cerr << "  --save-region=START-END" << endl;
+  cerr << "                        physical range to save (default: past the "
+          "ROM)"
+       << endl;
+  cerr << "  --no-save             don't load or write a save file" << endl
+       << endl;
+  cerr << "Supported platforms: " << platform_names() << endl;
+  cerr << "Debug addresses are hex, SPACE is cpu (default), phys, vram, "
+          "spram or scpu."
+       << endl;
+  cerr << "On a hit the CPU state is printed, F5 continues, unless GDB is "
+          "attached"
+       << endl;
+  cerr << "Timing defaults to the ROM filename region tag if present, "
+          "otherwise the platform default"
+       << endl;
+}
+
 int main(int argc, const char *argv[]) {
-  if (argc < 3) {
-    cerr << "Usage: " << endl;
-    cerr << "openvtx platform rom.bin" << endl << endl;
-    cerr << "Supported platforms: vt168 miwi2" << endl;
+  vector<string> args;
+  bool timing_set = false;
+  VideoTiming timing = VideoTiming::PAL;
+  PostProcConfig pp;
+  bool scale_set = false;
+  string record_file, play_file;
+  mos6502::Engine engine = mos6502::ENGINE_INTERP;
+  vector<DebugPoint> debug;
+  string gdb_addr, trace_file;
+  string save_file;
+  bool save_set = false, no_save = false;
+  vector<SaveRegion> save_regions;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.substr(0, 2) != "--") {
+      args.push_back(arg);
+      continue;
+    }
+    string opt = arg.substr(2), val;
+    size_t eq = opt.find('=');
+    bool has_val = (eq != string::npos);
+    if (has_val) {
+      val = opt.substr(eq + 1);
+      opt = opt.substr(0, eq);
+    }
+    bool ok = true;
+    if (opt == "scale") {
+      pp.scale = atoi(val.c_str());
+      scale_set = true;
+      ok = (pp.scale >= 1);
+    } else if (opt == "filter") {
+      ok = parse_filter(val, pp.filter);
+    } else if (opt == "scanlines") {
+      pp.scanlines = true;
+      ok = !has_val;
+    } else if (opt == "record-input") {
+      record_file = val;
+      ok = !val.empty();
+    } else if (opt == "play-input") {
+      play_file = val;
+      ok = !val.empty();
+    } else if (opt == "cpu") {
+      ok = mos6502::ParseEngine(val, engine);
+    } else if (opt == "break" || opt == "watch") {
+      DebugPoint p;
+      ok = parse_debug_point(val, (opt == "break") ? DEBUG_EXEC : DEBUG_WRITE,
+                             p);
+      debug.push_back(p);
+    } else if (opt == "trace-events") {
+      trace_file = val;
+      ok = !val.empty();
+    } else if (opt == "save") {
+      save_file = val;
+      save_set = true;
+      ok = !val.empty();
+    } else if (opt == "save-region") {
+      SaveRegion r;
+      ok = parse_save_region(val, r);
+      save_regions.push_back(r);
+    } else if (opt == "no-save") {
+      no_save = true;
+      ok = !has_val;
+    } else if (opt == "gdb") {
+      gdb_addr = val;
+      ok = !val.empty();
+    } else {
+      // Flags take no value, so --ntsc=0 isn't taken as --ntsc
+      ok = !has_val && parse_timing(opt, timing);
+      timing_set = true;
+    }
+    if (!ok) {
+      usage();
+      return 2;
+    }
+  }
+  if (!scale_set)
+    pp.scale = filter_factor(pp.filter);
+  if (args.size() < 2 || (pp.scale % filter_factor(pp.filter)) != 0) {
+    usage();
     return 2;
   }
+  const PlatformDesc *plat = find_platform(args[0]);
+  if (plat == nullptr) {
+    cerr << "Supported platforms: " << platform_names() << endl;
+    return 2;
+  }
+  if (!timing_set && !detect_rom_timing(args[1], timing))
+    timing = plat->default_timing;
+  InputMovie movie, recording;
+  if (!play_file.empty() && !movie.load(play_file)) {
+    cerr << "Failed to load input movie " << play_file << endl;
+    return 1;
+  }
+
+  int out_w = 256 * pp.scale, out_h = 240 * pp.scale;
   ppu_window = SDL_CreateWindow("openvtx", SDL_WINDOWPOS_CENTERED,
-                                SDL_WINDOWPOS_CENTERED, 256, 240, 0);
+                                SDL_WINDOWPOS_CENTERED, out_w, out_h, 0);
   if (ppu_window == nullptr) {
     printf("Failed to create window: %s.\n", SDL_GetError());
     exit(1);
   }
+  // Scaling is done by the post-processing, so any stretch left for SDL to do
+  // should stay sharp
+  SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
   ppuwin_renderer =
       SDL_CreateRenderer(ppu_window, -1, SDL_RENDERER_ACCELERATED);
-  VT168_Platform plat;
-  std::string platform_str = argv[1];
-  if (platform_str == "vt168") {
-    plat = VT168_Platform::VT168_BASE;
-  } else if (platform_str == "miwi2") {
-    plat = VT168_Platform::VT168_MIWI2;
-  } else {
-    cerr << "Supported platforms: vt168 miwi2" << endl;
-    return 2;
+  SDL_Texture *tex =
+      SDL_CreateTexture(ppuwin_renderer, SDL_PIXELFORMAT_ARGB8888,
+                        SDL_TEXTUREACCESS_STREAMING, out_w, out_h);
+  if (!trace_file.empty() && !trace_open(trace_file)) {
+    cerr << "Failed to open trace " << trace_file << endl;
+    return 1;
   }
-  vt168_init(plat, argv[2]);
+  vt168_init(plat->id, timing, args[1], true, engine);
+  // A saved game would change how a movie plays back, so only use one then
+  // if asked to
+  if (!no_save && (save_set || play_file.empty())) {
+    if (!save_set) {
+      size_t dot = args[1].find_last_of('.');
+      size_t slash = args[1].find_last_of('/');
+      if (dot != string::npos && (slash == string::npos || dot > slash))
+        save_file = args[1].substr(0, dot);
+      else
+        save_file = args[1];
+      save_file += ".sav";
+    }
+    if (!save_open(save_file, save_regions)) {
+      cerr << "Failed to open save file " << save_file << endl;
+      stop_threads();
+      return 1;
+    }
+  }
+  for (const DebugPoint &p : debug)
+    debug_add(p.space, p.start, p.end, p.access);
+  if (!gdb_addr.empty() && !gdb_listen(gdb_addr)) {
+    cerr << "Failed to listen for GDB on " << gdb_addr << endl;
+    stop_threads();
+    return 1;
+  }
+  bool gdb_on = !gdb_addr.empty();
+  ppu_set_postproc(pp);
+  if (pp.scale > 1)
+    cout << "Post-processing using " << postproc_impl_name() << endl;
   cout << "vector = 0x" << hex
        << (read_mem_virtual(0xfffd) << 8UL | read_mem_virtual(0xfffc)) << endl;
   bool last_render_done = false;
   SDL_Event event;
+  uint8_t buttons = 0;
+  uint64_t frame = 0;
+  if (!play_file.empty())
+    vt168_set_input(movie.buttons_at(0));
   while (true) {
-    vt168_tick();
+    if (vt168_paused()) {
+      if (gdb_attached()) {
+        if (!gdb_serve())
+          return quit(recording, record_file);
+      } else {
+        debug_print_state(cerr);
+        if (!wait_resume())
+          return quit(recording, record_file);
+        debug_resume();
+      }
+    }
+    if (vt168_tick()) {
+      // Input changes take effect at the start of VBLANK, so that a recording
+      // plays back exactly
+      frame++;
+      uint8_t state = play_file.empty() ? buttons : movie.buttons_at(frame);
+      vt168_set_input(state);
+      recording.record(frame, state);
+      if (gdb_on)
+        gdb_poll();
+    }
     if (ppu_is_render_done() && !last_render_done) {
       // Process events
       while (SDL_PollEvent(&event)) {
         switch (event.type) {
         case SDL_QUIT:
-          ppu_stop();
-          return 0;
-          break;
+          return quit(recording, record_file);
         }
-        vt168_process_event(&event);
+        process_event(&event, buttons);
       }
       // Render graphics
-      SDL_Surface *surf = SDL_CreateRGBSurfaceFrom(
-          (void *)get_render_buffer(), 256, 240, 32, 256 * 4, 0x00FF0000,
-          0x0000FF00, 0x000000FF, 0xFF000000);
-
-      SDL_Texture *tex = SDL_CreateTextureFromSurface(ppuwin_renderer, surf);
+      if (trace_on)
+        trace_begin(TraceThread::MAIN, "present", cpu_clock);
+      int w, h;
+      uint32_t *buf = get_output_buffer(w, h);
+      SDL_UpdateTexture(tex, nullptr, buf, w * 4);
       SDL_RenderClear(ppuwin_renderer);
       SDL_RenderCopy(ppuwin_renderer, tex, nullptr, nullptr);
       SDL_RenderPresent(ppuwin_renderer);
-      SDL_DestroyTexture(tex);
-      SDL_FreeSurface(surf);
+      if (trace_on)
+        trace_end(TraceThread::MAIN, "present", cpu_clock);
     }
     last_render_done = ppu_is_render_done();
   }
@@ -1,58 +1,120 @@
 #include "mmu.hpp"
+#include "coverage.hpp"
+#include "platform.hpp"
 #include "ppu.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <cassert>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <vector>
 using namespace std;
 
 namespace VTxx {
 
 uint8_t control_reg[256] = {0};
 uint8_t cpu_ram[8192];
+uint64_t cpu_clock = 0;
 
-static uint8_t rom[32 * 1024 * 1024];
+static const uint32_t rom_size = 32 * 1024 * 1024;
+// Padded so that renderer fast paths can do wide loads up to the end
+static uint8_t rom[rom_size + 8];
 
 ReadHandler reg_read_fn[256] = {nullptr};
 WriteHandler reg_write_fn[256] = {nullptr};
 
-void mmu_init() {
+// External memory journal, see mmu_snapshot
+static const int page_shift = 13;
+static const uint32_t page_size = 1 << page_shift;
+static const uint32_t n_pages = rom_size >> page_shift;
+// Pages written since the ROM was loaded, and the image as loaded, for
+// mmu_ext_state. Memory past the image was zero
+static bool page_written[n_pages];
+static vector<uint8_t> rom_image;
+// Pages written since the last mmu_take_unsaved, as flags and in order
+static bool page_unsaved[n_pages];
+static vector<uint32_t> unsaved;
+static bool journaling = false;
+// Pages written since the snapshot or the last restore
+static bool page_dirty[n_pages];
+// Contents of each page at the snapshot, saved on the first write after it
+static vector<vector<uint8_t>> page_saved;
+
+static const PlatformDesc *plat = nullptr;
+static ReadHandler bus_read = nullptr;
+static WriteHandler bus_write = nullptr;
+
+void mmu_init(const PlatformDesc &_plat) {
+  plat = &_plat;
+  fill(control_reg, control_reg + sizeof(control_reg), 0);
+  fill(cpu_ram, cpu_ram + sizeof(cpu_ram), 0);
+  mmu_set_bus(nullptr, nullptr);
   // TODO: default paging values?
 }
 
+// Called once len bytes of a new image are in rom
+static void rom_loaded(size_t len) {
+  // Clear whatever is left of the last image, or was written since
+  if (len < rom_image.size())
+    fill(rom + len, rom + rom_image.size(), 0);
+  for (uint32_t pg = 0; pg < n_pages; pg++) {
+    if (!page_written[pg])
+      continue;
+    size_t start = max(size_t(pg) << page_shift, len);
+    size_t end = size_t(pg + 1) << page_shift;
+    if (start < end)
+      fill(rom + start, rom + end, 0);
+    page_written[pg] = false;
+  }
+  rom_image.assign(rom, rom + len);
+  for (uint32_t pg : unsaved)
+    page_unsaved[pg] = false;
+  unsaved.clear();
+  journaling = false;
+  page_saved.clear();
+  cout << "Loaded ROM, size = " << (len / 1024) << "KB" << endl;
+}
+
 void load_rom(const string &filename) {
   ifstream romf(filename);
   if (!romf) {
     cerr << "Failed to load ROM" << endl;
     assert(false);
   }
-  romf.read(reinterpret_cast<char *>(rom), sizeof(rom));
-  size_t romsize = romf.gcount();
-  cout << "Loaded ROM, size = " << (romsize / 1024) << "KB" << endl;
-}
-
-const int reg_prg_bank1_reg3 = 0x00;
-const int reg_prg_bank0_reg0 = 0x07;
-const int reg_prg_bank0_reg1 = 0x08;
-const int reg_prg_bank0_reg2 = 0x09;
-const int reg_prg_bank0_reg3 = 0x0A;
-const int reg_prg_bank0_sel = 0x0B;
-const int reg_prg_bank1_reg2 = 0x0C;
-const int reg_prg_bank1_reg0 = 0x10;
-const int reg_prg_bank1_reg1 = 0x11;
-const int reg_prg_bank0_reg4 = 0x12;
-const int reg_prg_bank0_reg5 = 0x13;
-
-const int reg_prg_bank1_reg0_rd = 0x12;
-const int reg_prg_bank1_reg1_rd = 0x13;
-const int reg_prg_bank0_reg4_rd = 0x10;
-const int reg_prg_bank0_reg5_rd = 0x11;
-
-const int reg_prg_bank1_reg4_5 = 0x18;
-
-inline uint32_t decode_address(uint16_t addr) {
-  if (addr < 0x4000)
+  romf.read(reinterpret_cast<char *>(rom), rom_size);
+  rom_loaded(romf.gcount());
+}
+
+void load_rom_data(const uint8_t *data, size_t len) {
+  len = min(len, size_t(rom_size));
+  copy(data, data + len, rom);
+  rom_loaded(len);
+}
+
+// Queue a page for the next mmu_take_unsaved
+static inline void mark_unsaved(uint32_t pg) {
+  if (!page_unsaved[pg]) {
+    page_unsaved[pg] = true;
+    unsaved.push_back(pg);
+  }
+}
+
+// Called before a write to external memory
+static inline void touch_page(uint32_t pa) {
+  uint32_t pg = pa >> page_shift;
+  page_written[pg] = true;
+  mark_unsaved(pg);
+  if (page_dirty[pg] || !journaling)
+    return;
+  page_dirty[pg] = true;
+  if (page_saved[pg].empty())
+    page_saved[pg].assign(rom + (pg << page_shift),
+                          rom + ((pg + 1) << page_shift));
+}
+
+template <typename P> uint32_t decode_address_t(uint16_t addr) {
+  if (addr < P::rom_base)
     return addr;
   uint8_t tp = 0;
   bool comr6 = get_bit(control_reg[0x05], 6);
@@ -64,25 +126,25 @@ inline uint32_t decode_address(uint16_t addr) {
   case 0b01010:
   case 0b10010:
   case 0b11010:
-    tp = control_reg[reg_prg_bank0_reg4];
+    tp = control_reg[P::reg_prg_bank0_reg4];
     break;
   case 0b00011:
   case 0b01011:
   case 0b10011:
   case 0b11011:
-    tp = control_reg[reg_prg_bank0_reg5];
+    tp = control_reg[P::reg_prg_bank0_reg5];
     break;
   case 0b00100:
   case 0b01110:
   case 0b10100:
   case 0b11110:
-    tp = control_reg[reg_prg_bank0_reg0];
+    tp = control_reg[P::reg_prg_bank0_reg0];
     break;
   case 0b00101:
   case 0b01101:
   case 0b10101:
   case 0b11101:
-    tp = control_reg[reg_prg_bank0_reg1];
+    tp = control_reg[P::reg_prg_bank0_reg1];
     break;
   case 0b00110:
   case 0b01100:
@@ -96,14 +158,14 @@ inline uint32_t decode_address(uint16_t addr) {
     break;
   case 0b10110:
   case 0b11100:
-    tp = control_reg[reg_prg_bank0_reg2];
+    tp = control_reg[P::reg_prg_bank0_reg2];
     break;
   default:
     assert(false);
   }
-  uint8_t pq3 = control_reg[reg_prg_bank0_reg3];
+  uint8_t pq3 = control_reg[P::reg_prg_bank0_reg3];
   uint8_t pa20_13 = 0;
-  int sel = control_reg[reg_prg_bank0_sel] & 0x07;
+  int sel = control_reg[P::reg_prg_bank0_sel] & 0x07;
   if (sel == 0x07) {
     pa20_13 = tp;
   } else {
@@ -113,36 +175,36 @@ inline uint32_t decode_address(uint16_t addr) {
   pa |= (pa20_13 << 13);
   uint8_t pa24_21 = 0;
   if (ext2421 && get_bit(addr, 15)) {
-    pa24_21 = control_reg[reg_prg_bank1_reg3] & 0x0F;
+    pa24_21 = control_reg[P::reg_prg_bank1_reg3] & 0x0F;
   } else {
     switch ((pq2en << 4) | (comr6 << 3) | ((addr >> 13) & 0x07)) {
     case 0b00010:
     case 0b01010:
     case 0b10010:
     case 0b11010:
-      pa24_21 = control_reg[reg_prg_bank1_reg4_5] & 0x0F;
+      pa24_21 = control_reg[P::reg_prg_bank1_reg4_5] & 0x0F;
       break;
     case 0b00011:
     case 0b01011:
     case 0b10011:
     case 0b11011:
-      pa24_21 = (control_reg[reg_prg_bank1_reg4_5] >> 4) & 0x0F;
+      pa24_21 = (control_reg[P::reg_prg_bank1_reg4_5] >> 4) & 0x0F;
       break;
     case 0b00100:
     case 0b01110:
     case 0b10100:
     case 0b11110:
-      pa24_21 = control_reg[reg_prg_bank1_reg0] & 0x0F;
+      pa24_21 = control_reg[P::reg_prg_bank1_reg0] & 0x0F;
       break;
     case 0b00101:
     case 0b01101:
     case 0b10101:
     case 0b11101:
-      pa24_21 = control_reg[reg_prg_bank1_reg1] & 0x0F;
+      pa24_21 = control_reg[P::reg_prg_bank1_reg1] & 0x0F;
       break;
     case 0b10110:
     case 0b11100:
-      pa24_21 = control_reg[reg_prg_bank1_reg2] & 0x0F;
+      pa24_21 = control_reg[P::reg_prg_bank1_reg2] & 0x0F;
       break;
     case 0b00110:
     case 0b00111:
@@ -150,7 +212,7 @@ inline uint32_t decode_address(uint16_t addr) {
     case 0b01111:
     case 0b10111:
     case 0b11111:
-      pa24_21 = control_reg[reg_prg_bank1_reg3] & 0x0F;
+      pa24_21 = control_reg[P::reg_prg_bank1_reg3] & 0x0F;
       break;
     default:
       assert(false);
@@ -160,26 +222,30 @@ inline uint32_t decode_address(uint16_t addr) {
   return pa;
 }
 
-uint8_t read_mem_virtual(uint16_t addr) {
-  if (addr < 0x2000) {
+template <typename P> uint8_t read_mem_virtual_t(uint16_t addr) {
+  if (addr < P::ram_end) {
     return cpu_ram[addr];
-  } else if (addr >= 0x4000) {
-    return rom[decode_address(addr)];
-  } else if (addr >= 0x2000 && addr <= 0x20FF) {
+  } else if (addr >= P::rom_base) {
+    uint32_t pa = decode_address_t<P>(addr);
+#ifdef OPENVTX_COVERAGE
+    coverage_cpu_read(addr, pa);
+#endif
+    return rom[pa];
+  } else if (addr >= P::ppu_base && addr < P::sys_base) {
     return ppu_read(addr & 0xFF);
-  } else if (addr >= 0x2100 && addr <= 0x21FF) {
+  } else if (addr >= P::sys_base && addr < P::sys_base + 0x100) {
     if ((addr >= 0x210D) && (addr <= 0x210F))
       cout << "IOx READ 0x" << hex << addr << endl;
     // System regs read
     uint8_t reg_addr = addr & 0xFF;
-    if (reg_addr == reg_prg_bank0_reg4_rd)
-      return control_reg[reg_prg_bank0_reg4];
-    else if (reg_addr == reg_prg_bank0_reg5_rd)
-      return control_reg[reg_prg_bank0_reg5];
-    else if (reg_addr == reg_prg_bank1_reg0_rd)
-      return control_reg[reg_prg_bank1_reg0];
-    else if (reg_addr == reg_prg_bank1_reg1_rd)
-      return control_reg[reg_prg_bank1_reg1];
+    if (reg_addr == P::reg_prg_bank0_reg4_rd)
+      return control_reg[P::reg_prg_bank0_reg4];
+    else if (reg_addr == P::reg_prg_bank0_reg5_rd)
+      return control_reg[P::reg_prg_bank0_reg5];
+    else if (reg_addr == P::reg_prg_bank1_reg0_rd)
+      return control_reg[P::reg_prg_bank1_reg0];
+    else if (reg_addr == P::reg_prg_bank1_reg1_rd)
+      return control_reg[P::reg_prg_bank1_reg1];
     else if (reg_read_fn[reg_addr] != nullptr)
       return (reg_read_fn[reg_addr])(addr);
     else
@@ -190,18 +256,38 @@ uint8_t read_mem_virtual(uint16_t addr) {
   }
 }
 
-void write_mem_virtual(uint16_t addr, uint8_t data) {
-  if (addr < 0x2000) {
+#ifdef OPENVTX_COVERAGE
+// The registers decode_address_t<P> takes the bank from
+template <typename P> static bool is_bank_reg(uint8_t reg) {
+  return reg == P::reg_prg_bank0_reg0 || reg == P::reg_prg_bank0_reg1 ||
+         reg == P::reg_prg_bank0_reg2 || reg == P::reg_prg_bank0_reg3 ||
+         reg == P::reg_prg_bank0_reg4 || reg == P::reg_prg_bank0_reg5 ||
+         reg == P::reg_prg_bank0_sel || reg == P::reg_prg_bank1_reg0 ||
+         reg == P::reg_prg_bank1_reg1 || reg == P::reg_prg_bank1_reg2 ||
+         reg == P::reg_prg_bank1_reg3 || reg == P::reg_prg_bank1_reg4_5;
+}
+#endif
+
+template <typename P> void write_mem_virtual_t(uint16_t addr, uint8_t data) {
+  if (addr < P::ram_end) {
     cpu_ram[addr] = data;
-  } else if (addr >= 0x4000) {
-    rom[decode_address(addr)] =
-        data; // Seems odd but "ROM" might actually be extram
-  } else if (addr >= 0x2000 && addr <= 0x20FF) {
+  } else if (addr >= P::rom_base) {
+    uint32_t pa = decode_address_t<P>(addr);
+#ifdef OPENVTX_COVERAGE
+    coverage_write(pa);
+#endif
+    touch_page(pa);
+    rom[pa] = data; // Seems odd but "ROM" might actually be extram
+  } else if (addr >= P::ppu_base && addr < P::sys_base) {
     ppu_write(addr & 0xFF, data);
-  } else if (addr >= 0x2100 && addr <= 0x21FF) {
+  } else if (addr >= P::sys_base && addr < P::sys_base + 0x100) {
     if ((addr >= 0x210D) && (addr <= 0x210F))
       cout << "IOx WRITE " << addr << " d " << int(data) << endl;
     uint8_t reg_addr = addr & 0xFF;
+#ifdef OPENVTX_COVERAGE
+    if (is_bank_reg<P>(reg_addr))
+      coverage_bank_write();
+#endif
     if (reg_write_fn[reg_addr] != nullptr)
       (reg_write_fn[reg_addr])(addr, data);
     else
@@ -212,15 +298,37 @@ void write_mem_virtual(uint16_t addr, uint8_t data) {
   }
 }
 
+template uint32_t decode_address_t<VT168Traits>(uint16_t addr);
+template uint8_t read_mem_virtual_t<VT168Traits>(uint16_t addr);
+template void write_mem_virtual_t<VT168Traits>(uint16_t addr, uint8_t data);
+template uint32_t decode_address_t<MiWi2Traits>(uint16_t addr);
+template uint8_t read_mem_virtual_t<MiWi2Traits>(uint16_t addr);
+template void write_mem_virtual_t<MiWi2Traits>(uint16_t addr, uint8_t data);
+
+uint32_t decode_address(uint16_t addr) { return plat->decode_address(addr); }
+uint8_t read_mem_virtual(uint16_t addr) { return bus_read(addr); }
+void write_mem_virtual(uint16_t addr, uint8_t data) { bus_write(addr, data); }
+
+void mmu_set_bus(ReadHandler r, WriteHandler w) {
+  bus_read = (r != nullptr) ? r : plat->cpu_read;
+  bus_write = (w != nullptr) ? w : plat->cpu_write;
+}
+
 uint8_t read_mem_physical(uint32_t addr) {
-  assert(addr < sizeof(rom));
+  assert(addr < rom_size);
   return rom[addr];
 }
 void write_mem_physical(uint32_t addr, uint8_t data) {
-  assert(addr < sizeof(rom));
+  assert(addr < rom_size);
+  touch_page(addr);
   rom[addr] = data;
 }
 
+const uint8_t *get_physical_ptr(uint32_t addr, uint32_t len) {
+  assert(addr + len <= rom_size);
+  return rom + addr;
+}
+
 string va_to_str(uint16_t va) {
   ostringstream s;
   s << "0x" << hex << va;
@@ -229,4 +337,77 @@ string va_to_str(uint16_t va) {
   return s.str();
 }
 
+void mmu_state(StateIO &io) {
+  io.bytes(control_reg, sizeof(control_reg));
+  io.bytes(cpu_ram, sizeof(cpu_ram));
+  io.pod(cpu_clock);
+}
+
+void mmu_ext_state(StateIO &io) {
+  vector<uint32_t> pages;
+  for (uint32_t pg = 0; pg < n_pages; pg++)
+    if (page_written[pg])
+      pages.push_back(pg);
+  uint32_t n = pages.size();
+  io.pod(n);
+  if (!io.loading()) {
+    for (uint32_t pg : pages) {
+      io.pod(pg);
+      io.bytes(rom + (pg << page_shift), page_size);
+    }
+    return;
+  }
+  // Put back the pages written here, then read in those written in the state
+  for (uint32_t pg : pages) {
+    uint32_t pa = pg << page_shift;
+    touch_page(pa);
+    size_t in_image = 0;
+    if (pa < rom_image.size()) {
+      in_image = min(size_t(page_size), rom_image.size() - pa);
+      copy(rom_image.begin() + pa, rom_image.begin() + pa + in_image, rom + pa);
+    }
+    fill(rom + pa + in_image, rom + pa + page_size, 0);
+    page_written[pg] = false;
+  }
+  for (uint32_t i = 0; i < n && io.ok(); i++) {
+    uint32_t pg;
+    io.pod(pg);
+    if (pg >= n_pages) {
+      io.fail();
+      break;
+    }
+    touch_page(pg << page_shift);
+    io.bytes(rom + (pg << page_shift), page_size);
+  }
+}
+
+uint32_t mmu_image_size() { return rom_image.size(); }
+
+void mmu_take_unsaved(vector<uint32_t> &pages) {
+  for (uint32_t pg : unsaved)
+    page_unsaved[pg] = false;
+  pages.swap(unsaved);
+  unsaved.clear();
+}
+
+void mmu_snapshot() {
+  journaling = true;
+  fill(page_dirty, page_dirty + n_pages, false);
+  page_saved.assign(n_pages, vector<uint8_t>());
+}
+
+void mmu_restore() {
+  if (!journaling)
+    return;
+  for (uint32_t pg = 0; pg < n_pages; pg++) {
+    if (!page_dirty[pg])
+      continue;
+    // Changed back, so it needs saving again
+    mark_unsaved(pg);
+    copy(page_saved[pg].begin(), page_saved[pg].end(),
+         rom + (pg << page_shift));
+    page_dirty[pg] = false;
+  }
+}
+
 } // namespace VTxx
@@ -1,8 +1,10 @@
 #ifndef MMU_H
 #define MMU_H
+#include "state.hpp"
 #include "typedefs.hpp"
 #include <cstdint>
 #include <string>
+#include <vector>
 using namespace std;
 namespace VTxx {
 // The system control registers, 0x2100 .. 0x21FF
@@ -11,16 +13,58 @@ extern uint8_t control_reg[256];
 // The main 8KB CPU RAM, between 0x0000 and 0x1FFF
 extern uint8_t cpu_ram[8192];
 
-void mmu_init();
+// Main CPU clocks since power on, advanced by the system tick loop
+extern uint64_t cpu_clock;
+
+struct PlatformDesc;
+
+void mmu_init(const PlatformDesc &plat);
 void load_rom(const string &filename);
+// Load a ROM image from memory, up to 32MB
+void load_rom_data(const uint8_t *data, size_t len);
+
+// Bus access through the active platform's memory map. The CPU core is given
+// the per-platform instantiations directly
+uint32_t decode_address(uint16_t addr);
 uint8_t read_mem_virtual(uint16_t addr);
 void write_mem_virtual(uint16_t addr, uint8_t data);
 
+// Replace the handlers read_mem_virtual and write_mem_virtual use, which DMA
+// goes through, for tools that watch the bus. nullptr restores the platform's
+void mmu_set_bus(ReadHandler r, WriteHandler w);
+
+template <typename P> uint32_t decode_address_t(uint16_t addr);
+template <typename P> uint8_t read_mem_virtual_t(uint16_t addr);
+template <typename P> void write_mem_virtual_t(uint16_t addr, uint8_t data);
+
 uint8_t read_mem_physical(uint32_t addr);
 void write_mem_physical(uint32_t addr, uint8_t data);
 
+// Direct pointer to len bytes of physical memory, for bulk reads by the
+// renderer. Up to 8 bytes past the end may be read
+const uint8_t *get_physical_ptr(uint32_t addr, uint32_t len);
+
 string va_to_str(uint16_t va);
 
+// The control registers, CPU RAM and clock. External memory is too big to
+// save each time, so it is journaled instead: mmu_snapshot starts keeping the
+// original contents of each 8KB page as it is first written, and
+// mmu_restore puts back the pages written since the snapshot or the last
+// restore, which count as written for mmu_take_unsaved. Loading a ROM stops
+// the journal
+void mmu_state(StateIO &io);
+// External memory for a saved state: the pages written since the ROM was
+// loaded. Loading puts back the others, and is journaled like a write
+void mmu_ext_state(StateIO &io);
+void mmu_snapshot();
+void mmu_restore();
+
+// The size of the ROM image loaded
+uint32_t mmu_image_size();
+// The 8KB pages of external memory written since the last call or since the
+// ROM was loaded, in the order first written, for saving them
+void mmu_take_unsaved(vector<uint32_t> &pages);
+
 // Custom read and write overrides for control registers
 // Set to nullptr if just a plain register
 extern ReadHandler reg_read_fn[256];
@@ -0,0 +1,52 @@
+#include "movie.hpp"
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace VTxx {
+
+bool InputMovie::load(const string &filename) {
+  ifstream in(filename);
+  if (!in)
+    return false;
+  changes.clear();
+  pos = 0;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    istringstream ls(line);
+    uint64_t frame;
+    unsigned buttons;
+    if (!(ls >> dec >> frame >> hex >> buttons))
+      return false;
+    record(frame, buttons);
+  }
+  return true;
+}
+
+bool InputMovie::save(const string &filename) const {
+  ofstream out(filename);
+  if (!out)
+    return false;
+  for (const auto &c : changes)
+    out << dec << c.first << " " << hex << setw(2) << setfill('0')
+        << int(c.second) << endl;
+  return bool(out);
+}
+
+void InputMovie::record(uint64_t frame, uint8_t buttons) {
+  uint8_t last = changes.empty() ? 0 : changes.back().second;
+  if (buttons != last)
+    changes.push_back(make_pair(frame, buttons));
+}
+
+uint8_t InputMovie::buttons_at(uint64_t frame) {
+  if (pos > 0 && changes[pos - 1].first > frame)
+    pos = 0;
+  while (pos < changes.size() && changes[pos].first <= frame)
+    pos++;
+  return (pos == 0) ? 0 : changes[pos - 1].second;
+}
+
+} // namespace VTxx
@@ -0,0 +1,29 @@
+#ifndef MOVIE_HPP
+#define MOVIE_HPP
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+// Recorded input, as the button state from each frame where it changes.
+// Frames are counted in VBLANK starts since reset, and the state for a frame
+// takes effect at the start of that frame's VBLANK. The file format is one
+// "frame buttons" line per change, with the buttons in hex
+class InputMovie {
+public:
+  bool load(const string &filename);
+  bool save(const string &filename) const;
+  // Record the state for a frame, frames must be recorded in order
+  void record(uint64_t frame, uint8_t buttons);
+  // Return the state for a frame, fastest when frames are read in order
+  uint8_t buttons_at(uint64_t frame);
+
+private:
+  vector<pair<uint64_t, uint8_t>> changes;
+  size_t pos = 0;
+};
+} // namespace VTxx
+
+#endif /* end of include guard: MOVIE_HPP */
@@ -0,0 +1,101 @@
+#include "openvtx.h"
+#include "mmu.hpp"
+#include "platform.hpp"
+#include "ppu.hpp"
+#include "vt168.hpp"
+#include <algorithm>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+struct openvtx {
+  const PlatformDesc *plat;
+  VideoTiming timing;
+  bool loaded;
+  // Reused between saves
+  vector<uint8_t> state;
+};
+
+// The core is one global machine, see openvtx.h. Making it instantiable means
+// moving the vt168_* globals into a machine object, which is left for later
+static openvtx *instance = nullptr;
+
+openvtx *openvtx_create(const char *platform, int timing) {
+  if (instance != nullptr)
+    return nullptr;
+  const PlatformDesc *plat = find_platform(platform ? platform : "vt168");
+  if (plat == nullptr)
+    return nullptr;
+  VideoTiming t = plat->default_timing;
+  if (timing == OPENVTX_TIMING_PAL)
+    t = VideoTiming::PAL;
+  else if (timing == OPENVTX_TIMING_NTSC)
+    t = VideoTiming::NTSC;
+  else if (timing != OPENVTX_TIMING_DEFAULT)
+    return nullptr;
+  instance = new openvtx();
+  instance->plat = plat;
+  instance->timing = t;
+  instance->loaded = false;
+  return instance;
+}
+
+void openvtx_destroy(openvtx *vtx) {
+  if (vtx == nullptr || vtx != instance)
+    return;
+  delete vtx;
+  instance = nullptr;
+}
+
+int openvtx_load_rom(openvtx *vtx, const void *data, size_t len) {
+  if (len == 0)
+    return -1;
+  load_rom_data(static_cast<const uint8_t *>(data), len);
+  vt168_init(vtx->plat->id, vtx->timing, "", false);
+  vtx->loaded = true;
+  return 0;
+}
+
+int openvtx_run_frame(openvtx *vtx) {
+  if (!vtx->loaded)
+    return -1;
+  vt168_run_frame();
+  return 0;
+}
+
+int64_t openvtx_run_cycles(openvtx *vtx, uint64_t n) {
+  if (!vtx->loaded)
+    return -1;
+  int64_t frames = 0;
+  for (uint64_t i = 0; i < n; i++)
+    frames += vt168_tick();
+  return frames;
+}
+
+void openvtx_set_input(openvtx *vtx, uint8_t buttons) {
+  if (vtx->loaded)
+    vt168_set_input(buttons);
+}
+
+const uint32_t *openvtx_framebuffer(openvtx *vtx, int *width, int *height) {
+  if (width != nullptr)
+    *width = 256;
+  if (height != nullptr)
+    *height = 240;
+  return vtx->loaded ? get_render_buffer() : nullptr;
+}
+
+size_t openvtx_save_state(openvtx *vtx, void *buf, size_t len) {
+  if (!vtx->loaded)
+    return 0;
+  vt168_save_state(vtx->state);
+  if (vtx->state.size() <= len)
+    copy(vtx->state.begin(), vtx->state.end(), static_cast<uint8_t *>(buf));
+  return vtx->state.size();
+}
+
+int openvtx_load_state(openvtx *vtx, const void *data, size_t len) {
+  if (!vtx->loaded)
+    return -1;
+  return vt168_load_state(static_cast<const uint8_t *>(data), len) ? 0 : -1;
+}
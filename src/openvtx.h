@@ -0,0 +1,129 @@
+#ifndef OPENVTX_H
+#define OPENVTX_H
+#include <stddef.h>
+#include <stdint.h>
+
+// C API to the emulator core, for embedding it without the SDL frontend. Link
+// with libopenvtx.a (and the C++ runtime and pthreads) or libopenvtx.so, see
+// `make lib`. Rendering is synchronous, so runs are deterministic. The core
+// logs some events to stdout
+//
+// The core is still one global machine, not an object: its state, such as
+// cpu_ram and the rest of what vt168.hpp declares, is process wide. So only
+// one openvtx can exist in a process at a time, and a second openvtx_create
+// returns NULL until the first is destroyed. To run another ROM or platform,
+// destroy the machine and create a new one; create and destroy can be
+// repeated as often as needed. Anything else in the process that calls the
+// vt168_* functions directly changes the same machine. The vectorised API
+// below shares that state too, which is why it runs each environment in a
+// forked worker: the workers change their own copies, and the caller's
+// openvtx, if any, is left alone
+
+#if defined(__GNUC__)
+#define OPENVTX_API __attribute__((visibility("default")))
+#else
+#define OPENVTX_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct openvtx openvtx;
+
+// Video timing for openvtx_create. DEFAULT is the platform's usual timing
+enum {
+  OPENVTX_TIMING_DEFAULT = 0,
+  OPENVTX_TIMING_PAL = 1,
+  OPENVTX_TIMING_NTSC = 2
+};
+
+// Buttons for openvtx_set_input, as BTN_* in input.hpp
+enum {
+  OPENVTX_BTN_A = 0x01,
+  OPENVTX_BTN_B = 0x02,
+  OPENVTX_BTN_SELECT = 0x04,
+  OPENVTX_BTN_START = 0x08,
+  OPENVTX_BTN_UP = 0x10,
+  OPENVTX_BTN_DOWN = 0x20,
+  OPENVTX_BTN_LEFT = 0x40,
+  OPENVTX_BTN_RIGHT = 0x80
+};
+
+// Create a machine for a platform, named as for openvtx --platform (NULL for
+// vt168). Returns NULL if the platform or timing isn't known, or a machine
+// already exists in this process
+OPENVTX_API openvtx *openvtx_create(const char *platform, int timing);
+OPENVTX_API void openvtx_destroy(openvtx *vtx);
+
+// Copy in a ROM image of up to 32MB and reset the machine. Returns 0, or -1 if
+// len is 0
+OPENVTX_API int openvtx_load_rom(openvtx *vtx, const void *data, size_t len);
+
+// Run until the start of the next VBLANK, or for n master clock ticks, which
+// returns the number of VBLANKs started. Both return -1 if no ROM is loaded
+OPENVTX_API int openvtx_run_frame(openvtx *vtx);
+OPENVTX_API int64_t openvtx_run_cycles(openvtx *vtx, uint64_t n);
+// Set the buttons held, as a mask of OPENVTX_BTN_*
+OPENVTX_API void openvtx_set_input(openvtx *vtx, uint8_t buttons);
+
+// The output, as width * height ARGB8888 pixels with no row padding. It is
+// the last frame rendered, at the end of the last VBLANK. The buffer belongs
+// to the machine and is updated in place, it stays valid until the next
+// openvtx_load_rom or openvtx_destroy. NULL if no ROM is loaded
+OPENVTX_API const uint32_t *openvtx_framebuffer(openvtx *vtx, int *width,
+                                                int *height);
+
+// Save the state to buf and return its size. If that is more than len
+// nothing is written, so pass len 0 to find the size. The size depends on how
+// much external memory has been written
+OPENVTX_API size_t openvtx_save_state(openvtx *vtx, void *buf, size_t len);
+// Load a state saved by the same build of the library, for the same platform
+// and ROM. Returns 0, or -1 leaving the machine as it was if it isn't one
+OPENVTX_API int openvtx_load_state(openvtx *vtx, const void *data, size_t len);
+
+// Many machines stepped together, such as for reinforcement learning. As
+// the core is one global machine, each environment runs in a worker process
+// forked from the caller, so create these before starting other threads.
+// They don't count as an openvtx, so one can be created alongside them.
+// Observations are written by the workers straight into one shared buffer.
+// The workers are killed if the thread that created them exits, such as when
+// the process dies without openvtx_vec_destroy
+typedef struct openvtx_vec openvtx_vec;
+
+// Observation formats for openvtx_vec_create
+enum { OPENVTX_OBS_ARGB = 0, OPENVTX_OBS_GREY = 1 };
+
+// Create n environments running a ROM, each reset to power on. Observations
+// are (256 / downsample) x (240 / downsample) pixels, averaged over each
+// downsample x downsample block, for a downsample of 1, 2 or 4. They are 4
+// bytes per pixel for ARGB, or 1 for GREY. Returns NULL on error
+OPENVTX_API openvtx_vec *openvtx_vec_create(const char *platform, int timing,
+                                            const void *rom, size_t len, int n,
+                                            int format, int downsample);
+OPENVTX_API void openvtx_vec_destroy(openvtx_vec *vec);
+
+// Run every environment for a frame in parallel, with buttons[i] held in
+// environment i, and update the observations. Returns 0, or -1 if a worker
+// has died
+OPENVTX_API int openvtx_vec_step(openvtx_vec *vec, const uint8_t *buttons);
+// Reset an environment, or all of them for -1, to power on and update its
+// observation. Returns 0, or -1 if a worker has died
+OPENVTX_API int openvtx_vec_reset(openvtx_vec *vec, int env);
+// Turn rendering an environment's output off or on (the default). While off
+// its observation isn't updated and the frame isn't rendered, which saves
+// the rendering time
+OPENVTX_API void openvtx_vec_set_render(openvtx_vec *vec, int env, int on);
+
+// The observations of all the environments, back to back in order, and the
+// size of each in bytes. The buffer is updated in place by each step or reset
+OPENVTX_API const uint8_t *openvtx_vec_obs(openvtx_vec *vec, size_t *size);
+// The 8KB main CPU RAM of each environment, back to back, as for the
+// observations
+OPENVTX_API const uint8_t *openvtx_vec_ram(openvtx_vec *vec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* end of include guard: OPENVTX_H */
@@ -0,0 +1,122 @@
+#include "platform.hpp"
+#include "mmu.hpp"
+#include "scpu_mem.hpp"
+#include <algorithm>
+#include <cassert>
+
+namespace VTxx {
+
+static const vector<IRQVector> vt168_cpu_vectors = {
+    {0xFFFF, 0xFFFE}, // 0 EXT
+    {0xFFF9, 0xFFF8}, // 1 TIMER
+    {0xFFF7, 0xFFF6}, // 2 SPU
+    {0xFFF5, 0xFFF4}, // 3 UART
+    {0xFFF3, 0xFFF2}, // 4 SPI
+};
+
+static const vector<IRQVector> vt168_scpu_vectors = {
+    {0x0FFF, 0x0FFE}, // 0 EXT
+    {0x0FF9, 0x0FF8}, // 1 TIMERA
+    {0x0FF7, 0x0FF6}, // 2 TIMERB
+    {0x0FF5, 0x0FF4}  // 3 CPU
+};
+
+// Fill in the fields that come straight from the traits type
+template <typename P> static PlatformDesc make_platform(PlatformDesc d) {
+  d.scramble = P::scramble;
+  d.cpu_read = read_mem_virtual_t<P>;
+  d.cpu_write = write_mem_virtual_t<P>;
+  d.scpu_read = scpu_read_mem_t<P>;
+  d.scpu_write = scpu_write_mem_t<P>;
+  d.decode_address = decode_address_t<P>;
+  d.cpu_zero_page = 0;
+  d.scpu_zero_page = P::scpu_ram_window;
+  return d;
+}
+
+static PlatformDesc vt168_base() {
+  PlatformDesc d;
+  d.id = VT168_Platform::VT168_BASE;
+  d.name = "vt168";
+  d.description = "minimal VT168 system";
+  d.cpu_vectors = vt168_cpu_vectors;
+  d.scpu_vectors = vt168_scpu_vectors;
+  d.scpu_brk = {0x0FFF, 0x0FFE};
+  d.scpu_rst = {0x0FFD, 0x0FFC};
+  d.scpu_nmi = {0x0FFB, 0x0FFA};
+  d.alu_rem_quirk = true;
+  d.alu_read_offset = false;
+  d.default_timing = VideoTiming::PAL;
+  return d;
+}
+
+static PlatformDesc miwi2() {
+  PlatformDesc d = vt168_base();
+  d.id = VT168_Platform::VT168_MIWI2;
+  d.name = "miwi2";
+  d.description = "MiWi2 Wii clone (VT168, scrambled opcodes)";
+  return d;
+}
+
+static const PlatformDesc platforms[] = {
+    make_platform<VT168Traits>(vt168_base()),
+    make_platform<MiWi2Traits>(miwi2()),
+};
+
+const PlatformDesc &get_platform(VT168_Platform plat) {
+  for (const auto &p : platforms)
+    if (p.id == plat)
+      return p;
+  assert(false);
+}
+
+const PlatformDesc *find_platform(const string &name) {
+  for (const auto &p : platforms)
+    if (name == p.name)
+      return &p;
+  return nullptr;
+}
+
+string platform_names() {
+  string s;
+  for (const auto &p : platforms) {
+    if (!s.empty())
+      s += " ";
+    s += p.name;
+  }
+  return s;
+}
+
+bool parse_timing(const string &name, VideoTiming &timing) {
+  if (name == "pal") {
+    timing = VideoTiming::PAL;
+  } else if (name == "ntsc") {
+    timing = VideoTiming::NTSC;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool detect_rom_timing(const string &filename, VideoTiming &timing) {
+  static const char *pal_tags[] = {"(europe)", "(e)", "(pal)", "(germany)",
+                                   "(france)", "(uk)", "(australia)"};
+  static const char *ntsc_tags[] = {"(usa)", "(u)", "(ntsc)", "(japan)", "(j)"};
+  string lower = filename.substr(filename.find_last_of('/') + 1);
+  transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+  for (auto tag : pal_tags) {
+    if (lower.find(tag) != string::npos) {
+      timing = VideoTiming::PAL;
+      return true;
+    }
+  }
+  for (auto tag : ntsc_tags) {
+    if (lower.find(tag) != string::npos) {
+      timing = VideoTiming::NTSC;
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace VTxx
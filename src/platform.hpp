@@ -0,0 +1,128 @@
+#ifndef PLATFORM_HPP
+#define PLATFORM_HPP
+#include "irq.hpp"
+#include "typedefs.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+
+enum class VT168_Platform { VT168_BASE, VT168_MIWI2 };
+
+// Compile-time platform traits. The hot paths (address decoding, the CPU
+// fetch loop and the system tick) are instantiated once per traits type, so
+// that differences between platforms don't cost any runtime branches
+struct VT168Traits {
+  // Main CPU memory map
+  static const uint16_t ram_end = 0x2000;  // 8KB RAM at 0x0000..0x1FFF
+  static const uint16_t ppu_base = 0x2000; // PPU regs at 0x2000..0x20FF
+  static const uint16_t sys_base = 0x2100; // System regs at 0x2100..0x21FF
+  static const uint16_t rom_base = 0x4000; // Banked external memory
+
+  // SCPU memory map - sees the upper 4KB of the main RAM, mirrored
+  static const uint16_t scpu_ram_end = 0x2000;
+  static const uint16_t scpu_ram_window = 0x1000;
+
+  // PRG bank registers, relative to 0x2100
+  static const uint8_t reg_prg_bank0_reg0 = 0x07;
+  static const uint8_t reg_prg_bank0_reg1 = 0x08;
+  static const uint8_t reg_prg_bank0_reg2 = 0x09;
+  static const uint8_t reg_prg_bank0_reg3 = 0x0A;
+  static const uint8_t reg_prg_bank0_reg4 = 0x12;
+  static const uint8_t reg_prg_bank0_reg5 = 0x13;
+  static const uint8_t reg_prg_bank0_sel = 0x0B;
+  static const uint8_t reg_prg_bank1_reg0 = 0x10;
+  static const uint8_t reg_prg_bank1_reg1 = 0x11;
+  static const uint8_t reg_prg_bank1_reg2 = 0x0C;
+  static const uint8_t reg_prg_bank1_reg3 = 0x00;
+  static const uint8_t reg_prg_bank1_reg4_5 = 0x18;
+
+  // Bank registers that read back from a different address than written
+  static const uint8_t reg_prg_bank1_reg0_rd = 0x12;
+  static const uint8_t reg_prg_bank1_reg1_rd = 0x13;
+  static const uint8_t reg_prg_bank0_reg4_rd = 0x10;
+  static const uint8_t reg_prg_bank0_reg5_rd = 0x11;
+
+  // MiWi2 style opcode scrambling
+  static const bool scramble = false;
+};
+
+struct MiWi2Traits : VT168Traits {
+  static const bool scramble = true;
+};
+
+enum class VideoTiming { PAL, NTSC };
+
+// Timing profiles. Frame timings are in CPU clocks, counted from the start of
+// VBLANK
+struct PALTiming {
+  // 26.601712MHz master clock, 5.32MHz CPU
+  static const int cpu_ratio = 5;
+  static const uint32_t v_total = 106392;
+  static const uint32_t vblank_len = 22036;
+};
+
+struct NTSCTiming {
+  // 21.477272MHz master clock, 5.37MHz CPU. 262 lines of 341 CPU clocks, the
+  // first 20 of which are VBLANK
+  static const int cpu_ratio = 4;
+  static const uint32_t v_total = 89342;
+  static const uint32_t vblank_len = 6820;
+};
+
+// Parse "pal" or "ntsc", returning false if not recognised
+bool parse_timing(const string &name, VideoTiming &timing);
+
+// Guess the timing from the region tags in a ROM filename, such as "(Europe)"
+// or "(USA)", returning false if there are none
+bool detect_rom_timing(const string &filename, VideoTiming &timing);
+
+// Runtime description of a platform, used at init time to configure the
+// peripherals and to pick the instantiated hot paths
+struct PlatformDesc {
+  VT168_Platform id;
+  const char *name;
+  const char *description;
+
+  // IRQ vectors, indexed by IRQ number
+  vector<IRQVector> cpu_vectors;
+  vector<IRQVector> scpu_vectors;
+
+  // SCPU BRK, reset and NMI vectors (the main CPU uses the 6502 defaults)
+  IRQVector scpu_brk, scpu_rst, scpu_nmi;
+
+  // External ALU variant
+  bool alu_rem_quirk;
+  bool alu_read_offset;
+
+  // Timing used when not given on the command line or by the ROM
+  VideoTiming default_timing;
+
+  bool scramble;
+
+  // Bus handlers instantiated for this platform
+  ReadHandler cpu_read;
+  WriteHandler cpu_write;
+  ReadHandler scpu_read;
+  WriteHandler scpu_write;
+  uint32_t (*decode_address)(uint16_t addr);
+
+  // Where each CPU's zero page is in cpu_ram, followed by its stack page
+  uint16_t cpu_zero_page;
+  uint16_t scpu_zero_page;
+};
+
+// Return the descriptor for a platform
+const PlatformDesc &get_platform(VT168_Platform plat);
+
+// Find a platform by command line name, returning nullptr if not found
+const PlatformDesc *find_platform(const string &name);
+
+// Space separated list of supported platform names
+string platform_names();
+
+} // namespace VTxx
+
+#endif /* end of include guard: PLATFORM_HPP */
@@ -0,0 +1,94 @@
+#include "postproc.hpp"
+#include "postproc_kernels.hpp"
+#include <cassert>
+
+namespace VTxx {
+
+// Portable fallback, one pixel at a time
+struct ScalarOps {
+  typedef uint32_t V;
+  static const int width = 1;
+  static V load(const uint32_t *p) { return *p; }
+  static void store(uint32_t *p, V v) { *p = v; }
+  static V eq(V a, V b) { return (a == b) ? 0xFFFFFFFF : 0; }
+  static V or_(V a, V b) { return a | b; }
+  static V andnot(V a, V b) { return ~a & b; }
+  static V sel(V m, V a, V b) { return (a & m) | (b & ~m); }
+  static V darken(V v) {
+    return (((v >> 1) & 0x007F7F7F) + ((v >> 2) & 0x003F3F3F)) | 0xFF000000;
+  }
+  static void zip2(V a, V b, V &o0, V &o1) {
+    o0 = a;
+    o1 = b;
+  }
+  static void zip3(V a, V b, V c, V &o0, V &o1, V &o2) {
+    o0 = a;
+    o1 = b;
+    o2 = c;
+  }
+};
+
+static void postproc_scalar(const PostProcConfig &cfg, const uint32_t *src,
+                            int w, int h, uint32_t *dst, int dst_pitch) {
+  postproc_frame_t<ScalarOps>(cfg, src, w, h, dst, dst_pitch);
+}
+
+int filter_factor(ScaleFilter filter) {
+  switch (filter) {
+  case ScaleFilter::NEAREST:
+    return 1;
+  case ScaleFilter::SCALE2X:
+    return 2;
+  case ScaleFilter::SCALE3X:
+    return 3;
+  }
+  assert(false);
+}
+
+bool parse_filter(const string &name, ScaleFilter &filter) {
+  if (name == "nearest") {
+    filter = ScaleFilter::NEAREST;
+  } else if (name == "scale2x") {
+    filter = ScaleFilter::SCALE2X;
+  } else if (name == "scale3x") {
+    filter = ScaleFilter::SCALE3X;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static PostProcFn impl = nullptr;
+static const char *impl_name = nullptr;
+
+static void select_impl() {
+  impl = postproc_scalar;
+  impl_name = "scalar";
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (postproc_avx2 != nullptr && __builtin_cpu_supports("avx2")) {
+    impl = postproc_avx2;
+    impl_name = "avx2";
+  } else if (postproc_sse2 != nullptr && __builtin_cpu_supports("sse2")) {
+    impl = postproc_sse2;
+    impl_name = "sse2";
+  }
+#endif
+}
+
+void postproc_frame(const PostProcConfig &cfg, const uint32_t *src, int w,
+                    int h, uint32_t *dst, int dst_pitch) {
+  assert(cfg.scale % filter_factor(cfg.filter) == 0);
+  assert(w <= postproc_max_width);
+  if (impl == nullptr)
+    select_impl();
+  impl(cfg, src, w, h, dst, dst_pitch);
+}
+
+const char *postproc_impl_name() {
+  if (impl == nullptr)
+    select_impl();
+  return impl_name;
+}
+
+} // namespace VTxx
@@ -0,0 +1,39 @@
+#ifndef POSTPROC_HPP
+#define POSTPROC_HPP
+#include <cstdint>
+#include <string>
+using namespace std;
+
+namespace VTxx {
+// CPU post-processing of the rendered frame: integer scaling, with optional
+// pixel art filters and scanlines. SSE2 and AVX2 versions are selected at
+// runtime, with a portable fallback
+
+enum class ScaleFilter { NEAREST, SCALE2X, SCALE3X };
+
+struct PostProcConfig {
+  ScaleFilter filter = ScaleFilter::NEAREST;
+  // Total scale factor, which must be a multiple of the filter's own factor.
+  // Anything left over after the filter is done with nearest scaling
+  int scale = 1;
+  // Darken the last line of each scaled source line
+  bool scanlines = false;
+};
+
+// Scale factor applied by the filter itself
+int filter_factor(ScaleFilter filter);
+
+// Parse "nearest", "scale2x" or "scale3x", returning false if not recognised
+bool parse_filter(const string &name, ScaleFilter &filter);
+
+// Process a w x h ARGB8888 frame into dst, which is (w * scale) x (h * scale)
+// with a pitch of dst_pitch pixels
+void postproc_frame(const PostProcConfig &cfg, const uint32_t *src, int w,
+                    int h, uint32_t *dst, int dst_pitch);
+
+// Name of the implementation in use, "avx2", "sse2" or "scalar"
+const char *postproc_impl_name();
+
+} // namespace VTxx
+
+#endif /* end of include guard: POSTPROC_HPP */
@@ -0,0 +1,68 @@
+// AVX2 post-processing. This file is built with -mavx2 on x86 (see the
+// Makefile), and is only used if the CPU supports it
+#include "postproc_kernels.hpp"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace VTxx {
+
+#ifdef __AVX2__
+struct AVX2Ops {
+  typedef __m256i V;
+  static const int width = 8;
+  static V load(const uint32_t *p) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  }
+  static void store(uint32_t *p, V v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+  }
+  static V eq(V a, V b) { return _mm256_cmpeq_epi32(a, b); }
+  static V or_(V a, V b) { return _mm256_or_si256(a, b); }
+  static V andnot(V a, V b) { return _mm256_andnot_si256(a, b); }
+  static V sel(V m, V a, V b) { return _mm256_blendv_epi8(b, a, m); }
+  static V darken(V v) {
+    V h = _mm256_and_si256(_mm256_srli_epi32(v, 1),
+                           _mm256_set1_epi32(0x007F7F7F));
+    V q = _mm256_and_si256(_mm256_srli_epi32(v, 2),
+                           _mm256_set1_epi32(0x003F3F3F));
+    return _mm256_or_si256(_mm256_add_epi32(h, q),
+                           _mm256_set1_epi32(0xFF000000));
+  }
+  // The unpacks work within each 128-bit lane, so put the lanes back in order
+  static void zip2(V a, V b, V &o0, V &o1) {
+    V lo = _mm256_unpacklo_epi32(a, b), hi = _mm256_unpackhi_epi32(a, b);
+    o0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+    o1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+  }
+  // As the SSE2 version in each lane, then reordering the six lanes
+  static void zip3(V a, V b, V c, V &o0, V &o1, V &o2) {
+    __m256 ab_lo = _mm256_castsi256_ps(_mm256_unpacklo_epi32(a, b));
+    __m256 ab_hi = _mm256_castsi256_ps(_mm256_unpackhi_epi32(a, b));
+    __m256 bc_lo = _mm256_castsi256_ps(_mm256_unpacklo_epi32(b, c));
+    __m256 bc_hi = _mm256_castsi256_ps(_mm256_unpackhi_epi32(b, c));
+    __m256 ca_lo = _mm256_castsi256_ps(_mm256_unpacklo_epi32(c, a));
+    __m256 ca_hi = _mm256_castsi256_ps(_mm256_unpackhi_epi32(c, a));
+    V l0 = _mm256_castps_si256(
+        _mm256_shuffle_ps(ab_lo, ca_lo, _MM_SHUFFLE(3, 0, 1, 0)));
+    V l1 = _mm256_castps_si256(
+        _mm256_shuffle_ps(bc_lo, ab_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    V l2 = _mm256_castps_si256(
+        _mm256_shuffle_ps(ca_hi, bc_hi, _MM_SHUFFLE(3, 2, 3, 0)));
+    o0 = _mm256_permute2x128_si256(l0, l1, 0x20);
+    o1 = _mm256_permute2x128_si256(l2, l0, 0x30);
+    o2 = _mm256_permute2x128_si256(l1, l2, 0x31);
+  }
+};
+
+static void postproc_frame_avx2(const PostProcConfig &cfg, const uint32_t *src,
+                                int w, int h, uint32_t *dst, int dst_pitch) {
+  postproc_frame_t<AVX2Ops>(cfg, src, w, h, dst, dst_pitch);
+}
+
+const PostProcFn postproc_avx2 = postproc_frame_avx2;
+#else
+const PostProcFn postproc_avx2 = nullptr;
+#endif
+
+} // namespace VTxx
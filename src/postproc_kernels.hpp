@@ -0,0 +1,207 @@
+#ifndef POSTPROC_KERNELS_HPP
+#define POSTPROC_KERNELS_HPP
+#include "postproc.hpp"
+#include <cstring>
+using namespace std;
+
+// Post-processing kernels, written once against a small vector interface and
+// built for each instruction set in its own translation unit (with the
+// matching compiler flags). An ops type provides:
+//   V, width                  vector type and number of pixels in it
+//   load(p), store(p, v)      unaligned load and store
+//   eq(a, b)                  all ones per pixel where a == b
+//   or_(a, b), andnot(a, b)   a | b and ~a & b
+//   sel(m, a, b)              m ? a : b per pixel
+//   darken(v)                 scanline darkening, to 3/4 brightness
+//   zip2(a, b, o0, o1)        interleave a and b into o0, o1
+//   zip3(a, b, c, o0, o1, o2) interleave a, b and c into o0, o1, o2
+// Everything here is static, and avoids the standard library templates, so
+// that copies built with different flags never get merged by the linker
+
+namespace VTxx {
+
+typedef void (*PostProcFn)(const PostProcConfig &cfg, const uint32_t *src,
+                           int w, int h, uint32_t *dst, int dst_pitch);
+
+// Set by each instruction set's translation unit, or nullptr if it was not
+// built with support for it
+extern const PostProcFn postproc_sse2;
+extern const PostProcFn postproc_avx2;
+
+// Widest source frame supported
+const int postproc_max_width = 512;
+
+// Scale a row of w pixels by k horizontally
+template <typename Ops>
+static void expand_row(const uint32_t *src, int w, int k, uint32_t *dst) {
+  typedef typename Ops::V V;
+  const int n = Ops::width;
+  int x = 0;
+  if (k == 1) {
+    memcpy(dst, src, w * sizeof(uint32_t));
+    return;
+  } else if (k == 2) {
+    for (; x + n <= w; x += n) {
+      V v = Ops::load(src + x), o0, o1;
+      Ops::zip2(v, v, o0, o1);
+      Ops::store(dst + 2 * x, o0);
+      Ops::store(dst + 2 * x + n, o1);
+    }
+  } else if (k == 3) {
+    for (; x + n <= w; x += n) {
+      V v = Ops::load(src + x), o0, o1, o2;
+      Ops::zip3(v, v, v, o0, o1, o2);
+      Ops::store(dst + 3 * x, o0);
+      Ops::store(dst + 3 * x + n, o1);
+      Ops::store(dst + 3 * x + 2 * n, o2);
+    }
+  } else if (k == 4) {
+    for (; x + n <= w; x += n) {
+      V v = Ops::load(src + x), a, b, o0, o1, o2, o3;
+      Ops::zip2(v, v, a, b);
+      Ops::zip2(a, a, o0, o1);
+      Ops::zip2(b, b, o2, o3);
+      Ops::store(dst + 4 * x, o0);
+      Ops::store(dst + 4 * x + n, o1);
+      Ops::store(dst + 4 * x + 2 * n, o2);
+      Ops::store(dst + 4 * x + 3 * n, o3);
+    }
+  }
+  for (; x < w; x++)
+    for (int j = 0; j < k; j++)
+      dst[k * x + j] = src[x];
+}
+
+template <typename Ops> static void darken_row(uint32_t *row, int w) {
+  int x = 0;
+  for (; x + Ops::width <= w; x += Ops::width)
+    Ops::store(row + x, Ops::darken(Ops::load(row + x)));
+  for (; x < w; x++)
+    row[x] = (((row[x] >> 1) & 0x007F7F7F) + ((row[x] >> 2) & 0x003F3F3F)) |
+             0xFF000000;
+}
+
+// Scale2x (AdvMAME2x) on one row. up, mid and dn are the rows above, at and
+// below, padded so that index -1 and w are valid
+template <typename Ops>
+static void scale2x_row(const uint32_t *up, const uint32_t *mid,
+                        const uint32_t *dn, int w, uint32_t *o0,
+                        uint32_t *o1) {
+  typedef typename Ops::V V;
+  const int n = Ops::width;
+  for (int x = 0; x < w; x += n) {
+    // Pixel names as in the reference: B above, D left, E, F right, H below
+    V b = Ops::load(up + x), h = Ops::load(dn + x);
+    V d = Ops::load(mid + x - 1), e = Ops::load(mid + x);
+    V f = Ops::load(mid + x + 1);
+    V flat = Ops::or_(Ops::eq(b, h), Ops::eq(d, f));
+    V e0 = Ops::sel(Ops::andnot(flat, Ops::eq(d, b)), d, e);
+    V e1 = Ops::sel(Ops::andnot(flat, Ops::eq(b, f)), f, e);
+    V e2 = Ops::sel(Ops::andnot(flat, Ops::eq(d, h)), d, e);
+    V e3 = Ops::sel(Ops::andnot(flat, Ops::eq(h, f)), f, e);
+    V r0, r1;
+    Ops::zip2(e0, e1, r0, r1);
+    Ops::store(o0 + 2 * x, r0);
+    Ops::store(o0 + 2 * x + n, r1);
+    Ops::zip2(e2, e3, r0, r1);
+    Ops::store(o1 + 2 * x, r0);
+    Ops::store(o1 + 2 * x + n, r1);
+  }
+}
+
+// Scale3x (AdvMAME3x) on one row, padded as for scale2x_row
+template <typename Ops>
+static void scale3x_row(const uint32_t *up, const uint32_t *mid,
+                        const uint32_t *dn, int w, uint32_t *o0, uint32_t *o1,
+                        uint32_t *o2) {
+  typedef typename Ops::V V;
+  const int n = Ops::width;
+  for (int x = 0; x < w; x += n) {
+    // A B C
+    // D E F
+    // G H I
+    V a = Ops::load(up + x - 1), b = Ops::load(up + x);
+    V c = Ops::load(up + x + 1), d = Ops::load(mid + x - 1);
+    V e = Ops::load(mid + x), f = Ops::load(mid + x + 1);
+    V g = Ops::load(dn + x - 1), h = Ops::load(dn + x);
+    V i = Ops::load(dn + x + 1);
+    V flat = Ops::or_(Ops::eq(b, h), Ops::eq(d, f));
+    V db = Ops::andnot(flat, Ops::eq(d, b));
+    V bf = Ops::andnot(flat, Ops::eq(b, f));
+    V dh = Ops::andnot(flat, Ops::eq(d, h));
+    V hf = Ops::andnot(flat, Ops::eq(h, f));
+    V ea = Ops::eq(e, a), ec = Ops::eq(e, c);
+    V eg = Ops::eq(e, g), ei = Ops::eq(e, i);
+    V e0 = Ops::sel(db, d, e);
+    V e1 = Ops::sel(Ops::or_(Ops::andnot(ec, db), Ops::andnot(ea, bf)), b, e);
+    V e2 = Ops::sel(bf, f, e);
+    V e3 = Ops::sel(Ops::or_(Ops::andnot(eg, db), Ops::andnot(ea, dh)), d, e);
+    V e5 = Ops::sel(Ops::or_(Ops::andnot(ei, bf), Ops::andnot(ec, hf)), f, e);
+    V e6 = Ops::sel(dh, d, e);
+    V e7 = Ops::sel(Ops::or_(Ops::andnot(ei, dh), Ops::andnot(eg, hf)), h, e);
+    V e8 = Ops::sel(hf, f, e);
+    V r0, r1, r2;
+    Ops::zip3(e0, e1, e2, r0, r1, r2);
+    Ops::store(o0 + 3 * x, r0);
+    Ops::store(o0 + 3 * x + n, r1);
+    Ops::store(o0 + 3 * x + 2 * n, r2);
+    Ops::zip3(e3, e, e5, r0, r1, r2);
+    Ops::store(o1 + 3 * x, r0);
+    Ops::store(o1 + 3 * x + n, r1);
+    Ops::store(o1 + 3 * x + 2 * n, r2);
+    Ops::zip3(e6, e7, e8, r0, r1, r2);
+    Ops::store(o2 + 3 * x, r0);
+    Ops::store(o2 + 3 * x + n, r1);
+    Ops::store(o2 + 3 * x + 2 * n, r2);
+  }
+}
+
+// Copy a row with the edge pixels repeated once either side, and enough extra
+// at the end for a whole vector past the end of the row
+static inline void pad_row(const uint32_t *src, int w, uint32_t *dst) {
+  dst[0] = src[0];
+  memcpy(dst + 1, src, w * sizeof(uint32_t));
+  for (int i = w + 1; i < w + 10; i++)
+    dst[i] = src[w - 1];
+}
+
+template <typename Ops>
+static void postproc_frame_t(const PostProcConfig &cfg, const uint32_t *src,
+                             int w, int h, uint32_t *dst, int dst_pitch) {
+  int f = filter_factor(cfg.filter);
+  int k = cfg.scale / f;
+  // The filters write whole vectors, so round their rows up
+  int wv = (w + Ops::width - 1) & ~(Ops::width - 1);
+  int fw = w * f;
+  const int pad_len = postproc_max_width + 10;
+  uint32_t pad[3 * pad_len];
+  uint32_t frows[3 * 3 * postproc_max_width];
+  uint32_t *pr[3] = {pad, pad + pad_len, pad + 2 * pad_len};
+  for (int y = 0; y < h; y++) {
+    if (f > 1) {
+      pad_row(src + ((y > 0) ? (y - 1) : 0) * w, w, pr[0]);
+      pad_row(src + y * w, w, pr[1]);
+      pad_row(src + ((y < h - 1) ? (y + 1) : y) * w, w, pr[2]);
+      if (f == 2)
+        scale2x_row<Ops>(pr[0] + 1, pr[1] + 1, pr[2] + 1, w, &frows[0],
+                         &frows[wv * 2]);
+      else
+        scale3x_row<Ops>(pr[0] + 1, pr[1] + 1, pr[2] + 1, w, &frows[0],
+                         &frows[wv * 3], &frows[2 * wv * 3]);
+    }
+    for (int r = 0; r < f; r++) {
+      const uint32_t *frow = (f > 1) ? &frows[r * wv * f] : (src + y * w);
+      uint32_t *out = dst + size_t((y * f + r) * k) * dst_pitch;
+      expand_row<Ops>(frow, fw, k, out);
+      for (int i = 1; i < k; i++)
+        memcpy(out + i * dst_pitch, out, fw * k * sizeof(uint32_t));
+    }
+    if (cfg.scanlines && cfg.scale > 1)
+      darken_row<Ops>(dst + size_t((y + 1) * cfg.scale - 1) * dst_pitch,
+                      w * cfg.scale);
+  }
+}
+
+} // namespace VTxx
+
+#endif /* end of include guard: POSTPROC_KERNELS_HPP */
@@ -0,0 +1,62 @@
+// SSE2 post-processing. SSE2 is part of the x86-64 baseline, so this needs no
+// extra compiler flags there
+#include "postproc_kernels.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace VTxx {
+
+#ifdef __SSE2__
+struct SSE2Ops {
+  typedef __m128i V;
+  static const int width = 4;
+  static V load(const uint32_t *p) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  }
+  static void store(uint32_t *p, V v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+  }
+  static V eq(V a, V b) { return _mm_cmpeq_epi32(a, b); }
+  static V or_(V a, V b) { return _mm_or_si128(a, b); }
+  static V andnot(V a, V b) { return _mm_andnot_si128(a, b); }
+  static V sel(V m, V a, V b) {
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+  }
+  static V darken(V v) {
+    V h = _mm_and_si128(_mm_srli_epi32(v, 1), _mm_set1_epi32(0x007F7F7F));
+    V q = _mm_and_si128(_mm_srli_epi32(v, 2), _mm_set1_epi32(0x003F3F3F));
+    return _mm_or_si128(_mm_add_epi32(h, q), _mm_set1_epi32(0xFF000000));
+  }
+  static void zip2(V a, V b, V &o0, V &o1) {
+    o0 = _mm_unpacklo_epi32(a, b);
+    o1 = _mm_unpackhi_epi32(a, b);
+  }
+  // [a0 b0 c0 a1] [b1 c1 a2 b2] [c2 a3 b3 c3]
+  static void zip3(V a, V b, V c, V &o0, V &o1, V &o2) {
+    __m128 ab_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(a, b));
+    __m128 ab_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(a, b));
+    __m128 bc_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(b, c));
+    __m128 bc_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(b, c));
+    __m128 ca_lo = _mm_castsi128_ps(_mm_unpacklo_epi32(c, a));
+    __m128 ca_hi = _mm_castsi128_ps(_mm_unpackhi_epi32(c, a));
+    o0 = _mm_castps_si128(
+        _mm_shuffle_ps(ab_lo, ca_lo, _MM_SHUFFLE(3, 0, 1, 0)));
+    o1 = _mm_castps_si128(
+        _mm_shuffle_ps(bc_lo, ab_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    o2 = _mm_castps_si128(
+        _mm_shuffle_ps(ca_hi, bc_hi, _MM_SHUFFLE(3, 2, 3, 0)));
+  }
+};
+
+static void postproc_frame_sse2(const PostProcConfig &cfg, const uint32_t *src,
+                                int w, int h, uint32_t *dst, int dst_pitch) {
+  postproc_frame_t<SSE2Ops>(cfg, src, w, h, dst, dst_pitch);
+}
+
+const PostProcFn postproc_sse2 = postproc_frame_sse2;
+#else
+const PostProcFn postproc_sse2 = nullptr;
+#endif
+
+} // namespace VTxx
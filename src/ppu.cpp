@@ -1,8 +1,12 @@
 #include "ppu.hpp"
+#include "coverage.hpp"
 #include "mmu.hpp"
+#include "platform.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 #include <algorithm>
 #include <atomic>
+#include <cstring>
 #include <cassert>
 #include <condition_variable>
 #include <iostream>
@@ -24,21 +28,55 @@ static volatile uint8_t spram[2048] = {0};
 // bank 1 and the LSW for palette bank 0. Each word is in TRGB1555 format,
 // where the MSb is 1 for transparent and 0 for solid
 static uint32_t *layers[4];
+// When only one palette bank is output, the layers instead use this compact
+// single-plane format: just the TRGB1555 word for that bank. The renderer
+// always passes that bank's palette as pal0, so a dual-plane word narrowed to
+// 16 bits is the single-plane word
+static uint16_t *layers16[4];
+static int out_plane = 0; // palette bank held in single-plane layers
+static int frame_layer_bytes = 0; // bytes per pixel in the last frame's layers
 static int layer_width, layer_height;
 
 // Output buffer in ARGB8888 format
 static uint32_t *obuf;
 static int out_width, out_height;
 
+// Post-processed output, or nullptr if there is no post-processing
+static PostProcConfig pp_cfg;
+static uint32_t *ppbuf = nullptr;
+
 static thread ppu_thread;
 
 enum class ColourMode { IDX_4, IDX_16, IDX_64, IDX_256, ARGB1555 };
 
+// Pick the palettes to draw with for the layer format. Single-plane layers
+// only hold the output bank, which is always drawn as pal0
+static inline void select_plane(const uint32_t *, volatile uint8_t *&,
+                                volatile uint8_t *&) {}
+static inline void select_plane(const uint16_t *, volatile uint8_t *&pal0,
+                                volatile uint8_t *&pal1) {
+  if (out_plane == 1)
+    pal0 = pal1;
+  pal1 = nullptr;
+}
+
+// Write a pixel to a layer, where each bank is only written if solid
+static inline void put_px(uint32_t &d, uint16_t argb0, uint16_t argb1) {
+  if (!(argb0 & 0x8000))
+    d = (d & 0xFFFF0000) | argb0;
+  if (!(argb1 & 0x8000))
+    d = (d & 0x0000FFFF) | (argb1 << 16UL);
+}
+static inline void put_px(uint16_t &d, uint16_t argb0, uint16_t) {
+  if (!(argb0 & 0x8000))
+    d = argb0;
+}
+
 // Our custom (slow) blitting function
+template <typename Px>
 static void vt_blit(int src_width, int src_height, uint8_t *src, int dst_width,
                     int dst_height, int dst_stride, int dst_x, int dst_y,
-                    uint32_t *dst, ColourMode fmt,
-                    volatile uint8_t *pal0 = nullptr,
+                    Px *dst, ColourMode fmt, volatile uint8_t *pal0 = nullptr,
                     volatile uint8_t *pal1 = nullptr) {
   uint8_t *srcptr = src;
   int src_bit = 0;
@@ -46,7 +84,7 @@ static void vt_blit(int src_width, int src_height, uint8_t *src, int dst_width,
     int dy = dst_y + sy;
     for (int sx = 0; sx < src_width; sx++) {
       int dx = dst_x + sx;
-      uint16_t argb0, argb1;
+      uint16_t argb0 = 0x8000, argb1 = 0x8000;
       if (fmt == ColourMode::ARGB1555) {
         argb0 = (*(srcptr + 1) << 8UL) | (*srcptr);
         argb1 = argb0;
@@ -107,16 +145,8 @@ static void vt_blit(int src_width, int src_height, uint8_t *src, int dst_width,
             argb1 = (pal1[2 * raw + 1] << 8) | pal1[2 * raw];
         }
       }
-      if ((dx >= 0) && (dx < dst_width) && (dy >= 0) && (dy < dst_height)) {
-        if (!(argb0 & 0x8000)) {
-          dst[dy * dst_stride + dx] =
-              (dst[dy * dst_stride + dx] & 0xFFFF0000) | argb0;
-        }
-        if (!(argb1 & 0x8000)) {
-          dst[dy * dst_stride + dx] =
-              (dst[dy * dst_stride + dx] & 0x0000FFFF) | (argb1 << 16UL);
-        }
-      }
+      if ((dx >= 0) && (dx < dst_width) && (dy >= 0) && (dy < dst_height))
+        put_px(dst[dy * dst_stride + dx], argb0, argb1);
     }
   }
 };
@@ -125,46 +155,152 @@ const int reg_sp_seg_lsb = 0x1A;
 const int reg_sp_seg_msb = 0x1B;
 const int reg_sp_ctrl = 0x18;
 
-// Get character data from ROM for an item
-static void get_char_data(uint16_t seg, uint16_t vector, int w, int h,
-                          ColourMode fmt, bool bmp, uint8_t *buf) {
-  int spacing = 0;
-  if (bmp || fmt == ColourMode::ARGB1555) {
-    spacing = 16 * 16;
-  } else {
-    spacing = w * h;
-  }
-  int bpp = 0;
+static int get_bpp(ColourMode fmt) {
   switch (fmt) {
   case ColourMode::ARGB1555:
-    bpp = 16;
-    break;
+    return 16;
   case ColourMode::IDX_256:
-    bpp = 8;
-    break;
+    return 8;
   case ColourMode::IDX_64:
-    bpp = 6;
-    break;
+    return 6;
   case ColourMode::IDX_16:
-    bpp = 4;
-    break;
+    return 4;
   case ColourMode::IDX_4:
-    bpp = 2;
-    break;
+    return 2;
   }
+  assert(false);
+}
+
+// Get the physical address of the character data for an item
+static uint32_t get_char_addr(uint16_t seg, uint16_t vector, int w, int h,
+                              ColourMode fmt, bool bmp) {
+  int spacing = 0;
+  if (bmp || fmt == ColourMode::ARGB1555) {
+    spacing = 16 * 16;
+  } else {
+    spacing = w * h;
+  }
+  int bpp = get_bpp(fmt);
   if (bpp == 16)
     spacing *= 8;
   else
     spacing *= bpp;
   spacing /= 8;
-  uint32_t pa = (seg << 13UL) + vector * spacing;
+  return (seg << 13UL) + vector * spacing;
+}
+
+// Get character data from ROM for an item
+static void get_char_data(uint16_t seg, uint16_t vector, int w, int h,
+                          ColourMode fmt, bool bmp, uint8_t *buf) {
+  uint32_t pa = get_char_addr(seg, vector, w, h, fmt, bmp);
   // cout << "pa = 0x" << hex << pa << endl;
-  int len = (w * h * bpp) / 8;
+  int len = (w * h * get_bpp(fmt)) / 8;
+#ifdef OPENVTX_COVERAGE
+  coverage_mark(COVERAGE_TILE, pa, len);
+#endif
   for (int i = 0; i < len; i++)
     buf[i] = read_mem_physical(pa + i);
 }
 
-static void render_sprites() {
+static inline uint64_t load_le64(const uint8_t *p) {
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  x = __builtin_bswap64(x);
+#endif
+  return x;
+}
+
+// Colour index to layer word lookup for the bitmap fast path, along with the
+// mask of bits to keep from the existing layer word. Index 0 is transparent,
+// as is a plane with no palette
+template <typename Px> struct PixelLUT {
+  Px val[256];
+  Px keep[256];
+  int pal_offset = -1;
+  bool has_pal0 = false, has_pal1 = false;
+};
+
+template <typename Px>
+static void build_lut(PixelLUT<Px> &lut, int n, uint16_t pal_offset,
+                      volatile uint8_t *pal0, volatile uint8_t *pal1) {
+  lut.pal_offset = pal_offset;
+  lut.has_pal0 = (pal0 != nullptr);
+  lut.has_pal1 = (pal1 != nullptr);
+  lut.val[0] = 0;
+  lut.keep[0] = Px(0xFFFFFFFF);
+  for (int i = 1; i < n; i++) {
+    uint32_t val = 0, keep = 0xFFFFFFFF;
+    if (pal0 != nullptr) {
+      uint16_t argb0 = (pal0[2 * i + 1] << 8) | pal0[2 * i];
+      if (!(argb0 & 0x8000)) {
+        val |= argb0;
+        keep &= 0xFFFF0000;
+      }
+    }
+    if (pal1 != nullptr) {
+      uint16_t argb1 = (pal1[2 * i + 1] << 8) | pal1[2 * i];
+      if (!(argb1 & 0x8000)) {
+        val |= (argb1 << 16UL);
+        keep &= 0x0000FFFF;
+      }
+    }
+    lut.val[i] = Px(val);
+    lut.keep[i] = Px(keep);
+  }
+}
+
+// Unpack a little endian stream of n pixels of 2, 4, 6 or 8 bpp into one byte
+// per pixel, a 64-bit word at a time
+static void unpack_indices(const uint8_t *src, int n, int bpp, uint8_t *idx) {
+  if (bpp == 8) {
+    memcpy(idx, src, n);
+  } else if (bpp == 6) {
+    // 8 pixels per 48 bits
+    for (int i = 0; i < n; i += 8, src += 6) {
+      uint64_t w = load_le64(src) & 0xFFFFFFFFFFFFULL;
+      for (int j = 0; j < 8; j++, w >>= 6)
+        idx[i + j] = w & 0x3F;
+    }
+  } else {
+    int per_word = 64 / bpp;
+    uint64_t mask = (1U << bpp) - 1;
+    for (int i = 0; i < n; i += per_word, src += 8) {
+      uint64_t w = load_le64(src);
+      for (int j = 0; j < per_word; j++, w >>= bpp)
+        idx[i + j] = w & mask;
+    }
+  }
+}
+
+// Fast path for a row of n indexed pixels
+template <typename Px>
+static void blit_row_indexed(const uint8_t *idx, int n, Px *dst,
+                             const PixelLUT<Px> &lut) {
+  for (int i = 0; i < n; i++)
+    dst[i] = (dst[i] & lut.keep[idx[i]]) | lut.val[idx[i]];
+}
+
+// Fast path for a row of n ARGB1555 pixels, which go to both palette planes
+template <typename Px>
+static void blit_row_argb1555(const uint8_t *src, int n, Px *dst) {
+  int i = 0;
+  for (; i < (n & ~3); i += 4) {
+    uint64_t w = load_le64(src + 2 * i);
+    for (int j = 0; j < 4; j++, w >>= 16) {
+      uint32_t argb = w & 0xFFFF;
+      Px solid = Px(((argb >> 15) & 0x1) - 1); // all ones if not transparent
+      dst[i + j] = (dst[i + j] & ~solid) | (Px(argb | (argb << 16UL)) & solid);
+    }
+  }
+  for (; i < n; i++) {
+    uint32_t argb = (src[2 * i + 1] << 8) | src[2 * i];
+    if (!(argb & 0x8000))
+      dst[i] = Px(argb | (argb << 16UL));
+  }
+}
+
+template <typename Px> static void render_sprites(Px *const *lyr) {
   // TODO: lots of rendering fixes, e.g. multi palette blending, sprite per line
   // limit, "dig"
   bool sp_en = get_bit(ppu_regs_shadow[reg_sp_ctrl], 2);
@@ -199,8 +335,9 @@ static void render_sprites() {
       pal0 = (vram + 0x1E00 + 32 * palette);
     if (spalsel || psel)
       pal1 = (vram + 0x1C00 + 32 * palette);
+    select_plane(lyr[layer], pal0, pal1);
     vt_blit(sp_width, sp_height, tempbuf, layer_width, layer_height,
-            layer_width, x, y, layers[layer], ColourMode::IDX_16, pal0, pal1);
+            layer_width, x, y, lyr[layer], ColourMode::IDX_16, pal0, pal1);
   }
 }
 
@@ -208,7 +345,7 @@ const int reg_bkg_x[2] = {0x10, 0x14};
 const int reg_bkg_y[2] = {0x11, 0x15};
 const int reg_bkg_ctrl1[2] = {0x12, 0x16};
 
-// const int reg_bkg_linescroll = 0x20;
+const int reg_bkg_linescroll = 0x20;
 const int reg_bkg_ctrl2[2] = {0x13, 0x17};
 
 const int reg_bkg_pal_sel = 0x0F;
@@ -308,8 +445,37 @@ static pair<uint16_t, bool> get_tile_addr(int tx, int ty, bool y8, bool x8,
   }
 }
 
+// A run of lines that share the same horizontal scroll
+struct ScrollSpan {
+  int y0, y1;
+  int xoff;
+  bool x8;
+};
+
+// Read a line scroll table from VRAM, grouping lines with the same scroll into
+// spans so each span can be drawn with the normal tile path. Tables are 0x200
+// bytes per bank, with two bytes per line: X scroll bits 7..0, then the X8 bit
+// in bit 0. This needs checking as the datasheet says very little about it
+static int get_line_scroll_spans(int bank, ScrollSpan *spans) {
+  uint8_t tbl[0x200];
+  copy(vram + bank * 0x200, vram + (bank + 1) * 0x200, tbl);
+  int n = 0;
+  for (int y = 0; y < layer_height; y++) {
+    bool x8 = get_bit(tbl[2 * y + 1], 0);
+    int xoff = unsigned(tbl[2 * y]);
+    if (x8)
+      xoff = xoff - 256;
+    if (n > 0 && spans[n - 1].xoff == xoff && spans[n - 1].x8 == x8)
+      spans[n - 1].y1 = y + 1;
+    else
+      spans[n++] = {y, y + 1, xoff, x8};
+  }
+  return n;
+}
+
 // Render the given background layer (idx = [0, 1])
-static void render_background(int idx) {
+template <typename Px>
+static void render_background(int idx, Px *const *lyr) {
   bool en = get_bit(ppu_regs_shadow[reg_bkg_ctrl2[idx]], 7);
   if (!en)
     return;
@@ -353,8 +519,7 @@ static void render_background(int idx) {
       (idx == 0) ? get_bit(ppu_regs_shadow[reg_bkg_ctrl2[idx]], 1) : false;
   BkgScrollMode scrl_mode =
       (BkgScrollMode)((ppu_regs_shadow[reg_bkg_ctrl1[idx]] >> 2) & 0x03);
-  // bool line_scroll = get_bit(ppu_regs_shadow[reg_bkg_linescroll], 4 + idx);
-  // int line_scroll_bank = ppu_regs_shadow[reg_bkg_linescroll] & 0x0F;
+  bool line_scroll = get_bit(ppu_regs_shadow[reg_bkg_linescroll], 4 + idx);
   bool bkx_size = get_bit(ppu_regs_shadow[reg_bkg_ctrl2[idx]], 0);
   int tile_height = bmp ? 1 : (bkx_size ? 16 : 8);
   int tile_width = bmp ? 256 : (bkx_size ? 16 : 8);
@@ -365,57 +530,109 @@ static void render_background(int idx) {
   int yn = 256;
   int xn = 256;
   uint8_t char_buf[512];
+  uint8_t idx_buf[256];
+  PixelLUT<Px> lut;
 
   uint16_t seg = ((ppu_regs_shadow[reg_bkg_seg_msb[idx]] & 0x0F) << 8UL) |
                  ppu_regs_shadow[reg_bkg_seg_lsb[idx]];
 
-  for (int y = y0; y < yn; y += tile_height) {
-    for (int x = x0; x < xn; x += tile_width) {
-      int lx = x + xoff;
+  // Without line scroll the whole layer is one span
+  ScrollSpan spans[256];
+  int n_spans = 1;
+  if (line_scroll)
+    n_spans = get_line_scroll_spans(
+        ppu_regs_shadow[reg_bkg_linescroll] & 0x0F, spans);
+  else
+    spans[0] = {0, layer_height, xoff, x8};
+
+  for (int s = 0; s < n_spans; s++) {
+    const ScrollSpan &span = spans[s];
+    for (int y = y0; y < yn; y += tile_height) {
       int ly = y + yoff;
-      int tx = (x - x0) / tile_width;
-      int ty = (y - y0) / tile_height;
-      // Various inefficiencies here, should not draw unless at least part
-      // visible
-      auto tile_d =
-          get_tile_addr(tx, ty, y8, x8, tile_width, bmp, idx, scrl_mode);
-      uint16_t tile_addr = tile_d.first;
-      bool tile_mapped = tile_d.second;
-      if (!tile_mapped)
+      if (ly + tile_height <= span.y0 || ly >= span.y1)
         continue;
-      uint16_t cell = (vram[tile_addr + 1] << 8UL) | vram[tile_addr];
-      uint16_t vector = cell & 0xFFF;
-      uint8_t cell_pal_bk = (cell >> 12) & 0x0F;
-      if (vector == 0) // transparent
-        continue;
-      uint8_t pal_bank = 0;
-      uint8_t depth = 0;
-      if (bkx_pal) {
-        depth = (ppu_regs_shadow[reg_bkg_ctrl2[idx]] >> 4) & 0x03;
-        pal_bank = (fmt == ColourMode::IDX_16)
-                       ? cell_pal_bk
-                       : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
-      } else {
-        depth = cell_pal_bk & 0x03;
-        pal_bank = (fmt == ColourMode::IDX_16)
-                       ? (((ppu_regs_shadow[reg_bkg_ctrl2[idx]] >> 4) & 0x03) |
-                          (cell_pal_bk >> 2))
-                       : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
-      }
+      for (int x = x0; x < xn; x += tile_width) {
+        int lx = x + span.xoff;
+        int tx = (x - x0) / tile_width;
+        int ty = (y - y0) / tile_height;
+        // Various inefficiencies here, should not draw unless at least part
+        // visible
+        auto tile_d = get_tile_addr(tx, ty, y8, span.x8, tile_width, bmp,
+                                    idx, scrl_mode);
+        uint16_t tile_addr = tile_d.first;
+        bool tile_mapped = tile_d.second;
+        if (!tile_mapped)
+          continue;
+        uint16_t cell = (vram[tile_addr + 1] << 8UL) | vram[tile_addr];
+        uint16_t vector = cell & 0xFFF;
+        uint8_t cell_pal_bk = (cell >> 12) & 0x0F;
+        if (vector == 0) // transparent
+          continue;
+        uint8_t pal_bank = 0;
+        uint8_t depth = 0;
+        if (bkx_pal) {
+          depth = (ppu_regs_shadow[reg_bkg_ctrl2[idx]] >> 4) & 0x03;
+          pal_bank =
+              (fmt == ColourMode::IDX_16)
+                  ? cell_pal_bk
+                  : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
+        } else {
+          depth = cell_pal_bk & 0x03;
+          pal_bank =
+              (fmt == ColourMode::IDX_16)
+                  ? (((ppu_regs_shadow[reg_bkg_ctrl2[idx]] >> 4) & 0x03) |
+                     (cell_pal_bk >> 2))
+                  : ((fmt == ColourMode::IDX_64) ? (cell_pal_bk >> 2) : 0);
+        }
 
-      get_char_data(seg, vector, tile_width, tile_height, fmt, bmp, char_buf);
-      // TODO: line scrolling
-      uint16_t palette_offset =
-          (fmt == ColourMode::IDX_16)
-              ? (pal_bank * 32)
-              : (fmt == ColourMode::IDX_64 ? (pal_bank * 128) : 0);
-      volatile uint8_t *pal0 = nullptr, *pal1 = nullptr;
-      if (render_pal0)
-        pal0 = (vram + 0x1E00 + palette_offset);
-      if (render_pal1)
-        pal1 = (vram + 0x1C00 + palette_offset);
-      vt_blit(tile_width, tile_height, char_buf, layer_width, layer_height,
-              layer_width, lx, ly, layers[depth & 0x03], fmt, pal0, pal1);
+        uint16_t palette_offset =
+            (fmt == ColourMode::IDX_16)
+                ? (pal_bank * 32)
+                : (fmt == ColourMode::IDX_64 ? (pal_bank * 128) : 0);
+        volatile uint8_t *pal0 = nullptr, *pal1 = nullptr;
+        if (render_pal0)
+          pal0 = (vram + 0x1E00 + palette_offset);
+        if (render_pal1)
+          pal1 = (vram + 0x1C00 + palette_offset);
+        Px *dst = lyr[depth & 0x03];
+        select_plane(dst, pal0, pal1);
+        if (bmp || fmt == ColourMode::ARGB1555) {
+          // Bitmap and hi-colour fast path, a row at a time straight from ROM
+          int bpp = get_bpp(fmt);
+          int row_len = (tile_width * bpp) / 8;
+          uint32_t pa =
+              get_char_addr(seg, vector, tile_width, tile_height, fmt, bmp);
+          const uint8_t *src = get_physical_ptr(pa, row_len * tile_height);
+#ifdef OPENVTX_COVERAGE
+          coverage_mark(COVERAGE_TILE, pa, row_len * tile_height);
+#endif
+          int sx0 = max(0, -lx), sx1 = min(tile_width, layer_width - lx);
+          if (fmt != ColourMode::ARGB1555 &&
+              (lut.pal_offset != palette_offset ||
+               lut.has_pal0 != (pal0 != nullptr) ||
+               lut.has_pal1 != (pal1 != nullptr)))
+            build_lut(lut, 1 << bpp, palette_offset, pal0, pal1);
+          for (int r = 0; r < tile_height; r++, src += row_len) {
+            int dy = ly + r;
+            if (dy < span.y0 || dy >= span.y1 || sx0 >= sx1)
+              continue;
+            Px *row = dst + dy * layer_width + lx + sx0;
+            if (fmt == ColourMode::ARGB1555) {
+              blit_row_argb1555(src + 2 * sx0, sx1 - sx0, row);
+            } else {
+              unpack_indices(src, tile_width, bpp, idx_buf);
+              blit_row_indexed(idx_buf + sx0, sx1 - sx0, row, lut);
+            }
+          }
+        } else {
+          get_char_data(seg, vector, tile_width, tile_height, fmt, bmp,
+                        char_buf);
+          // Clip to the lines of this span
+          vt_blit(tile_width, tile_height, char_buf, layer_width,
+                  span.y1 - span.y0, layer_width, lx, ly - span.y0,
+                  dst + span.y0 * layer_width, fmt, pal0, pal1);
+        }
+      }
     }
   }
 }
@@ -456,7 +673,7 @@ static inline uint32_t argb1555_to_rgb8888(uint16_t x) {
 
 // Merge the layers and convert to ARGB8888. Set lcd to true to merge for LCD
 // rather than TV output
-static void merge_layers(bool lcd = false) {
+static void merge_layers(uint32_t *const *lyr, bool lcd = false) {
   bool output_pal0 = get_bit(ppu_regs_shadow[reg_pal_sel], lcd ? 0 : 1);
   bool output_pal1 = get_bit(ppu_regs_shadow[reg_pal_sel], lcd ? 2 : 3);
   bool blend_pal = get_bit(ppu_regs_shadow[reg_pal_sel], lcd ? 5 : 4);
@@ -464,7 +681,7 @@ static void merge_layers(bool lcd = false) {
     for (int x = 0; x < out_width; x++) {
       uint16_t pal0 = 0x8000, pal1 = 0x8000;
       for (int l = 3; l >= 0; l--) {
-        uint32_t raw = layers[l][y * layer_width + x];
+        uint32_t raw = lyr[l][y * layer_width + x];
         if (!(raw & 0x8000)) {
           pal0 = raw & 0xFFFF;
         }
@@ -487,35 +704,81 @@ static void merge_layers(bool lcd = false) {
   }
 }
 
-static void clear_layer(uint32_t *ptr, int w, int h) {
-  fill(ptr, ptr + (w * h), 0x80008000); // fill with transparent
+// Merge single-plane layers, which only need the top solid pixel. Their
+// palette bank was picked for the TV output when they were drawn
+static void merge_layers(uint16_t *const *lyr) {
+  for (int y = 0; y < out_height; y++) {
+    const uint16_t *l0 = lyr[0] + y * layer_width,
+                   *l1 = lyr[1] + y * layer_width,
+                   *l2 = lyr[2] + y * layer_width,
+                   *l3 = lyr[3] + y * layer_width;
+    uint32_t *out = obuf + y * out_width;
+    for (int x = 0; x < out_width; x++) {
+      uint16_t res = l0[x];
+      if (res & 0x8000)
+        res = l1[x];
+      if (res & 0x8000)
+        res = l2[x];
+      if (res & 0x8000)
+        res = l3[x];
+      out[x] = argb1555_to_rgb8888(res);
+    }
+  }
 }
 
-static void clear_layers() {
+template <typename Px> static void clear_layer(Px *ptr, int w, int h) {
+  fill(ptr, ptr + (w * h), Px(0x80008000)); // fill with transparent
+}
+
+// Draw all layers in the given format and merge them to the output
+template <typename Px> static void render_layers(Px *const *lyr) {
+  // Fill all layers with transparent
   for (int i = 0; i < 4; i++)
-    clear_layer(layers[i], layer_width, layer_height);
+    clear_layer(lyr[i], layer_width, layer_height);
+  // Render background layers (lower index has priority)
+  for (int i = 1; i >= 0; i--)
+    render_background(i, lyr);
+  // Render sprites
+  render_sprites(lyr);
+  // Merge to output
+  merge_layers(lyr);
 }
 
 static atomic<bool> render_done(false);
+// CPU clock of the VBLANK end that started the render, for tracing
+static uint64_t render_clock = 0;
 
 // Render and merge all layers
 static void do_render() {
   render_done = false;
+  if (trace_on)
+    trace_begin(TraceThread::RENDER, "render", render_clock);
   // Make a shadow copy of the PPU registers for thread safety - the CPU
   // shouldn't really be accessing them though anyway
   {
     lock_guard<std::mutex> guard(regs_mutex);
     copy(ppu_regs, ppu_regs + 256, ppu_regs_shadow);
   }
-  // Fill all layers with transparent
-  clear_layers();
-  // Render background layers (lower index has priority)
-  for (int i = 1; i >= 0; i--)
-    render_background(i);
-  // Render sprites
-  render_sprites();
-  // Merge to output
-  merge_layers(false);
+  // Both palette banks are only needed when both are output (TV), otherwise
+  // use the compact single-plane layers
+  bool output_pal0 = get_bit(ppu_regs_shadow[reg_pal_sel], 1);
+  bool output_pal1 = get_bit(ppu_regs_shadow[reg_pal_sel], 3);
+  if (output_pal0 && output_pal1) {
+    render_layers(layers);
+    frame_layer_bytes = 4;
+  } else if (output_pal0 || output_pal1) {
+    out_plane = output_pal1 ? 1 : 0;
+    render_layers(layers16);
+    frame_layer_bytes = 2;
+  } else {
+    fill(obuf, obuf + (out_width * out_height), 0xFF000000);
+    frame_layer_bytes = 0;
+  }
+  if (ppbuf != nullptr)
+    postproc_frame(pp_cfg, obuf, out_width, out_height, ppbuf,
+                   out_width * pp_cfg.scale);
+  if (trace_on)
+    trace_end(TraceThread::RENDER, "render", render_clock);
   render_done = true;
 };
 
@@ -536,54 +799,150 @@ void ppu_render_thread() {
     lk.unlock();
   }
 }
-// Defaults to PAL
-static uint32_t vblank_start = 0;
-static uint32_t vblank_len = 22036;
-static uint32_t v_total = 106392;
-
-static uint32_t ticks = 0;
-// Called once every CPU clock
-void ppu_tick() {
-  ticks += 1;
-  if (ticks >= v_total) {
-    ticks = 0;
-    // TODO: signal vblank NMI
-  } else if (ticks == vblank_len) {
-    // Render begins at end of VBLANK
-    {
-      lock_guard<mutex> lk(do_render_m);
-      render_ready = true;
+// The PPU doesn't run every clock. Instead it keeps the CPU clock of its next
+// event (VBLANK start or end) and catches up to the CPU clock lazily, when its
+// registers are accessed or when the scheduler reaches that event
+static uint64_t frame_start = 0;    // CPU clock of the current VBLANK start
+static uint64_t next_event_clk = 0; // CPU clock of the next VBLANK start/end
+static bool in_vblank = false;
+static uint8_t pending_events = 0;
+
+static bool threaded_render = true;
+// Off to skip rendering, see ppu_set_render
+static bool render_on = true;
+
+static void start_render(uint64_t clock) {
+  if (!render_on)
+    return;
+  if (!threaded_render) {
+    render_clock = clock;
+    do_render();
+    return;
+  }
+  {
+    lock_guard<mutex> lk(do_render_m);
+    render_clock = clock;
+    render_ready = true;
+  }
+  do_render_cv.notify_one();
+}
+
+template <typename T> void ppu_sync_t(uint64_t now) {
+  while (now >= next_event_clk) {
+    if (in_vblank) {
+      // Render begins at end of VBLANK
+      in_vblank = false;
+      uint64_t end_clk = next_event_clk;
+      if (trace_on)
+        trace_end(TraceThread::MAIN, "vblank", end_clk);
+      next_event_clk = frame_start + T::v_total;
+      pending_events |= PPU_EV_VBLANK_END;
+      start_render(end_clk);
+    } else {
+      frame_start = next_event_clk;
+      in_vblank = true;
+      next_event_clk = frame_start + T::vblank_len;
+      pending_events |= PPU_EV_VBLANK_START;
+      if (trace_on)
+        trace_begin(TraceThread::MAIN, "vblank", frame_start);
     }
-    do_render_cv.notify_one();
   }
 }
 
+template void ppu_sync_t<PALTiming>(uint64_t now);
+template void ppu_sync_t<NTSCTiming>(uint64_t now);
+
+// Sync for the paths that don't know the timing at compile time
+static void (*ppu_sync)(uint64_t now) = ppu_sync_t<PALTiming>;
+
+uint64_t ppu_next_event() { return next_event_clk; }
+
+uint8_t ppu_take_events() {
+  uint8_t ev = pending_events;
+  pending_events = 0;
+  return ev;
+}
+
 bool ppu_is_render_done() { return render_done; }
 
-bool ppu_is_vblank() { return (ticks >= vblank_start && ticks < vblank_len); }
+void ppu_set_render(bool on) { render_on = on; }
+
+bool ppu_is_vblank() {
+  ppu_sync(cpu_clock);
+  return in_vblank;
+}
 
 uint32_t *get_render_buffer() { return obuf; }
 
-void ppu_init() {
+const uint8_t *ppu_get_layer(int idx, size_t &len) {
+  len = size_t(layer_width * layer_height) * frame_layer_bytes;
+  if (frame_layer_bytes == 2)
+    return reinterpret_cast<const uint8_t *>(layers16[idx]);
+  return reinterpret_cast<const uint8_t *>(layers[idx]);
+}
+
+void ppu_set_postproc(const PostProcConfig &cfg) {
+  pp_cfg = cfg;
+  delete[] ppbuf;
+  ppbuf = nullptr;
+  if (cfg.scale > 1)
+    ppbuf = new uint32_t[(out_width * cfg.scale) * (out_height * cfg.scale)];
+}
+
+uint32_t *get_output_buffer(int &width, int &height) {
+  if (ppbuf == nullptr) {
+    width = out_width;
+    height = out_height;
+    return obuf;
+  }
+  width = out_width * pp_cfg.scale;
+  height = out_height * pp_cfg.scale;
+  return ppbuf;
+}
+
+void ppu_init(VideoTiming timing, bool threaded) {
+  threaded_render = threaded;
+  render_on = true;
+  ppu_sync = (timing == VideoTiming::NTSC) ? ppu_sync_t<NTSCTiming>
+                                           : ppu_sync_t<PALTiming>;
+  frame_start = 0;
+  next_event_clk = cpu_clock;
+  in_vblank = false;
+  pending_events = 0;
   layer_width = 256;
   layer_height = 256;
+  fill(ppu_regs, ppu_regs + sizeof(ppu_regs), 0);
+  fill(vram, vram + sizeof(vram), 0);
+  fill(spram, spram + sizeof(spram), 0);
 
+  // Buffers from an earlier init
+  for (int i = 0; i < 4; i++) {
+    delete[] layers[i];
+    delete[] layers16[i];
+  }
+  delete[] obuf;
   for (int i = 0; i < 4; i++) {
     layers[i] = new uint32_t[layer_width * layer_height];
+    layers16[i] = new uint16_t[layer_width * layer_height];
   }
   out_width = 256;
   out_height = 240;
   obuf = new uint32_t[out_width * out_height];
-  ppu_thread = thread(ppu_render_thread);
+  fill(obuf, obuf + (out_width * out_height), 0xFF000000);
+  if (threaded_render)
+    ppu_thread = thread(ppu_render_thread);
 }
 
 void ppu_stop() {
+  if (!threaded_render)
+    return;
   {
     lock_guard<mutex> lk(do_render_m);
     render_ready = true;
     kill_renderer = true;
   }
   do_render_cv.notify_one();
+  ppu_thread.join();
 }
 
 const uint8_t reg_ppu_stat = 0x01;
@@ -596,23 +955,32 @@ const uint8_t reg_vram_addr_msb = 0x06;
 const uint8_t reg_vram_addr_lsb = 0x05;
 const uint8_t reg_vram_data = 0x07;
 
+uint16_t ppu_vram_addr() {
+  return ((ppu_regs[reg_vram_addr_msb] & 0x1F) << 8) |
+         ppu_regs[reg_vram_addr_lsb];
+}
+
+uint16_t ppu_spram_addr() {
+  return ((ppu_regs[reg_spram_addr_msb] & 0x07) << 8) |
+         ppu_regs[reg_spram_addr_lsb];
+}
+
+uint8_t ppu_peek_vram(uint16_t addr) { return vram[addr & 0x1FFF]; }
+uint8_t ppu_peek_spram(uint16_t addr) { return spram[addr & 0x7FF]; }
+uint8_t ppu_peek_reg(uint8_t addr) { return ppu_regs[addr]; }
+
 uint8_t ppu_read(uint8_t address) {
+  ppu_sync(cpu_clock);
   switch (address) {
-  case reg_spram_data: {
-    uint16_t spram_addr = ((ppu_regs[reg_spram_addr_msb] & 0x07) << 8) |
-                          ppu_regs[reg_spram_addr_lsb];
-    return spram[spram_addr]; // TODO: are SPRAM and VRAM reads swapped?
-  }
-  case reg_vram_data: {
-    uint16_t vram_addr = ((ppu_regs[reg_vram_addr_msb] & 0x1F) << 8) |
-                         ppu_regs[reg_vram_addr_lsb];
-    // cout << "vram rd " << hex << vram_addr;
-    return vram[vram_addr]; // TODO: are SPRAM and VRAM reads
-                            // swapped?
-  }
+  case reg_spram_data:
+    return spram[ppu_spram_addr()]; // TODO: are SPRAM and VRAM reads swapped?
+  case reg_vram_data:
+    // cout << "vram rd " << hex << ppu_vram_addr();
+    return vram[ppu_vram_addr()]; // TODO: are SPRAM and VRAM reads
+                                  // swapped?
   case reg_ppu_stat: {
     // Clear VBLANK IRQ here
-    return (ppu_is_vblank() << 7);
+    return (in_vblank << 7);
   }
   default:
     return ppu_regs[address];
@@ -620,10 +988,10 @@ uint8_t ppu_read(uint8_t address) {
 }
 
 void ppu_write(uint8_t address, uint8_t data) {
+  ppu_sync(cpu_clock);
   switch (address) {
   case reg_spram_data: {
-    uint16_t spram_addr = ((ppu_regs[reg_spram_addr_msb] & 0x07) << 8) |
-                          ppu_regs[reg_spram_addr_lsb];
+    uint16_t spram_addr = ppu_spram_addr();
     spram[spram_addr++] = data;
     if ((spram_addr & 0x07) >= 6) { // TODO: check, is this just for DMA?
       spram_addr &= ~0x07;
@@ -634,8 +1002,7 @@ void ppu_write(uint8_t address, uint8_t data) {
     break;
   }
   case reg_vram_data: {
-    uint16_t vram_addr = ((ppu_regs[reg_vram_addr_msb] & 0x1F) << 8) |
-                         ppu_regs[reg_vram_addr_lsb];
+    uint16_t vram_addr = ppu_vram_addr();
     // cout << "vram wr " << hex << vram_addr << " d=" << int(data) << endl;
     vram[vram_addr++] = data;
     ppu_regs[reg_vram_addr_msb] = (vram_addr >> 8) & 0x1F;
@@ -656,4 +1023,14 @@ void ppu_write(uint8_t address, uint8_t data) {
 
 bool ppu_nmi_enabled() { return get_bit(ppu_regs[0], 0); }
 
+void ppu_state(StateIO &io) {
+  io.bytes(ppu_regs, sizeof(ppu_regs));
+  io.bytes(vram, sizeof(vram));
+  io.bytes(spram, sizeof(spram));
+  io.pod(frame_start);
+  io.pod(next_event_clk);
+  io.pod(in_vblank);
+  io.pod(pending_events);
+}
+
 } // namespace VTxx
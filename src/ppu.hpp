@@ -1,5 +1,9 @@
 #ifndef PPU_H
 #define PPU_H
+#include "platform.hpp"
+#include "postproc.hpp"
+#include "state.hpp"
+#include <cstddef>
 #include <cstdint>
 
 using namespace std;
@@ -8,23 +12,63 @@ namespace VTxx {
 // Multithreaded VT1682 PPU - at the moment this is a simple but very inaccurate
 // implementation
 
-void ppu_init();
+// With threaded false, frames are rendered on the calling thread as soon as
+// VBLANK ends, rather than on the render thread
+void ppu_init(VideoTiming timing, bool threaded = true);
 void ppu_stop();
 
-// Call once every four clocks (i.e. once every cpu tick)
-void ppu_tick();
+// The PPU has no per-clock work. It catches up to cpu_clock when its registers
+// are accessed, and the scheduler calls ppu_sync_t once cpu_clock reaches
+// ppu_next_event(). T is the frame timing (PALTiming or NTSCTiming)
+template <typename T> void ppu_sync_t(uint64_t now);
+uint64_t ppu_next_event();
+
+// Events that have happened since the last call, as a mask of PPU_EV_*
+const uint8_t PPU_EV_VBLANK_START = 0x01;
+const uint8_t PPU_EV_VBLANK_END = 0x02;
+uint8_t ppu_take_events();
 
 // Write/Read PPU address space, address is 0..255 relative to 0x2000
 void ppu_write(uint8_t addr, uint8_t data);
 uint8_t ppu_read(uint8_t addr);
 
+// For the debugger, without side effects: the VRAM and SPRAM addresses the
+// data ports (0x2007 and 0x2004) will access next, and the contents of VRAM,
+// SPRAM and the registers
+uint16_t ppu_vram_addr();
+uint16_t ppu_spram_addr();
+uint8_t ppu_peek_vram(uint16_t addr);
+uint8_t ppu_peek_spram(uint16_t addr);
+uint8_t ppu_peek_reg(uint8_t addr);
+
+// The registers, VRAM, SPRAM and frame timing. The render buffers aren't
+// included, they hold the last frame until the next is rendered
+void ppu_state(StateIO &io);
+
 bool ppu_is_render_done();
+// Turn rendering off or back on, for runs that don't need the output. While
+// off, the buffers keep the last frame rendered. Nothing else depends on
+// rendering, so the emulation is the same
+void ppu_set_render(bool on);
 bool ppu_is_vblank();
 bool ppu_nmi_enabled();
 
 // Return the PPU output as a 256x240 ARGB buffer
 uint32_t *get_render_buffer();
 
+// Return the raw contents of a graphics layer (idx = [0, 3]) from the last
+// frame rendered, for testing. The format depends on which palettes were
+// output, and the length is 0 if nothing was rendered
+const uint8_t *ppu_get_layer(int idx, size_t &len);
+
+// Set up post-processing, which runs on the render thread after each frame.
+// Must be called before the first frame is rendered
+void ppu_set_postproc(const PostProcConfig &cfg);
+
+// Return the post-processed output as an ARGB buffer, and its size. This is
+// the render buffer if there is no post-processing
+uint32_t *get_output_buffer(int &width, int &height);
+
 } // namespace VTxx
 
 #endif /* end of include guard: PPU_H */
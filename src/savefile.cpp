@@ -0,0 +1,199 @@
+#include "savefile.hpp"
+#include "mmu.hpp"
+#include "util.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+namespace VTxx {
+
+bool save_on = false;
+
+static const uint32_t page_size = 8192;
+static const uint32_t n_pages = (32 * 1024 * 1024) / page_size;
+static const char save_magic[8] = {'O', 'V', 'T', 'X', 'S', 'A', 'V', '1'};
+
+typedef map<uint32_t, vector<uint8_t>> PageMap;
+
+static string save_name;
+static vector<bool> in_region;
+// Reused by save_frame
+static vector<uint32_t> written;
+
+// Pages waiting for the writer, with the latest contents of each. The writer
+// swaps them out about once a second, or on close
+static PageMap pending;
+static mutex pending_m;
+static condition_variable pending_cv;
+static bool closing = false;
+static thread writer;
+
+// Only used by the writer once started: the file being appended to, the
+// latest contents of every page in it, and the number of records in it
+static FILE *out = nullptr;
+static PageMap saved;
+static size_t n_records = 0;
+
+static uint32_t page_hash(const uint8_t *data) {
+  return uint32_t(fnv1a64(data, page_size));
+}
+
+static bool write_record(FILE *f, uint32_t pg, const vector<uint8_t> &data) {
+  uint32_t h = page_hash(data.data());
+  return fwrite(&pg, sizeof(pg), 1, f) == 1 &&
+         fwrite(&h, sizeof(h), 1, f) == 1 &&
+         fwrite(data.data(), 1, page_size, f) == page_size;
+}
+
+// Read the records in a journal into saved, returning false if it isn't one
+static bool read_journal(const string &filename) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == nullptr)
+    return true;
+  char magic[8];
+  uint32_t size;
+  if (fread(magic, 1, 8, f) != 8 || memcmp(magic, save_magic, 8) != 0 ||
+      fread(&size, sizeof(size), 1, f) != 1 || size != page_size) {
+    fclose(f);
+    return false;
+  }
+  vector<uint8_t> data(page_size);
+  uint32_t pg, h;
+  while (fread(&pg, sizeof(pg), 1, f) == 1 && fread(&h, sizeof(h), 1, f) == 1 &&
+         fread(data.data(), 1, page_size, f) == page_size) {
+    if (pg >= n_pages || page_hash(data.data()) != h)
+      break;
+    saved[pg] = data;
+    n_records++;
+  }
+  fclose(f);
+  return true;
+}
+
+// Rewrite the journal with only the latest records, then append to it
+static bool compact() {
+  string tmp = save_name + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  bool ok = (f != nullptr);
+  uint32_t size = page_size;
+  ok = ok && fwrite(save_magic, 1, 8, f) == 8 &&
+       fwrite(&size, sizeof(size), 1, f) == 1;
+  for (const auto &p : saved)
+    ok = ok && write_record(f, p.first, p.second);
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if (f != nullptr)
+    fclose(f);
+  if (!ok || rename(tmp.c_str(), save_name.c_str()) != 0) {
+    cerr << "Failed to write save file " << save_name << endl;
+    remove(tmp.c_str());
+    return false;
+  }
+  if (out != nullptr)
+    fclose(out);
+  out = fopen(save_name.c_str(), "ab");
+  n_records = saved.size();
+  return out != nullptr;
+}
+
+static void write_batch(PageMap &batch) {
+  // The first write starts a clean file, in case the last one was cut short
+  if (out == nullptr || n_records + batch.size() > 2 * saved.size() + 16) {
+    for (auto &p : batch)
+      saved[p.first].swap(p.second);
+    compact();
+    return;
+  }
+  bool ok = true;
+  for (auto &p : batch) {
+    ok = ok && write_record(out, p.first, p.second);
+    saved[p.first].swap(p.second);
+    n_records++;
+  }
+  ok = ok && fflush(out) == 0 && fdatasync(fileno(out)) == 0;
+  if (!ok)
+    cerr << "Failed to write save file " << save_name << endl;
+}
+
+static void writer_thread() {
+  PageMap batch;
+  bool done = false;
+  while (!done) {
+    {
+      unique_lock<mutex> lk(pending_m);
+      pending_cv.wait_for(lk, chrono::seconds(1), [] { return closing; });
+      batch.swap(pending);
+      done = closing;
+    }
+    if (!batch.empty())
+      write_batch(batch);
+    batch.clear();
+  }
+  if (out != nullptr)
+    fclose(out);
+  out = nullptr;
+}
+
+bool save_open(const string &filename, const vector<SaveRegion> &regions) {
+  save_close();
+  save_name = filename;
+  saved.clear();
+  n_records = 0;
+  if (!read_journal(filename))
+    return false;
+  in_region.assign(n_pages, false);
+  if (regions.empty()) {
+    for (uint32_t pg = mmu_image_size() / page_size; pg < n_pages; pg++)
+      in_region[pg] = true;
+  }
+  for (const SaveRegion &r : regions) {
+    uint32_t end = min((r.end + page_size - 1) / page_size, n_pages);
+    for (uint32_t pg = r.start / page_size; pg < end; pg++)
+      in_region[pg] = true;
+  }
+  for (const auto &p : saved)
+    for (uint32_t i = 0; i < page_size; i++)
+      write_mem_physical(p.first * page_size + i, p.second[i]);
+  if (!saved.empty())
+    cout << "Restored " << saved.size() << " pages from " << filename << endl;
+  // Those are already saved
+  mmu_take_unsaved(written);
+  closing = false;
+  pending.clear();
+  writer = thread(writer_thread);
+  save_on = true;
+  return true;
+}
+
+void save_close() {
+  if (!save_on)
+    return;
+  // Anything written since the last VBLANK
+  save_frame();
+  save_on = false;
+  {
+    lock_guard<mutex> lk(pending_m);
+    closing = true;
+  }
+  pending_cv.notify_one();
+  writer.join();
+}
+
+void save_frame() {
+  mmu_take_unsaved(written);
+  if (written.empty())
+    return;
+  lock_guard<mutex> lk(pending_m);
+  for (uint32_t pg : written) {
+    if (!in_region[pg])
+      continue;
+    const uint8_t *data = get_physical_ptr(pg * page_size, page_size);
+    pending[pg].assign(data, data + page_size);
+  }
+}
+} // namespace VTxx
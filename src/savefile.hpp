@@ -0,0 +1,43 @@
+#ifndef SAVEFILE_H
+#define SAVEFILE_H
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+// Persistent external memory, for games that save to flash or battery-backed
+// RAM mapped alongside the ROM. The 8KB pages written in the save regions are
+// collected at each VBLANK and appended to a journal file by a background
+// thread, at most about once a second, so the emulation never waits on the
+// disk. The journal is restored into memory when it is opened.
+//
+// The file is "OVTXSAV1" and a u32 page size, followed by records of a u32
+// page number, the u32 low half of the page's FNV-1a hash and the page. Later
+// records replace earlier ones, and loading stops at the first incomplete or
+// damaged record, such as one cut short by a crash. When most records are
+// out of date the file is rewritten with only the latest, through a
+// temporary file and a rename
+
+// A range of physical addresses, end exclusive
+struct SaveRegion {
+  uint32_t start, end;
+};
+
+// Restore the pages saved in filename, if it exists, then start saving the
+// pages written in regions to it. With no regions, everything past the
+// loaded ROM image is saved. Call after vt168_init. Returns false if the file
+// exists but isn't a save file. The file is only created once something is
+// written
+bool save_open(const string &filename, const vector<SaveRegion> &regions);
+// Write out the pages still waiting and stop saving
+void save_close();
+
+// Set while saving
+extern bool save_on;
+// Called at the start of each VBLANK while saving, to queue the pages written
+// since the last one
+void save_frame();
+} // namespace VTxx
+
+#endif /* end of include guard: SAVEFILE_H */
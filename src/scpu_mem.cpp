@@ -1,5 +1,6 @@
 #include "scpu_mem.hpp"
 #include "mmu.hpp"
+#include "platform.hpp"
 #include <cassert>
 #include <iostream>
 namespace VTxx {
@@ -8,11 +9,11 @@ uint8_t scpu_control_reg[256] = {0};
 ReadHandler scpu_reg_read_fn[256];
 WriteHandler scpu_reg_write_fn[256];
 
-uint8_t scpu_read_mem(uint16_t addr) {
-  if ((addr >= 0 && addr < 0x1000) || (addr >= 0x1000 && addr < 0x2000)) {
-    uint16_t mem_addr = addr & 0x0FFF;
-    return cpu_ram[0x1000 | mem_addr];
-  } else if (addr >= 0x2100 && addr < 0x2200) {
+template <typename P> uint8_t scpu_read_mem_t(uint16_t addr) {
+  if (addr < P::scpu_ram_end) {
+    uint16_t mem_addr = addr & (P::scpu_ram_window - 1);
+    return cpu_ram[P::scpu_ram_window | mem_addr];
+  } else if (addr >= P::sys_base && addr < P::sys_base + 0x100) {
     cout << "scpu read " << addr << endl;
     uint8_t reg_addr = addr & 0xFF;
     if (scpu_reg_read_fn[reg_addr] != nullptr)
@@ -24,11 +25,11 @@ uint8_t scpu_read_mem(uint16_t addr) {
   }
 }
 
-void scpu_write_mem(uint16_t addr, uint8_t data) {
-  if ((addr >= 0 && addr < 0x1000) || (addr >= 0x1000 && addr < 0x2000)) {
-    uint16_t mem_addr = addr & 0x0FFF;
-    cpu_ram[0x1000 | mem_addr] = data;
-  } else if (addr >= 0x2100 && addr < 0x2200) {
+template <typename P> void scpu_write_mem_t(uint16_t addr, uint8_t data) {
+  if (addr < P::scpu_ram_end) {
+    uint16_t mem_addr = addr & (P::scpu_ram_window - 1);
+    cpu_ram[P::scpu_ram_window | mem_addr] = data;
+  } else if (addr >= P::sys_base && addr < P::sys_base + 0x100) {
     cout << "scpu write " << addr << " " << data << endl;
 
     uint8_t reg_addr = addr & 0xFF;
@@ -40,4 +41,9 @@ void scpu_write_mem(uint16_t addr, uint8_t data) {
     assert(false);
   }
 }
+
+template uint8_t scpu_read_mem_t<VT168Traits>(uint16_t addr);
+template void scpu_write_mem_t<VT168Traits>(uint16_t addr, uint8_t data);
+template uint8_t scpu_read_mem_t<MiWi2Traits>(uint16_t addr);
+template void scpu_write_mem_t<MiWi2Traits>(uint16_t addr, uint8_t data);
 }; // namespace VTxx
@@ -8,8 +8,8 @@ namespace VTxx {
 // The system control registers, 0x2100 .. 0x21FF
 extern uint8_t scpu_control_reg[256];
 
-uint8_t scpu_read_mem(uint16_t addr);
-void scpu_write_mem(uint16_t addr, uint8_t data);
+template <typename P> uint8_t scpu_read_mem_t(uint16_t addr);
+template <typename P> void scpu_write_mem_t(uint16_t addr, uint8_t data);
 
 // Read and write handlers for SCPU register space
 extern ReadHandler scpu_reg_read_fn[256];
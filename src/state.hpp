@@ -0,0 +1,50 @@
+#ifndef STATE_H
+#define STATE_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+namespace VTxx {
+// Machine state, for snapshots. Each part of the machine passes its state
+// through a StateIO in a fixed order, which either appends it to a buffer or
+// reads it back from one, so that one function does both
+class StateIO {
+public:
+  // Save, appending to buf
+  explicit StateIO(vector<uint8_t> &buf) : out(&buf) {}
+  // Load from len bytes at data
+  StateIO(const uint8_t *data, size_t len) : in(data), in_len(len) {}
+
+  bool loading() const { return out == nullptr; }
+  // False if a load ran past the end of the data
+  bool ok() const { return good; }
+  // Mark a load as failed, for data that doesn't make sense
+  void fail() { good = false; }
+
+  void bytes(void *p, size_t len) {
+    if (out != nullptr) {
+      const uint8_t *b = static_cast<const uint8_t *>(p);
+      out->insert(out->end(), b, b + len);
+    } else if (pos + len <= in_len) {
+      memcpy(p, in + pos, len);
+      pos += len;
+    } else {
+      good = false;
+    }
+  }
+  void bytes(volatile uint8_t *p, size_t len) {
+    bytes(static_cast<void *>(const_cast<uint8_t *>(p)), len);
+  }
+  template <typename T> void pod(T &x) { bytes(&x, sizeof(x)); }
+
+private:
+  vector<uint8_t> *out = nullptr;
+  const uint8_t *in = nullptr;
+  size_t in_len = 0, pos = 0;
+  bool good = true;
+};
+} // namespace VTxx
+
+#endif /* end of include guard: STATE_H */
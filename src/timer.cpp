@@ -17,6 +17,9 @@ void Timer::write(uint8_t addr, uint8_t data) {
       preload |= (data << 8UL);
       break;
     case 0x1:
+      // Count from the preload when started
+      if (get_bit(data, 0) && !get_bit(config, 0))
+        count = preload;
       config = data;
       break;
     case 0x2:
@@ -40,6 +43,8 @@ void Timer::write(uint8_t addr, uint8_t data) {
       preload |= (data << 8UL);
       break;
     case 0x2:
+      if (get_bit(data, 0) && !get_bit(config, 0))
+        count = preload;
       config = data;
       break;
     case 0x3:
@@ -99,8 +104,24 @@ void Timer::tick() {
       if (get_bit(config, 1))
         cb(true);
       count = preload;
+    } else {
+      count++;
     }
   }
 }
 
+uint32_t Timer::ticks_to_irq() const {
+  if (!get_bit(config, 0) || !get_bit(config, 1))
+    return UINT32_MAX;
+  return 0xFFFF - count;
+}
+
+void Timer::state(StateIO &io) {
+  io.pod(preload);
+  io.pod(count);
+  io.pod(config);
+  io.pod(tsynen);
+  io.pod(tsyn_div);
+}
+
 } // namespace VTxx
@@ -1,5 +1,6 @@
 #ifndef TIMER_H
 #define TIMER_H
+#include "state.hpp"
 #include "typedefs.hpp"
 #include <cstdint>
 
@@ -14,6 +15,10 @@ public:
   void write(uint8_t addr, uint8_t data);
   uint8_t read(uint8_t addr);
   void tick();
+  // Ticks before the first that can raise the IRQ, so 0 if the next can.
+  // Ticks skipped by TSYN only make it later
+  uint32_t ticks_to_irq() const;
+  void state(StateIO &io);
 
 private:
   TimerType type;
@@ -0,0 +1,145 @@
+#include "trace.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace VTxx {
+
+atomic<bool> trace_on(false);
+
+struct Event {
+  string name, args;
+  char phase;
+  TraceThread thread;
+  uint64_t cycle;
+  // Host nanoseconds since trace_open
+  int64_t host;
+};
+
+// Events are added to pending, which the writer swaps out once it has
+// flush_events of them, or on close
+static const size_t flush_events = 4096;
+static vector<Event> pending;
+static mutex pending_m;
+static condition_variable pending_cv;
+static bool closing = false;
+
+static ofstream out;
+static thread writer;
+static chrono::steady_clock::time_point start_time;
+static bool first_event = true;
+
+static void write_event(const Event &e) {
+  char ts[32];
+  snprintf(ts, sizeof(ts), "%lld.%03lld", (long long)(e.host / 1000),
+           (long long)(e.host % 1000));
+  out << (first_event ? "\n" : ",\n") << "{\"name\": \"" << e.name
+      << "\", \"ph\": \"" << e.phase << "\", \"pid\": 1, \"tid\": "
+      << int(e.thread) << ", \"ts\": " << ts;
+  if (e.phase == 'i')
+    out << ", \"s\": \"t\"";
+  out << ", \"args\": {\"cycle\": " << e.cycle;
+  if (!e.args.empty())
+    out << ", " << e.args;
+  out << "}}";
+  first_event = false;
+}
+
+static void write_thread_name(TraceThread t, const char *name) {
+  out << (first_event ? "\n" : ",\n")
+      << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+      << int(t) << ", \"args\": {\"name\": \"" << name << "\"}}";
+  first_event = false;
+}
+
+static void writer_thread() {
+  vector<Event> batch;
+  bool done = false;
+  while (!done) {
+    {
+      unique_lock<mutex> lk(pending_m);
+      pending_cv.wait(
+          lk, [] { return closing || pending.size() >= flush_events; });
+      batch.swap(pending);
+      done = closing;
+    }
+    for (const Event &e : batch)
+      write_event(e);
+    batch.clear();
+  }
+}
+
+bool trace_open(const string &filename) {
+  out.open(filename);
+  if (!out)
+    return false;
+  out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+  write_thread_name(TraceThread::MAIN, "main");
+  write_thread_name(TraceThread::RENDER, "render");
+  start_time = chrono::steady_clock::now();
+  pending.reserve(flush_events);
+  closing = false;
+  writer = thread(writer_thread);
+  trace_on = true;
+  return true;
+}
+
+void trace_close() {
+  if (!trace_on)
+    return;
+  trace_on = false;
+  {
+    lock_guard<mutex> lk(pending_m);
+    closing = true;
+  }
+  pending_cv.notify_one();
+  writer.join();
+  out << "\n]}" << endl;
+  out.close();
+}
+
+static void add(TraceThread t, char phase, const string &name, uint64_t cycle,
+                const string &args) {
+  Event e;
+  e.name = name;
+  e.args = args;
+  e.phase = phase;
+  e.thread = t;
+  e.cycle = cycle;
+  e.host = chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now() - start_time)
+               .count();
+  bool flush;
+  {
+    lock_guard<mutex> lk(pending_m);
+    pending.push_back(e);
+    flush = (pending.size() >= flush_events);
+  }
+  if (flush)
+    pending_cv.notify_one();
+}
+
+void trace_begin(TraceThread t, const string &name, uint64_t cycle,
+                 const string &args) {
+  add(t, 'B', name, cycle, args);
+}
+
+void trace_end(TraceThread t, const string &name, uint64_t cycle) {
+  add(t, 'E', name, cycle, string());
+}
+
+void trace_instant(TraceThread t, const string &name, uint64_t cycle,
+                   const string &args) {
+  add(t, 'i', name, cycle, args);
+}
+
+string trace_hex(uint32_t x) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "\"0x%x\"", x);
+  return buf;
+}
+} // namespace VTxx
@@ -0,0 +1,39 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <atomic>
+#include <cstdint>
+#include <string>
+using namespace std;
+
+namespace VTxx {
+// Timeline of emulator events in Chrome trace event JSON, for Perfetto or
+// chrome://tracing. ts is the host time since the trace was opened, and each
+// event has the main CPU clock as args.cycle. Events are buffered, and written
+// out by a background thread
+
+// Tracks in the timeline. MAIN is the thread running the emulation and
+// presenting frames, RENDER the PPU render thread (or the same thread, when
+// rendering isn't threaded)
+enum class TraceThread { MAIN = 1, RENDER = 2 };
+
+// Start tracing to filename, returning false if it can't be opened
+bool trace_open(const string &filename);
+// Write out any buffered events and finish the file
+void trace_close();
+
+// Set while tracing. Check it before building an event
+extern atomic<bool> trace_on;
+
+// Record an event. args, if not empty, is extra members for the args object,
+// such as "\"vector\": \"0xfffa\""
+void trace_begin(TraceThread t, const string &name, uint64_t cycle,
+                 const string &args = "");
+void trace_end(TraceThread t, const string &name, uint64_t cycle);
+void trace_instant(TraceThread t, const string &name, uint64_t cycle,
+                   const string &args = "");
+
+// Format a number as a quoted hex JSON string
+string trace_hex(uint32_t x);
+} // namespace VTxx
+
+#endif /* end of include guard: TRACE_H */
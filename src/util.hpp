@@ -1,8 +1,20 @@
 #ifndef UTIL_HPP
 #define UTIL_HPP
+#include <cstddef>
 #include <cstdint>
 using namespace std;
 
 #define get_bit(x, n) ((x & (1UL << (n))) != 0)
 
+// 64-bit FNV-1a hash, pass the previous result as h to hash several buffers
+inline uint64_t fnv1a64(const void *data, size_t len,
+                        uint64_t h = 0xcbf29ce484222325ULL) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
 #endif /* end of include guard: UTIL_HPP */
@@ -0,0 +1,276 @@
+#include "mmu.hpp"
+#include "openvtx.h"
+#include "platform.hpp"
+#include "ppu.hpp"
+#include "vt168.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <iostream>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+// Each environment is a worker process, driven through a slot in memory
+// shared with the parent. The parent sets cmd and posts go, the worker runs
+// it and posts done
+enum { CMD_STEP, CMD_RESET, CMD_QUIT };
+
+struct EnvSlot {
+  sem_t go, done;
+  uint8_t cmd;
+  uint8_t buttons;
+  uint8_t render;
+};
+
+struct openvtx_vec {
+  int n;
+  int format, downsample;
+  size_t obs_size;
+  // Shared with the workers: the slots, then the observations, then the RAM
+  uint8_t *shm;
+  size_t shm_size;
+  EnvSlot *slots;
+  uint8_t *obs, *ram;
+  vector<pid_t> pids;
+  vector<bool> dead;
+};
+
+static const int frame_w = 256, frame_h = 240;
+static const size_t ram_size = sizeof(cpu_ram);
+
+static size_t round_up(size_t x, size_t align) {
+  return (x + align - 1) / align * align;
+}
+
+// Convert the output into an observation, averaging each channel over
+// downsample x downsample blocks
+static void write_obs(const openvtx_vec *vec, uint8_t *out) {
+  const uint32_t *in = get_render_buffer();
+  int d = vec->downsample, w = frame_w / d, h = frame_h / d;
+  if (d == 1 && vec->format == OPENVTX_OBS_ARGB) {
+    copy(in, in + frame_w * frame_h, reinterpret_cast<uint32_t *>(out));
+    return;
+  }
+  int area = d * d;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint32_t r = 0, g = 0, b = 0;
+      for (int yy = 0; yy < d; yy++) {
+        const uint32_t *row = in + (y * d + yy) * frame_w + x * d;
+        for (int xx = 0; xx < d; xx++) {
+          r += (row[xx] >> 16) & 0xFF;
+          g += (row[xx] >> 8) & 0xFF;
+          b += row[xx] & 0xFF;
+        }
+      }
+      r /= area;
+      g /= area;
+      b /= area;
+      if (vec->format == OPENVTX_OBS_GREY)
+        *out++ = (r * 77 + g * 150 + b * 29) >> 8;
+      else
+        reinterpret_cast<uint32_t *>(out)[y * w + x] =
+            0xFF000000 | (r << 16) | (g << 8) | b;
+    }
+  }
+}
+
+static void worker(const openvtx_vec *vec, int idx, VT168_Platform plat,
+                   VideoTiming timing, const void *rom, size_t len) {
+  // The core logs to cout
+  cout.setstate(ios::failbit);
+  EnvSlot &slot = vec->slots[idx];
+  uint8_t *obs = vec->obs + idx * vec->obs_size;
+  uint8_t *ram = vec->ram + idx * ram_size;
+  load_rom_data(static_cast<const uint8_t *>(rom), len);
+  vt168_init(plat, timing, "", false);
+  // Resets go back to here, which is much faster than starting again
+  vt168_snapshot();
+  while (true) {
+    while (sem_wait(&slot.go) < 0 && errno == EINTR)
+      ;
+    if (slot.cmd == CMD_QUIT)
+      break;
+    ppu_set_render(slot.render);
+    if (slot.cmd == CMD_RESET) {
+      vt168_restore();
+      // Nothing has been rendered yet at power on
+      uint32_t *fb = get_render_buffer();
+      fill(fb, fb + frame_w * frame_h, 0xFF000000);
+    } else {
+      vt168_set_input(slot.buttons);
+      vt168_run_frame();
+    }
+    if (slot.render)
+      write_obs(vec, obs);
+    copy(cpu_ram, cpu_ram + ram_size, ram);
+    sem_post(&slot.done);
+  }
+}
+
+// Wait for a worker to finish its command, returning false if it has died
+static bool wait_done(openvtx_vec *vec, int idx) {
+  if (vec->dead[idx])
+    return false;
+  while (true) {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    if (sem_timedwait(&vec->slots[idx].done, &ts) == 0)
+      return true;
+    if (errno != ETIMEDOUT && errno != EINTR)
+      break;
+    int status;
+    if (waitpid(vec->pids[idx], &status, WNOHANG) == vec->pids[idx])
+      break;
+  }
+  vec->dead[idx] = true;
+  return false;
+}
+
+// Send a command to the environments from first to last and wait for them
+static int run_cmd(openvtx_vec *vec, int first, int last, uint8_t cmd,
+                   const uint8_t *buttons) {
+  for (int i = first; i <= last; i++) {
+    if (vec->dead[i])
+      continue;
+    vec->slots[i].cmd = cmd;
+    if (buttons != nullptr)
+      vec->slots[i].buttons = buttons[i];
+    sem_post(&vec->slots[i].go);
+  }
+  int res = 0;
+  for (int i = first; i <= last; i++)
+    if (!wait_done(vec, i))
+      res = -1;
+  return res;
+}
+
+openvtx_vec *openvtx_vec_create(const char *platform, int timing,
+                                const void *rom, size_t len, int n,
+                                int format, int downsample) {
+  const PlatformDesc *plat = find_platform(platform ? platform : "vt168");
+  if (plat == nullptr || len == 0 || n < 1)
+    return nullptr;
+  VideoTiming t = plat->default_timing;
+  if (timing == OPENVTX_TIMING_PAL)
+    t = VideoTiming::PAL;
+  else if (timing == OPENVTX_TIMING_NTSC)
+    t = VideoTiming::NTSC;
+  else if (timing != OPENVTX_TIMING_DEFAULT)
+    return nullptr;
+  if ((format != OPENVTX_OBS_ARGB && format != OPENVTX_OBS_GREY) ||
+      (downsample != 1 && downsample != 2 && downsample != 4))
+    return nullptr;
+
+  openvtx_vec *vec = new openvtx_vec();
+  vec->n = n;
+  vec->format = format;
+  vec->downsample = downsample;
+  vec->obs_size = (frame_w / downsample) * (frame_h / downsample) *
+                  (format == OPENVTX_OBS_ARGB ? 4 : 1);
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t slots_size = round_up(n * sizeof(EnvSlot), page);
+  size_t obs_total = round_up(n * vec->obs_size, page);
+  vec->shm_size = slots_size + obs_total + round_up(n * ram_size, page);
+  void *p = mmap(nullptr, vec->shm_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    delete vec;
+    return nullptr;
+  }
+  vec->shm = static_cast<uint8_t *>(p);
+  vec->slots = reinterpret_cast<EnvSlot *>(vec->shm);
+  vec->obs = vec->shm + slots_size;
+  vec->ram = vec->obs + obs_total;
+  vec->dead.assign(n, false);
+  for (int i = 0; i < n; i++) {
+    EnvSlot &slot = vec->slots[i];
+    sem_init(&slot.go, 1, 0);
+    sem_init(&slot.done, 1, 0);
+    slot.render = 1;
+  }
+
+  cout.flush();
+  cerr.flush();
+  pid_t parent = getpid();
+  for (int i = 0; i < n; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      // Workers wait for commands forever, so go with the parent if it dies
+      // without destroying them, including before this
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() != parent)
+        _exit(1);
+      worker(vec, i, plat->id, t, rom, len);
+      _exit(0);
+    }
+    vec->pids.push_back(pid);
+    if (pid < 0)
+      vec->dead[i] = true;
+  }
+  // Start every environment from power on, with its first observation
+  if (run_cmd(vec, 0, n - 1, CMD_RESET, nullptr) < 0) {
+    openvtx_vec_destroy(vec);
+    return nullptr;
+  }
+  return vec;
+}
+
+void openvtx_vec_destroy(openvtx_vec *vec) {
+  if (vec == nullptr)
+    return;
+  for (int i = 0; i < vec->n; i++) {
+    if (vec->pids[i] <= 0)
+      continue;
+    if (vec->dead[i]) {
+      kill(vec->pids[i], SIGKILL);
+    } else {
+      vec->slots[i].cmd = CMD_QUIT;
+      sem_post(&vec->slots[i].go);
+    }
+    waitpid(vec->pids[i], nullptr, 0);
+  }
+  for (int i = 0; i < vec->n; i++) {
+    sem_destroy(&vec->slots[i].go);
+    sem_destroy(&vec->slots[i].done);
+  }
+  munmap(vec->shm, vec->shm_size);
+  delete vec;
+}
+
+int openvtx_vec_step(openvtx_vec *vec, const uint8_t *buttons) {
+  return run_cmd(vec, 0, vec->n - 1, CMD_STEP, buttons);
+}
+
+int openvtx_vec_reset(openvtx_vec *vec, int env) {
+  if (env < 0)
+    return run_cmd(vec, 0, vec->n - 1, CMD_RESET, nullptr);
+  if (env >= vec->n)
+    return -1;
+  return run_cmd(vec, env, env, CMD_RESET, nullptr);
+}
+
+void openvtx_vec_set_render(openvtx_vec *vec, int env, int on) {
+  if (env >= 0 && env < vec->n)
+    vec->slots[env].render = (on != 0);
+}
+
+const uint8_t *openvtx_vec_obs(openvtx_vec *vec, size_t *size) {
+  if (size != nullptr)
+    *size = vec->obs_size;
+  return vec->obs;
+}
+
+const uint8_t *openvtx_vec_ram(openvtx_vec *vec) { return vec->ram; }
@@ -1,16 +1,24 @@
 #include "vt168.hpp"
 #include "6502/mos6502.hpp"
+#include "coverage.hpp"
 #include "dma.hpp"
 #include "extalu.hpp"
 #include "input.hpp"
 #include "irq.hpp"
 #include "mmu.hpp"
+#include "platform.hpp"
 #include "ppu.hpp"
+#include "savefile.hpp"
 #include "scpu_mem.hpp"
 #include "timer.hpp"
+#include "trace.hpp"
 #include "util.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
 #include <string>
 #include <vector>
 using namespace std;
@@ -26,48 +34,179 @@ static DMACtrl *cpu_dma;
 
 static InputDev *inp;
 
-static const vector<IRQVector> cpu_vectors = {
-    {0xFFFF, 0xFFFE}, // 0 EXT
-    {0xFFF9, 0xFFF8}, // 1 TIMER
-    {0xFFF7, 0xFFF6}, // 2 SPU
-    {0xFFF5, 0xFFF4}, // 3 UART
-    {0xFFF3, 0xFFF2}, // 4 SPI
-};
-
-static const vector<IRQVector> scpu_vectors = {
-    {0x0FFF, 0x0FFE}, // 0 EXT
-    {0x0FF9, 0x0FF8}, // 1 TIMERA
-    {0x0FF7, 0x0FF6}, // 2 TIMERB
-    {0x0FF5, 0x0FF4}  // 3 CPU
-};
-
-void vt168_init(VT168_Platform plat, const std::string &rom) {
-  mmu_init();
-  ppu_init();
+static const PlatformDesc *plat;
+static bool (*tick_fn)();
+static CPUStepFn cpu_step = nullptr, scpu_step = nullptr;
+bool vt168_pause_flag = false;
+
+static int cpu_div = 0;
+// Clocks the main CPU has run ahead by, after a fused sequence
+static uint32_t cpu_ahead = 0;
+// While a fused sequence runs, the main CPU's count at its start. CPU timer
+// and SCPU ticks run early for writes from it, to be skipped later
+static bool in_fused = false;
+static uint32_t fused_start = 0;
+static uint32_t timer_ahead = 0, scpu_ahead = 0;
+// Whether the main CPU stopped at a breakpoint before running its clock, which
+// the next tick then carries on from
+static bool held_cpu = false;
+// The SCPU tick and master clocks per CPU clock of the bound tick loop
+static bool (*scpu_tick_fn)();
+static int cpu_ratio = 1;
+// CPU clock of the next scheduled event
+static uint64_t next_event = 0;
+
+template <typename P, typename T, mos6502::Engine E, bool Hooked>
+static bool vt168_tick_t();
+
+static VideoTiming timing;
+static mos6502::Engine engine;
+
+template <bool Hooked> static bool vt168_scpu_tick();
+static void vt168_catch_up();
+
+// Pick the tick instantiation. Hooked is true while there is a CPU step
+// function or a held CPU clock, so that the usual path doesn't check for one
+template <typename P, typename T, mos6502::Engine E>
+static void vt168_bind_tick() {
+  cpu_ratio = T::cpu_ratio;
+  if (cpu_step != nullptr || scpu_step != nullptr || held_cpu) {
+    tick_fn = vt168_tick_t<P, T, E, true>;
+    scpu_tick_fn = vt168_scpu_tick<true>;
+  } else {
+    tick_fn = vt168_tick_t<P, T, E, false>;
+    scpu_tick_fn = vt168_scpu_tick<false>;
+  }
+}
+
+template <typename P, typename T> static void vt168_bind_tick() {
+  if (engine == mos6502::ENGINE_FUSED)
+    vt168_bind_tick<P, T, mos6502::ENGINE_FUSED>();
+  else
+    vt168_bind_tick<P, T, mos6502::ENGINE_INTERP>();
+}
+
+template <typename P> static void vt168_bind_tick() {
+  if (timing == VideoTiming::NTSC)
+    vt168_bind_tick<P, NTSCTiming>();
+  else
+    vt168_bind_tick<P, PALTiming>();
+}
+
+static void vt168_bind_tick() {
+  switch (plat->id) {
+  case VT168_Platform::VT168_BASE:
+    vt168_bind_tick<VT168Traits>();
+    break;
+  case VT168_Platform::VT168_MIWI2:
+    vt168_bind_tick<MiWi2Traits>();
+    break;
+  }
+}
+
+#ifdef OPENVTX_PROFILE
+// Opcode pairs to include in the profile
+static const int profile_top_pairs = 64;
+
+// Write both CPUs' instruction mix to the working directory, on exit
+static void vt168_write_profile() {
+  ofstream csv("openvtx-profile.csv");
+  csv << "cpu,kind,opcode,mnemonic,mode,count,cycles" << endl;
+  cpu->WriteProfileCSV(csv, "cpu", profile_top_pairs);
+  scpu->WriteProfileCSV(csv, "scpu", profile_top_pairs);
+  ofstream json("openvtx-profile.json");
+  json << "{\"cpu\": ";
+  cpu->WriteProfileJSON(json, profile_top_pairs);
+  json << ",\n\"scpu\": ";
+  scpu->WriteProfileJSON(json, profile_top_pairs);
+  json << "}" << endl;
+}
+#endif
+
+#ifdef OPENVTX_COVERAGE
+static const char coverage_file[] = "openvtx-coverage.bin";
+
+// Add this run's coverage to the file in the working directory, and write
+// this run's heatmap, on exit
+static void vt168_write_coverage() {
+  coverage_load(coverage_file);
+  if (!coverage_save(coverage_file))
+    cerr << "Failed to save " << coverage_file << endl;
+  coverage_save_heatmap("openvtx-heatmap.csv");
+  coverage_save_bank_writes("openvtx-bank-writes.csv");
+}
+#endif
+
+const int reg_sys = 0x06;
+
+// The machine state at vt168_snapshot, empty if there is none
+static vector<uint8_t> snapshot;
+
+void vt168_init(VT168_Platform _plat, VideoTiming _timing,
+                const std::string &rom, bool threaded_render,
+                mos6502::Engine _engine) {
+  // From an earlier init
+  delete cpu;
+  delete scpu;
+  delete cpu_irq;
+  delete scpu_irq;
+  delete cpu_alu;
+  delete scpu_alu;
+  delete cpu_timer;
+  delete scpu_timer0;
+  delete scpu_timer1;
+  delete cpu_dma;
+  delete inp;
+  fill(scpu_control_reg, scpu_control_reg + sizeof(scpu_control_reg), 0);
+  // Handlers of the last platform, which may not all be installed again
+  fill(reg_read_fn, reg_read_fn + 256, nullptr);
+  fill(reg_write_fn, reg_write_fn + 256, nullptr);
+  fill(scpu_reg_read_fn, scpu_reg_read_fn + 256, nullptr);
+  fill(scpu_reg_write_fn, scpu_reg_write_fn + 256, nullptr);
+  snapshot.clear();
+
+  plat = &get_platform(_plat);
+  timing = _timing;
+  engine = _engine;
+  mmu_init(*plat);
+  cpu_clock = 0;
+  next_event = 0;
+  cpu_ahead = 0;
+  in_fused = false;
+  timer_ahead = 0;
+  scpu_ahead = 0;
+  held_cpu = false;
+  cpu_div = 0;
+  ppu_init(timing, threaded_render);
   if (rom != "")
     load_rom(rom);
 
-  cpu = new mos6502::mos6502(read_mem_virtual, write_mem_virtual);
-  if (plat == VT168_Platform::VT168_MIWI2)
-    cpu->scramble = true;
+  vt168_pause_flag = false;
+  cpu = new mos6502::mos6502(plat->cpu_read, plat->cpu_write);
+  cpu->scramble = plat->scramble;
+  cpu->engine = engine;
+  vt168_set_cpu_bus(nullptr, nullptr);
+
+  scpu = new mos6502::mos6502(plat->scpu_read, plat->scpu_write);
+  scpu->brkVectorH = plat->scpu_brk.h;
+  scpu->brkVectorL = plat->scpu_brk.l;
+  scpu->rstVectorH = plat->scpu_rst.h;
+  scpu->rstVectorL = plat->scpu_rst.l;
+  scpu->nmiVectorH = plat->scpu_nmi.h;
+  scpu->nmiVectorL = plat->scpu_nmi.l;
+  vt168_set_scpu_bus(nullptr, nullptr);
 
-  scpu = new mos6502::mos6502(scpu_read_mem, scpu_write_mem);
-  scpu->brkVectorH = 0x0FFF;
-  scpu->brkVectorL = 0x0FFE;
-  scpu->rstVectorH = 0x0FFD;
-  scpu->rstVectorL = 0x0FFC;
-  scpu->nmiVectorH = 0x0FFB;
-  scpu->nmiVectorL = 0x0FFA;
+  vt168_bind_tick();
 
-  cpu_irq = new IRQController(cpu_vectors, cpu);
+  cpu_irq = new IRQController(plat->cpu_vectors, cpu, "cpu");
   reg_read_fn[0x21] = [](uint16_t a) { return cpu_irq->read(0); };
   reg_write_fn[0x21] = [](uint16_t a, uint8_t x) { cpu_irq->write(0, x); };
 
-  scpu_irq = new IRQController(scpu_vectors, scpu);
+  scpu_irq = new IRQController(plat->scpu_vectors, scpu, "scpu");
   scpu_irq->write(0, 0x0F); // no general mask register, set all enabled
 
-  cpu_alu = new ExtALU(true, false);
-  scpu_alu = new ExtALU(true, false);
+  cpu_alu = new ExtALU(plat->alu_rem_quirk, plat->alu_read_offset);
+  scpu_alu = new ExtALU(plat->alu_rem_quirk, plat->alu_read_offset);
   for (uint8_t a = 0x30; a <= 0x37; a++) {
     reg_read_fn[a] = [](uint16_t a) { return cpu_alu->read(a & 0xFF); };
     scpu_reg_read_fn[a] = [](uint16_t a) { return scpu_alu->read(a & 0xFF); };
@@ -90,6 +229,7 @@ void vt168_init(VT168_Platform plat, const std::string &rom) {
       return cpu_timer->read(a - 0x2101);
     };
     reg_write_fn[0x01 + i] = [](uint16_t a, uint8_t b) {
+      vt168_catch_up();
       cpu_timer->write(a - 0x2101, b);
     };
     scpu_reg_read_fn[0x0 + i] = [](uint16_t a) {
@@ -105,8 +245,22 @@ void vt168_init(VT168_Platform plat, const std::string &rom) {
       scpu_timer1->write(a & 0x03, b);
     };
   }
+  // Bits 5 and 4 hold the SCPU in reset and enable it
+  reg_write_fn[reg_sys] = [](uint16_t a, uint8_t d) {
+    vt168_catch_up();
+    uint8_t changed = control_reg[reg_sys] ^ d;
+    if (trace_on && get_bit(changed, 5))
+      trace_instant(TraceThread::MAIN,
+                    get_bit(d, 5) ? "scpu reset release" : "scpu reset",
+                    cpu_clock);
+    if (trace_on && get_bit(changed, 4))
+      trace_instant(TraceThread::MAIN,
+                    get_bit(d, 4) ? "scpu enable" : "scpu disable", cpu_clock);
+    control_reg[reg_sys] = d;
+  };
   reg_read_fn[0x0B] = [](uint16_t a) { return cpu_timer->read(0xA); };
   reg_write_fn[0x0B] = [](uint16_t a, uint8_t b) {
+    vt168_catch_up();
     cpu_timer->write(0xA, b);
     control_reg[0x0B] = b;
   };
@@ -116,6 +270,9 @@ void vt168_init(VT168_Platform plat, const std::string &rom) {
     reg_read_fn[a] = [](uint16_t a) { return cpu_dma->read(a - 0x2122); };
     reg_write_fn[a] = [](uint16_t a, uint8_t b) {
       cpu_dma->write(a - 0x2122, b);
+      // VRAM DMA started during VBLANK doesn't need to wait
+      if (ppu_is_vblank())
+        cpu_dma->vblank_notify();
     };
   }
 
@@ -124,64 +281,307 @@ void vt168_init(VT168_Platform plat, const std::string &rom) {
 
   // TODO: init misc control regs
 
+#ifdef OPENVTX_PROFILE
+  static bool profile_registered = false;
+  if (!profile_registered)
+    atexit(vt168_write_profile);
+  profile_registered = true;
+#endif
+#ifdef OPENVTX_COVERAGE
+  static bool coverage_registered = false;
+  if (!coverage_registered)
+    atexit(vt168_write_coverage);
+  coverage_registered = true;
+#endif
+
   cpu->Reset();
 }
 
-const int reg_sys = 0x06;
-
-static void vt168_scpu_tick() {
+// Returns false if the SCPU stopped at a breakpoint, with nothing run, so that
+// the whole tick runs again on resume
+template <bool Hooked> static bool vt168_scpu_tick() {
   if (!get_bit(control_reg[reg_sys], 5)) {
     scpu->Reset();
   } else if (get_bit(control_reg[reg_sys], 4)) {
-    scpu->Run(1);
+    if (Hooked && scpu_step != nullptr) {
+      if (scpu_step(*scpu) == 0 && vt168_pause_flag)
+        return false;
+    } else
+      scpu->RunT<false>(1);
   }
   scpu_timer0->tick();
   scpu_timer1->tick();
+  return true;
+}
+
+static inline bool scpu_running() {
+  return get_bit(control_reg[reg_sys], 5) && get_bit(control_reg[reg_sys], 4);
+}
+
+// A fused sequence runs in one clock and the CPU then idles for the rest, so
+// its later instructions run up to FusedMax - 1 clocks early, and anything
+// raised in the idle clocks waits for the end of the sequence. So only fuse
+// when nothing the CPU can see happens in that time: no PPU event with its
+// NMI, no CPU timer IRQ and no SCPU running alongside
+static inline bool vt168_can_fuse() {
+  const uint32_t span = mos6502::mos6502::FusedMax - 1;
+  return cpu_clock + span < next_event && cpu_timer->ticks_to_irq() >= span &&
+         !scpu_running();
 }
 
-static void vt168_cpu_tick() {
+// The later instructions of a fused sequence also run early. Before one of
+// them writes to the CPU timer or the system control register, run the CPU
+// timer and SCPU for the clocks it is early by, so that they see the write
+// at the same clock as under the interpreter
+static void vt168_catch_up() {
+  if (!in_fused)
+    return;
+  uint32_t early = cpu->GetCycles() - fused_start;
+  for (; timer_ahead < early; timer_ahead++)
+    cpu_timer->tick();
+  for (; scpu_ahead < early * cpu_ratio; scpu_ahead++)
+    scpu_tick_fn();
+}
+
+// Returns false if the CPU stopped at a breakpoint, with nothing run and its
+// clock held for the next tick
+template <typename P, mos6502::Engine E, bool Hooked>
+static bool vt168_cpu_tick() {
   // cout << "PC: " << va_to_str(cpu->GetPC()) << endl;
-  cpu->Run(1);
-  cpu_timer->tick();
+  if (cpu_ahead > 0) {
+    cpu_ahead--;
+  } else {
+    uint32_t ran;
+    if (Hooked && cpu_step != nullptr) {
+      ran = cpu_step(*cpu);
+      if (ran == 0 && vt168_pause_flag) {
+        held_cpu = true;
+        return false;
+      }
+    } else if (E == mos6502::ENGINE_FUSED && vt168_can_fuse()) {
+      in_fused = true;
+      fused_start = cpu->GetCycles();
+      ran = cpu->RunFusedT<P::scramble>(1);
+      in_fused = false;
+    } else {
+      ran = cpu->RunT<P::scramble>(1);
+    }
+    cpu_ahead = (ran > 1) ? (ran - 1) : 0;
+  }
+  if (E == mos6502::ENGINE_FUSED && timer_ahead > 0)
+    timer_ahead--;
+  else
+    cpu_timer->tick();
+  return true;
 }
 
-static int cpu_ratio = 5; // set to 4 for NTSC
-static int cpu_div = 0;
-static bool last_vblank = false;
-bool vt168_tick() {
-  vt168_scpu_tick();
-  cpu_div++;
-  bool is_vblank = false;
-  if (cpu_div == cpu_ratio) {
+// Handle any events due at the current CPU clock, returning true at the start
+// of VBLANK
+template <typename T> static bool vt168_events() {
+  ppu_sync_t<T>(cpu_clock);
+  uint8_t ev = ppu_take_events();
+  next_event = ppu_next_event();
+  if (ev & PPU_EV_VBLANK_START) {
+#ifdef OPENVTX_COVERAGE
+    coverage_frame();
+#endif
+    if (save_on)
+      save_frame();
+    cpu_dma->vblank_notify();
+    /*cout << "PC: " << va_to_str(cpu->GetPC()) << endl;
+    cout << "mem[PC]: ";
+    for (int i = 0; i < 4; i++) {
+      int addr = cpu->GetPC() + i;
+      if ((addr < 0x2000) || (addr >= 0x4000))
+        cout << hex << int(read_mem_virtual(addr)) << " ";
+    }
+    cout << endl;
+    if (cpu->GetPC() <= 0x104)
+      assert(false);*/
+    if (ppu_nmi_enabled()) {
+      cout << "-- NMI --" << endl;
+      if (trace_on)
+        trace_instant(TraceThread::MAIN, "cpu NMI", cpu_clock,
+                      "\"vector\": " + trace_hex(cpu->nmiVectorL));
+      cpu->NMI();
+    }
+    return true;
+  }
+  return false;
+}
+
+// One master clock tick, specialised for platform P, timing profile T, CPU
+// engine E and whether there are CPU step functions
+template <typename P, typename T, mos6502::Engine E, bool Hooked>
+static bool vt168_tick_t() {
+  if (Hooked && held_cpu) {
+    // The rest of the tick a breakpoint stopped in. The step functions may
+    // have gone since
+    held_cpu = false;
+    if (cpu_step == nullptr && scpu_step == nullptr)
+      vt168_bind_tick();
+  } else {
+    if (E == mos6502::ENGINE_FUSED && scpu_ahead > 0)
+      scpu_ahead--;
+    else if (!vt168_scpu_tick<Hooked>())
+      return false;
+    cpu_div++;
+    if (cpu_div != T::cpu_ratio)
+      return false;
     cpu_div = 0;
-    vt168_cpu_tick();
-    ppu_tick();
-    if (ppu_is_vblank())
-      cpu_dma->vblank_notify();
-
-    if (ppu_is_vblank() && !last_vblank) {
-      /*cout << "PC: " << va_to_str(cpu->GetPC()) << endl;
-      cout << "mem[PC]: ";
-      for (int i = 0; i < 4; i++) {
-        int addr = cpu->GetPC() + i;
-        if ((addr < 0x2000) || (addr >= 0x4000))
-          cout << hex << int(read_mem_virtual(addr)) << " ";
-      }
-      cout << endl;
-      if (cpu->GetPC() <= 0x104)
-        assert(false);*/
-      if (ppu_nmi_enabled()) {
-        cout << "-- NMI --" << endl;
-        cpu->NMI();
-      }
+  }
+  if (!vt168_cpu_tick<P, E, Hooked>())
+    return false;
+  cpu_clock++;
+  if (cpu_clock >= next_event)
+    return vt168_events<T>();
+  return false;
+}
+
+bool vt168_tick() { return tick_fn(); }
+
+bool vt168_run_frame() {
+  while (!tick_fn()) {
+    if (vt168_pause_flag)
+      return false;
+  }
+  return true;
+}
+
+void vt168_set_input(uint8_t buttons) { inp->set_buttons(buttons); }
+
+mos6502::mos6502 &vt168_cpu() { return *cpu; }
+
+mos6502::mos6502 &vt168_scpu() { return *scpu; }
+
+void vt168_set_cpu_step(CPUStepFn fn) {
+  cpu_step = fn;
+  vt168_bind_tick();
+}
+
+void vt168_set_scpu_step(CPUStepFn fn) {
+  scpu_step = fn;
+  vt168_bind_tick();
+}
+
+void vt168_set_cpu_bus(ReadHandler r, WriteHandler w) {
+  if (r == nullptr) {
+    cpu->SetBus(plat->cpu_read, plat->cpu_write);
+    cpu->SetDirectPages(cpu_ram + plat->cpu_zero_page,
+                        cpu_ram + plat->cpu_zero_page + 0x100);
+  } else {
+    cpu->SetBus(r, w);
+  }
+  mmu_set_bus(r, w);
+}
+
+void vt168_set_scpu_bus(ReadHandler r, WriteHandler w) {
+  if (r == nullptr) {
+    scpu->SetBus(plat->scpu_read, plat->scpu_write);
+    scpu->SetDirectPages(cpu_ram + plat->scpu_zero_page,
+                         cpu_ram + plat->scpu_zero_page + 0x100);
+  } else {
+    scpu->SetBus(r, w);
+  }
+}
+
+const PlatformDesc &vt168_platform() { return *plat; }
 
-      is_vblank = true;
+// Pass the state of everything but external memory through io
+static void vt168_state(StateIO &io) {
+  // Field by field, so struct padding and layout aren't part of the state
+  for (mos6502::mos6502 *c : {cpu, scpu}) {
+    mos6502::mos6502::State s = c->GetState();
+    uint8_t halted = c->IsHalted();
+    io.pod(s.A);
+    io.pod(s.X);
+    io.pod(s.Y);
+    io.pod(s.sp);
+    io.pod(s.status);
+    io.pod(s.pc);
+    io.pod(s.cycles);
+    io.pod(halted);
+    if (io.loading()) {
+      c->SetState(s);
+      c->SetHalted(halted != 0);
     }
-    last_vblank = ppu_is_vblank();
   }
-  return is_vblank;
+  mmu_state(io);
+  io.bytes(scpu_control_reg, sizeof(scpu_control_reg));
+  ppu_state(io);
+  cpu_alu->state(io);
+  scpu_alu->state(io);
+  cpu_timer->state(io);
+  scpu_timer0->state(io);
+  scpu_timer1->state(io);
+  cpu_irq->state(io);
+  scpu_irq->state(io);
+  cpu_dma->state(io);
+  inp->state(io);
+  io.pod(cpu_div);
+  io.pod(cpu_ahead);
+  io.pod(timer_ahead);
+  io.pod(scpu_ahead);
+  io.pod(held_cpu);
+  io.pod(next_event);
+  if (io.loading())
+    vt168_bind_tick();
+}
+
+void vt168_snapshot() {
+  snapshot.clear();
+  StateIO io(snapshot);
+  vt168_state(io);
+  mmu_snapshot();
+}
+
+bool vt168_restore() {
+  if (snapshot.empty())
+    return false;
+  StateIO io(snapshot.data(), snapshot.size());
+  vt168_state(io);
+  assert(io.ok());
+  mmu_restore();
+  return true;
+}
+
+// Saved states start with this and the platform id
+static const char state_magic[8] = {'O', 'V', 'T', 'X', 'S', 'T', 'A', '4'};
+
+void vt168_save_state(vector<uint8_t> &data) {
+  data.clear();
+  StateIO io(data);
+  char magic[8];
+  copy(state_magic, state_magic + 8, magic);
+  io.bytes(magic, 8);
+  uint32_t id = uint32_t(plat->id);
+  io.pod(id);
+  vt168_state(io);
+  mmu_ext_state(io);
+}
+
+bool vt168_load_state(const uint8_t *data, size_t len) {
+  StateIO io(data, len);
+  char magic[8];
+  uint32_t id;
+  io.bytes(magic, 8);
+  io.pod(id);
+  if (!io.ok() || !equal(magic, magic + 8, state_magic) ||
+      id != uint32_t(plat->id))
+    return false;
+  vector<uint8_t> backup;
+  vt168_save_state(backup);
+  vt168_state(io);
+  mmu_ext_state(io);
+  if (io.ok())
+    return true;
+  // Truncated, go back to where we were
+  if (!vt168_load_state(backup.data(), backup.size()))
+    assert(false);
+  return false;
 }
 
-void vt168_process_event(SDL_Event *ev) { inp->process_event(ev); }
+void vt168_request_pause() { vt168_pause_flag = true; }
+void vt168_resume() { vt168_pause_flag = false; }
 
 }; // namespace VTxx
@@ -1,16 +1,75 @@
 #ifndef VT168_H
 #define VT168_H
 
-#include "SDL2/SDL.h"
+#include "6502/mos6502.hpp"
+#include "platform.hpp"
 #include <cstdint>
 #include <string>
+#include <vector>
 namespace VTxx {
 
-enum class VT168_Platform { VT168_BASE, VT168_MIWI2 };
-
-void vt168_init(VT168_Platform plat, const std::string &rom);
+// Set threaded_render to false to render each frame synchronously at the end
+// of VBLANK, which makes the output deterministic (for testing). engine is
+// the main CPU's execution engine. rom may be empty if one was loaded with
+// load_rom_data. It can be called again to start over, with threaded
+// rendering stopped first
+void vt168_init(VT168_Platform plat, VideoTiming timing,
+                const std::string &rom, bool threaded_render = true,
+                mos6502::Engine engine = mos6502::ENGINE_INTERP);
+// Run one master clock tick, returning true at the start of VBLANK
 bool vt168_tick();
-void vt168_process_event(SDL_Event *ev);
+// Run until the start of the next VBLANK, returning false if paused first
+bool vt168_run_frame();
+// Set the buttons held, as a mask of BTN_* (see input.hpp)
+void vt168_set_input(uint8_t buttons);
+
+// The main CPU and the SCPU, for tools
+mos6502::mos6502 &vt168_cpu();
+mos6502::mos6502 &vt168_scpu();
+// Replace how the main CPU runs each of its clocks, which is a RunT(1) or
+// RunFusedT(1) by default, for tools such as the lockstep checker. It returns
+// the number of clocks run, the CPU is then idle for any past the first.
+// Returning 0 after vt168_request_pause stops the tick before the clock, which
+// then runs from the step again on the next tick. nullptr restores the default
+typedef uint32_t (*CPUStepFn)(mos6502::mos6502 &cpu);
+void vt168_set_cpu_step(CPUStepFn fn);
+// The same for each clock the SCPU runs, normally a RunT(1). Only the return
+// value of 0 with a pause matters
+void vt168_set_scpu_step(CPUStepFn fn);
+// Replace the main CPU's bus handlers, which DMA also goes through, for tools
+// that watch its accesses. The direct zero page and stack are dropped while
+// replaced. nullptr restores the platform's
+void vt168_set_cpu_bus(ReadHandler r, WriteHandler w);
+// The same for the SCPU, which has no DMA
+void vt168_set_scpu_bus(ReadHandler r, WriteHandler w);
+const PlatformDesc &vt168_platform();
+
+// A snapshot of the whole machine, for restarting runs from a point such as
+// the end of a game's boot without reloading or booting again.
+// vt168_restore returns to the last vt168_snapshot, copying back only the
+// external memory pages written since (see mmu_snapshot), so it takes
+// microseconds. Call both between ticks. With threaded rendering, a frame
+// being rendered at the time may see either state. vt168_restore returns
+// false, leaving the machine as it is, if there has been no snapshot since
+// vt168_init
+void vt168_snapshot();
+bool vt168_restore();
+
+// Save the whole machine to data, with the external memory pages written
+// since the ROM was loaded. vt168_load_state returns false, leaving the
+// machine as it was, if data isn't a whole state for the same platform. States
+// are only meant to be loaded by the same build
+void vt168_save_state(std::vector<uint8_t> &data);
+bool vt168_load_state(const uint8_t *data, size_t len);
+
+// Pausing, for the debugger. A pause requested during a tick takes effect
+// once it is done: vt168_run_frame returns, and callers of vt168_tick should
+// stop calling it until vt168_resume
+// vt168_paused is only a read of the flag, cheap enough to check every tick
+extern bool vt168_pause_flag;
+void vt168_request_pause();
+inline bool vt168_paused() { return vt168_pause_flag; }
+void vt168_resume();
 }; // namespace VTxx
 
 #endif /* end of include guard: VT168_H */
@@ -0,0 +1,441 @@
+// Batch runner for a corpus of ROMs. Each job in a manifest runs a ROM
+// headless for a number of frames, optionally on recorded input, and checks
+// the hash of the output at given frames. Jobs run in parallel, each with a
+// timeout, and a JSON summary of the results, speed and memory use is written
+// at the end.
+//
+// The core is a single global machine, so jobs can't share a process. Instead
+// each worker slot takes the next job from the queue when it is free and runs
+// it in a forked child, which also keeps a crash or hang to that job
+#include "../src/movie.hpp"
+#include "../src/platform.hpp"
+#include "../src/ppu.hpp"
+#include "../src/util.hpp"
+#include "../src/vt168.hpp"
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+struct Job {
+  string name, dir, rom, platform = "vt168", input;
+  bool timing_set = false;
+  VideoTiming timing = VideoTiming::PAL;
+  uint64_t frames = 0;
+  double timeout = 0; // seconds, 0 for the default
+  // Expected output hashes, as (frame, hash)
+  vector<pair<uint64_t, uint64_t>> hashes;
+};
+
+enum Status { JOB_PASS, JOB_FAIL, JOB_SKIP, JOB_ERROR, JOB_TIMEOUT, JOB_CRASH };
+static const char *status_names[] = {"pass",  "fail",    "skip",
+                                     "error", "timeout", "crash"};
+
+// Sent from the child over a pipe when a job finishes. It is smaller than
+// PIPE_BUF, so it is written in one go and the child doesn't wait for the
+// parent to read it
+struct ChildResult {
+  int status;
+  double run_time; // seconds spent running frames
+  uint64_t last_hash;
+  char msg[256];
+};
+
+struct Result {
+  ChildResult child;
+  double wall_time;
+  long peak_rss_kb;
+};
+
+static const int frame_w = 256, frame_h = 240;
+
+static bool file_exists(const string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Resolve a path from the manifest, relative to its directory, then to
+// $OPENVTX_ROMS. Returns an empty string if not found
+static string find_file(const Job &j, const string &file) {
+  if (!file.empty() && file[0] == '/')
+    return file_exists(file) ? file : "";
+  if (file_exists(j.dir + "/" + file))
+    return j.dir + "/" + file;
+  const char *roms = getenv("OPENVTX_ROMS");
+  if (roms != nullptr && file_exists(string(roms) + "/" + file))
+    return string(roms) + "/" + file;
+  return "";
+}
+
+static bool parse_job(const string &line, Job &j) {
+  istringstream ls(line);
+  string tok;
+  while (ls >> tok) {
+    size_t eq = tok.find('=');
+    if (eq == string::npos)
+      return false;
+    string key = tok.substr(0, eq), val = tok.substr(eq + 1);
+    istringstream vs(val);
+    bool ok = true;
+    if (key == "name") {
+      j.name = val;
+    } else if (key == "rom") {
+      j.rom = val;
+    } else if (key == "platform") {
+      j.platform = val;
+    } else if (key == "timing") {
+      ok = parse_timing(val, j.timing);
+      j.timing_set = true;
+    } else if (key == "frames") {
+      ok = (vs >> j.frames) && j.frames > 0;
+    } else if (key == "input") {
+      j.input = val;
+    } else if (key == "timeout") {
+      ok = (vs >> j.timeout) && j.timeout > 0;
+    } else if (key == "hash") {
+      uint64_t f, h;
+      char colon;
+      ok = (vs >> dec >> f >> colon >> hex >> h) && colon == ':';
+      j.hashes.push_back(make_pair(f, h));
+    } else {
+      ok = false;
+    }
+    if (!ok)
+      return false;
+  }
+  if (j.rom.empty() || j.frames == 0)
+    return false;
+  if (j.name.empty()) {
+    size_t slash = j.rom.find_last_of('/');
+    j.name = j.rom.substr(slash == string::npos ? 0 : slash + 1);
+    j.name = j.name.substr(0, j.name.rfind('.'));
+  }
+  return true;
+}
+
+static bool load_manifest(const string &path, vector<Job> &jobs) {
+  ifstream in(path);
+  if (!in) {
+    cerr << path << ": can't open" << endl;
+    return false;
+  }
+  size_t slash = path.find_last_of('/');
+  string dir = (slash == string::npos) ? "." : path.substr(0, slash);
+  string line;
+  int line_no = 0;
+  while (getline(in, line)) {
+    line_no++;
+    line = line.substr(0, line.find('#'));
+    if (line.find_first_not_of(" \t\r") == string::npos)
+      continue;
+    Job j;
+    j.dir = dir;
+    if (!parse_job(line, j)) {
+      cerr << path << ":" << line_no << ": bad job" << endl;
+      return false;
+    }
+    jobs.push_back(j);
+  }
+  return true;
+}
+
+// Run a job in the current process
+static ChildResult run_job(const Job &j) {
+  ChildResult r;
+  memset(&r, 0, sizeof(r));
+  r.status = JOB_ERROR;
+  const PlatformDesc *plat = find_platform(j.platform);
+  if (plat == nullptr) {
+    snprintf(r.msg, sizeof(r.msg), "unknown platform %s", j.platform.c_str());
+    return r;
+  }
+  string rom = find_file(j, j.rom);
+  if (rom.empty()) {
+    r.status = JOB_SKIP;
+    snprintf(r.msg, sizeof(r.msg), "ROM %s not found", j.rom.c_str());
+    return r;
+  }
+  VideoTiming timing = j.timing;
+  if (!j.timing_set && !detect_rom_timing(rom, timing))
+    timing = plat->default_timing;
+  InputMovie movie;
+  if (!j.input.empty() && !movie.load(find_file(j, j.input))) {
+    snprintf(r.msg, sizeof(r.msg), "can't load input %s", j.input.c_str());
+    return r;
+  }
+
+  // The core logs to cout
+  cout.setstate(ios::failbit);
+  vt168_init(plat->id, timing, rom, false);
+  uint64_t n_bad = 0, first_bad = 0;
+  auto start = chrono::steady_clock::now();
+  for (uint64_t f = 0; f < j.frames; f++) {
+    vt168_set_input(movie.buttons_at(f));
+    vt168_run_frame();
+    bool check = (f == j.frames - 1);
+    for (const auto &h : j.hashes)
+      check = check || h.first == f;
+    if (!check)
+      continue;
+    uint64_t h =
+        fnv1a64(get_render_buffer(), frame_w * frame_h * sizeof(uint32_t));
+    r.last_hash = h;
+    for (const auto &e : j.hashes) {
+      if (e.first != f || e.second == h)
+        continue;
+      if (n_bad++ == 0)
+        first_bad = f;
+    }
+  }
+  r.run_time =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  for (const auto &e : j.hashes) {
+    if (e.first >= j.frames && n_bad++ == 0)
+      first_bad = e.first;
+  }
+  if (n_bad > 0) {
+    r.status = JOB_FAIL;
+    snprintf(r.msg, sizeof(r.msg), "%llu hashes differ, first at frame %llu",
+             (unsigned long long)n_bad, (unsigned long long)first_bad);
+  } else {
+    r.status = JOB_PASS;
+  }
+  return r;
+}
+
+struct Running {
+  pid_t pid;
+  size_t job;
+  int fd;
+  chrono::steady_clock::time_point start;
+  bool killed;
+};
+
+static bool start_job(const Job &j, size_t idx, Running &run) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    return false;
+  }
+  cerr.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    ChildResult r = run_job(j);
+    ssize_t n = write(fds[1], &r, sizeof(r));
+    _exit(n == sizeof(r) ? 0 : 1);
+  }
+  close(fds[1]);
+  run.pid = pid;
+  run.job = idx;
+  run.fd = fds[0];
+  run.start = chrono::steady_clock::now();
+  run.killed = false;
+  return true;
+}
+
+static void finish_job(const Running &run, int wstatus, const rusage &ru,
+                       Result &res) {
+  res.wall_time = chrono::duration<double>(chrono::steady_clock::now() -
+                                           run.start)
+                      .count();
+  res.peak_rss_kb = ru.ru_maxrss;
+  ChildResult &r = res.child;
+  memset(&r, 0, sizeof(r));
+  bool got = read(run.fd, &r, sizeof(r)) == sizeof(r);
+  close(run.fd);
+  if (run.killed) {
+    r.status = JOB_TIMEOUT;
+    snprintf(r.msg, sizeof(r.msg), "killed after %.1fs", res.wall_time);
+  } else if (WIFSIGNALED(wstatus)) {
+    r.status = JOB_CRASH;
+    snprintf(r.msg, sizeof(r.msg), "crashed with signal %d",
+             WTERMSIG(wstatus));
+  } else if (!got) {
+    r.status = JOB_ERROR;
+    snprintf(r.msg, sizeof(r.msg), "no result, exit status %d",
+             WEXITSTATUS(wstatus));
+  }
+}
+
+static string json_str(const string &s) {
+  string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+static void write_summary(ostream &out, const vector<Job> &jobs,
+                          const vector<Result> &results, int n_workers,
+                          double wall_time) {
+  int counts[6] = {0};
+  uint64_t total_frames = 0;
+  long peak_rss = 0;
+  out << "{\n  \"jobs\": [";
+  for (size_t i = 0; i < jobs.size(); i++) {
+    const Job &j = jobs[i];
+    const Result &r = results[i];
+    const ChildResult &c = r.child;
+    counts[c.status]++;
+    bool ran = (c.status == JOB_PASS || c.status == JOB_FAIL);
+    if (ran)
+      total_frames += j.frames;
+    peak_rss = max(peak_rss, r.peak_rss_kb);
+    char hash[24];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)c.last_hash);
+    out << (i ? ",\n" : "\n") << "    {\"name\": " << json_str(j.name)
+        << ", \"platform\": " << json_str(j.platform)
+        << ", \"rom\": " << json_str(j.rom) << ", \"frames\": " << j.frames
+        << ", \"status\": \"" << status_names[c.status] << "\""
+        << ", \"seconds\": " << r.wall_time << ", \"fps\": "
+        << ((ran && c.run_time > 0) ? j.frames / c.run_time : 0)
+        << ", \"peak_rss_kb\": " << r.peak_rss_kb;
+    if (ran)
+      out << ", \"last_hash\": \"" << hash << "\"";
+    if (c.msg[0] != '\0')
+      out << ", \"message\": " << json_str(c.msg);
+    out << "}";
+  }
+  out << "\n  ],\n  \"summary\": {";
+  for (int s = JOB_PASS; s <= JOB_CRASH; s++)
+    out << "\"" << status_names[s] << "\": " << counts[s] << ", ";
+  out << "\"workers\": " << n_workers << ", \"seconds\": " << wall_time
+      << ", \"fps\": " << (wall_time > 0 ? total_frames / wall_time : 0)
+      << ", \"peak_rss_kb\": " << peak_rss << "}\n}" << endl;
+}
+
+static void usage() {
+  cerr << "Usage: " << endl;
+  cerr << "openvtx-batch [options] manifest" << endl;
+  cerr << "  --jobs=N       jobs to run at once (one per CPU)" << endl;
+  cerr << "  --timeout=SEC  default time limit per job (60)" << endl;
+  cerr << "  --out=FILE     write the JSON summary to FILE, not stdout" << endl;
+  cerr << "Each manifest line is a job, as key=value words:" << endl;
+  cerr << "  rom=FILE frames=N [platform=NAME] [timing=pal|ntsc]" << endl;
+  cerr << "  [input=FILE] [hash=FRAME:HEX]... [timeout=SEC] [name=NAME]"
+       << endl;
+}
+
+int main(int argc, const char *argv[]) {
+  int n_workers = thread::hardware_concurrency();
+  double timeout = 60;
+  string manifest, out_file;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.substr(0, 7) == "--jobs=") {
+      n_workers = atoi(arg.substr(7).c_str());
+    } else if (arg.substr(0, 10) == "--timeout=") {
+      timeout = atof(arg.substr(10).c_str());
+    } else if (arg.substr(0, 6) == "--out=") {
+      out_file = arg.substr(6);
+    } else if (arg.substr(0, 2) == "--" || !manifest.empty()) {
+      usage();
+      return 2;
+    } else {
+      manifest = arg;
+    }
+  }
+  if (manifest.empty() || timeout <= 0) {
+    usage();
+    return 2;
+  }
+  if (n_workers < 1)
+    n_workers = 1;
+  vector<Job> jobs;
+  if (!load_manifest(manifest, jobs))
+    return 2;
+
+  vector<Result> results(jobs.size());
+  vector<Running> running;
+  size_t next = 0;
+  auto start = chrono::steady_clock::now();
+  while (next < jobs.size() || !running.empty()) {
+    while (next < jobs.size() && int(running.size()) < n_workers) {
+      Running run;
+      if (!start_job(jobs[next], next, run)) {
+        results[next].child.status = JOB_ERROR;
+        snprintf(results[next].child.msg, sizeof(results[next].child.msg),
+                 "can't start");
+      } else {
+        running.push_back(run);
+      }
+      next++;
+    }
+    int wstatus;
+    rusage ru;
+    pid_t pid = wait4(-1, &wstatus, WNOHANG, &ru);
+    if (pid > 0) {
+      for (size_t i = 0; i < running.size(); i++) {
+        if (running[i].pid != pid)
+          continue;
+        const Job &j = jobs[running[i].job];
+        Result &res = results[running[i].job];
+        finish_job(running[i], wstatus, ru, res);
+        cerr << j.name << ": " << status_names[res.child.status];
+        if (res.child.msg[0] != '\0')
+          cerr << ", " << res.child.msg;
+        cerr << endl;
+        running.erase(running.begin() + i);
+        break;
+      }
+      continue;
+    }
+    auto now = chrono::steady_clock::now();
+    for (Running &run : running) {
+      double limit =
+          jobs[run.job].timeout > 0 ? jobs[run.job].timeout : timeout;
+      if (!run.killed &&
+          chrono::duration<double>(now - run.start).count() > limit) {
+        kill(run.pid, SIGKILL);
+        run.killed = true;
+      }
+    }
+    this_thread::sleep_for(chrono::milliseconds(5));
+  }
+  double wall_time =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  if (out_file.empty()) {
+    write_summary(cout, jobs, results, n_workers, wall_time);
+  } else {
+    ofstream out(out_file);
+    write_summary(out, jobs, results, n_workers, wall_time);
+    if (!out) {
+      cerr << out_file << ": can't write" << endl;
+      return 2;
+    }
+  }
+  int failed = 0;
+  for (const Result &r : results)
+    failed += (r.child.status != JOB_PASS && r.child.status != JOB_SKIP);
+  cerr << jobs.size() - failed << " of " << jobs.size() << " jobs passed or "
+       << "skipped" << endl;
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,441 @@
+// Tests of the emulator core that need a whole machine, such as debugging
+// under each CPU engine. Each test builds a small ROM in memory, so no ROMs
+// are needed. Tests can be picked by name on the command line, otherwise all
+// are run
+#include "../src/debug.hpp"
+#include "../src/mmu.hpp"
+#include "../src/openvtx.h"
+#include "../src/platform.hpp"
+#include "../src/ppu.hpp"
+#include "../src/savefile.hpp"
+#include "../src/util.hpp"
+#include "../src/vt168.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+static const uint32_t rom_size = 0x80000;
+// Where the CPU's E000-FFFF is in the image
+static const uint32_t rom_e000 = rom_size - 0x2000;
+
+static bool failed;
+
+static void check(bool ok, const string &what) {
+  if (!ok) {
+    cerr << "    " << what << endl;
+    failed = true;
+  }
+}
+
+// A ROM with code at E000, where it starts, and an NMI and IRQ handler at
+// E100 of nmi then RTI
+static vector<uint8_t> make_rom(const vector<uint8_t> &code,
+                                const vector<uint8_t> &nmi = {}) {
+  vector<uint8_t> rom(rom_size, 0);
+  copy(code.begin(), code.end(), rom.begin() + rom_e000);
+  copy(nmi.begin(), nmi.end(), rom.begin() + rom_e000 + 0x100);
+  rom[rom_e000 + 0x100 + nmi.size()] = 0x40;
+  const uint8_t vectors[] = {0x00, 0xE1, 0x00, 0xE0, 0x00, 0xE1};
+  copy(vectors, vectors + 6, rom.begin() + rom_size - 6);
+  return rom;
+}
+
+static void boot(const vector<uint8_t> &rom,
+                 mos6502::Engine engine = mos6502::ENGINE_INTERP) {
+  load_rom_data(rom.data(), rom.size());
+  vt168_init(find_platform("vt168")->id, VideoTiming::PAL, "", false, engine);
+}
+
+// Run until the next debugger pause, returning false if there is none within
+// a few frames
+static bool run_to_pause(DebugHit &hit) {
+  for (int i = 0; i < 4; i++)
+    if (!vt168_run_frame())
+      return debug_last_hit(hit);
+  return false;
+}
+
+// A breakpoint on the BNE of a DEX, BNE loop, which the fused engine runs as
+// one sequence, must hit on every pass, and single steps must run one
+// instruction
+static void test_break_fused() {
+  // E000: LDX #5; E002: DEX; E003: BNE E002; E005: JMP E000
+  const vector<uint8_t> rom =
+      make_rom({0xA2, 0x05, 0xCA, 0xD0, 0xFD, 0x4C, 0x00, 0xE0});
+  for (mos6502::Engine e : {mos6502::ENGINE_INTERP, mos6502::ENGINE_FUSED}) {
+    string name = mos6502::EngineName(e);
+    boot(rom, e);
+    debug_add(DebugSpace::CPU, 0xE003, 0xE003, DEBUG_EXEC);
+    // X on each pass, going round the loop again after 0
+    const uint8_t expect_x[] = {4, 3, 2, 1, 0, 4, 3};
+    DebugHit hit;
+    for (uint8_t x : expect_x) {
+      if (!run_to_pause(hit)) {
+        check(false, name + ": breakpoint missed");
+        break;
+      }
+      check(hit.access == DEBUG_EXEC && hit.pc == 0xE003 &&
+                vt168_cpu().GetState().X == x,
+            name + ": breakpoint hit at the wrong point");
+      debug_resume();
+    }
+    // From the breakpoint, with X = 2: BNE, then DEX
+    run_to_pause(hit);
+    const uint16_t expect_pc[] = {0xE002, 0xE003};
+    for (uint16_t pc : expect_pc) {
+      debug_step(DebugCPU::MAIN);
+      check(run_to_pause(hit) && hit.access == DEBUG_STEP &&
+                vt168_cpu().GetPC() == pc,
+            name + ": step didn't run one instruction");
+    }
+    check(vt168_cpu().GetState().X == 1, name + ": step ran too far");
+    debug_clear();
+    debug_resume();
+  }
+}
+
+// Hash of the output frame, RAM, the CPU registers and a byte of external
+// memory
+static uint64_t machine_hash(uint32_t ext_addr) {
+  uint64_t h = fnv1a64(get_render_buffer(), 256 * 240 * sizeof(uint32_t));
+  h = fnv1a64(cpu_ram, sizeof(cpu_ram), h);
+  mos6502::mos6502::State s = vt168_cpu().GetState();
+  const uint8_t regs[] = {s.A, s.X, s.Y, s.sp, s.status, uint8_t(s.pc),
+                          uint8_t(s.pc >> 8)};
+  h = fnv1a64(regs, sizeof(regs), h);
+  uint8_t ext = read_mem_physical(ext_addr);
+  return fnv1a64(&ext, 1, h);
+}
+
+// Writes a counter to external memory through the banked window, RAM and
+// VRAM, with NMI on
+// E000: LDA #1; STA $2000
+// E005: INX; STX $8000; STX $10; STX $2007; JMP E005
+static const vector<uint8_t> writer_code = {
+    0xA9, 0x01, 0x8D, 0x00, 0x20, 0xE8, 0x8E, 0x00, 0x80,
+    0x86, 0x10, 0x8E, 0x07, 0x20, 0x4C, 0x05, 0xE0};
+
+// Runs from a snapshot must repeat exactly, with the external memory written
+// since put back
+static void test_snapshot() {
+  boot(make_rom(writer_code));
+  check(!vt168_restore(), "restore without a snapshot");
+  uint32_t ext_addr = decode_address(0x8000);
+  for (int i = 0; i < 10; i++)
+    vt168_run_frame();
+  vt168_snapshot();
+  uint8_t ext = read_mem_physical(ext_addr);
+  const int n = 30;
+  vector<uint64_t> hashes;
+  for (int i = 0; i < n; i++) {
+    vt168_run_frame();
+    hashes.push_back(machine_hash(ext_addr));
+  }
+  check(read_mem_physical(ext_addr) != ext, "external memory not written");
+  for (int r = 0; r < 2; r++) {
+    check(vt168_restore(), "restore failed");
+    check(read_mem_physical(ext_addr) == ext, "external memory not restored");
+    for (int i = 0; i < n; i++) {
+      vt168_run_frame();
+      if (machine_hash(ext_addr) != hashes[i]) {
+        check(false, "frame " + to_string(i) + " differs after restore");
+        break;
+      }
+    }
+  }
+  // A CPU halted on an illegal opcode stays halted
+  boot(make_rom({0xEA, 0x02}));
+  vt168_cpu().assertOnTrap = false;
+  for (int i = 0; i < 2; i++)
+    vt168_run_frame();
+  check(vt168_cpu().IsHalted(), "CPU not halted");
+  vt168_snapshot();
+  check(vt168_restore() && vt168_cpu().IsHalted(), "halt not restored");
+}
+
+// Polls VBLANK with fused LDA, AND #, BEQ sequences and takes NMIs and CPU
+// timer IRQs, with the timer started and acknowledged by fused LDA, STA
+// sequences. Every frame must be the same under both engines
+// E000: LDA #3B; STA $2101; LDA #FE; STA $2104     timer preload FE3B
+// E00A: LDA #2; STA $2121; LDA #3; STA $2102        timer IRQ on
+// E014: LDA #1; STA $2000; CLI                     NMI on
+// E01A: LDA $2001; AND #80; BEQ E01A              wait for VBLANK
+// E021: INC $10; LDX #20; DEX; BNE E025
+// E028: LDA $10; STA $0300
+// E02D: LDA $2001; AND #80; BNE E02D              wait for the end of it
+// E034: JMP E01A
+static const vector<uint8_t> timing_code = {
+    0xA9, 0x3B, 0x8D, 0x01, 0x21, 0xA9, 0xFE, 0x8D, 0x04, 0x21, 0xA9, 0x02,
+    0x8D, 0x21, 0x21, 0xA9, 0x03, 0x8D, 0x02, 0x21, 0xA9, 0x01, 0x8D, 0x00,
+    0x20, 0x58, 0xAD, 0x01, 0x20, 0x29, 0x80, 0xF0, 0xF9, 0xE6, 0x10, 0xA2,
+    0x20, 0xCA, 0xD0, 0xFD, 0xA5, 0x10, 0x8D, 0x00, 0x03, 0xAD, 0x01, 0x20,
+    0x29, 0x80, 0xD0, 0xF9, 0x4C, 0x1A, 0xE0};
+// E200: PHA; INC $11; LDA $11; STA $2103; STA $0301; PLA; RTI
+static const vector<uint8_t> timing_irq = {0x48, 0xE6, 0x11, 0xA5, 0x11, 0x8D,
+                                           0x03, 0x21, 0x8D, 0x01, 0x03, 0x68,
+                                           0x40};
+
+static void test_fused_timing() {
+  // NMI: INC $12
+  vector<uint8_t> rom = make_rom(timing_code, {0xE6, 0x12});
+  copy(timing_irq.begin(), timing_irq.end(), rom.begin() + rom_e000 + 0x200);
+  rom[rom_size - 8] = 0x00;
+  rom[rom_size - 7] = 0xE2;
+  const int n = 60;
+  vector<uint64_t> hashes[2];
+  bool irqs = false;
+  for (mos6502::Engine e : {mos6502::ENGINE_INTERP, mos6502::ENGINE_FUSED}) {
+    boot(rom, e);
+    for (int i = 0; i < n; i++) {
+      uint8_t count = cpu_ram[0x11];
+      vt168_run_frame();
+      irqs = irqs || (cpu_ram[0x11] != count);
+      hashes[e == mos6502::ENGINE_FUSED].push_back(machine_hash(0));
+    }
+  }
+  check(irqs, "no timer IRQs");
+  for (int i = 0; i < n; i++) {
+    if (hashes[0][i] != hashes[1][i]) {
+      check(false, "frame " + to_string(i) + " differs under the fused engine");
+      break;
+    }
+  }
+}
+
+// Stopping at breakpoints and resuming must not change the run: the CPU must
+// run the instruction it stopped before in the same clock. Breakpoints on the
+// end of the VBLANK wait and in the timer IRQ handler hit many times a frame
+static void test_break_timing() {
+  vector<uint8_t> rom = make_rom(timing_code, {0xE6, 0x12});
+  copy(timing_irq.begin(), timing_irq.end(), rom.begin() + rom_e000 + 0x200);
+  rom[rom_size - 8] = 0x00;
+  rom[rom_size - 7] = 0xE2;
+  const int n = 20;
+  vector<uint64_t> hashes[2];
+  int hits = 0;
+  for (int with_break = 0; with_break < 2; with_break++) {
+    boot(rom);
+    if (with_break) {
+      debug_add(DebugSpace::CPU, 0xE021, 0xE021, DEBUG_EXEC);
+      debug_add(DebugSpace::CPU, 0xE205, 0xE205, DEBUG_EXEC);
+    }
+    for (int i = 0; i < n; i++) {
+      while (!vt168_run_frame()) {
+        hits++;
+        debug_resume();
+      }
+      uint64_t cycles = vt168_cpu().GetCycles();
+      hashes[with_break].push_back(fnv1a64(&cycles, sizeof(cycles),
+                                           machine_hash(0)));
+    }
+    debug_clear();
+  }
+  check(hits > n, "breakpoints missed");
+  for (int i = 0; i < n; i++) {
+    if (hashes[0][i] != hashes[1][i]) {
+      check(false, "frame " + to_string(i) + " differs with breakpoints");
+      break;
+    }
+  }
+}
+
+// The pages a restore puts back must be saved again, so that a save file
+// reloads to the memory as restored rather than as written before it
+static void test_save_restore() {
+  const string file = "openvtx-coretest.sav";
+  remove(file.c_str());
+  boot(make_rom(writer_code));
+  uint32_t page = decode_address(0x8000) & ~0x1FFFu;
+  const SaveRegion region = {page, page + 0x2000};
+  check(save_open(file, {region}), "save file not opened");
+  auto read_region = [&]() {
+    vector<uint8_t> data;
+    for (uint32_t pa = region.start; pa < region.end; pa++)
+      data.push_back(read_mem_physical(pa));
+    return data;
+  };
+  for (int i = 0; i < 10; i++)
+    vt168_run_frame();
+  vt168_snapshot();
+  vector<uint8_t> at_snapshot = read_region();
+  for (int i = 0; i < 10; i++)
+    vt168_run_frame();
+  check(read_region() != at_snapshot, "external memory not written");
+  vt168_restore();
+  save_close();
+  boot(make_rom(writer_code));
+  check(save_open(file, {region}), "save file not reopened");
+  check(read_region() == at_snapshot, "save file doesn't match the restore");
+  save_close();
+  remove(file.c_str());
+}
+
+static vector<uint8_t> save_state(openvtx *vtx) {
+  vector<uint8_t> data(openvtx_save_state(vtx, nullptr, 0));
+  openvtx_save_state(vtx, data.data(), data.size());
+  return data;
+}
+
+// A saved state must load back to the same machine, and a short or damaged
+// one must be rejected without changing it
+static void test_save_state() {
+  openvtx *vtx = openvtx_create("vt168", OPENVTX_TIMING_DEFAULT);
+  const vector<uint8_t> rom = make_rom(writer_code);
+  openvtx_load_rom(vtx, rom.data(), rom.size());
+  uint32_t ext_addr = decode_address(0x8000);
+  for (int i = 0; i < 10; i++)
+    openvtx_run_frame(vtx);
+  vector<uint8_t> state = save_state(vtx);
+  const int n = 20;
+  vector<uint64_t> hashes;
+  for (int i = 0; i < n; i++) {
+    openvtx_run_frame(vtx);
+    hashes.push_back(machine_hash(ext_addr));
+  }
+  check(openvtx_load_state(vtx, state.data(), state.size()) == 0,
+        "load failed");
+  check(save_state(vtx) == state, "state differs after loading it");
+  for (int i = 0; i < n; i++) {
+    openvtx_run_frame(vtx);
+    if (machine_hash(ext_addr) != hashes[i]) {
+      check(false, "frame " + to_string(i) + " differs after load");
+      break;
+    }
+  }
+
+  vector<uint8_t> now = save_state(vtx);
+  for (size_t len : {state.size() - 1, state.size() / 2, size_t(8)})
+    check(openvtx_load_state(vtx, state.data(), len) < 0,
+          "loaded a state cut to " + to_string(len) + " bytes");
+  vector<uint8_t> bad = state;
+  bad[0] ^= 0xFF;
+  check(openvtx_load_state(vtx, bad.data(), bad.size()) < 0,
+        "loaded a state with a bad header");
+  check(save_state(vtx) == now, "rejected state changed the machine");
+  openvtx_destroy(vtx);
+}
+
+// Draws a background of 16x16 hi-colour tiles, scrolled one pixel for each
+// frame A is held
+static vector<uint8_t> make_scroll_rom() {
+  vector<uint8_t> rom = make_rom(
+      {// Tile map of 256 cells with vectors 1 to 8, at VRAM 0
+       0xA9, 0x00, 0x8D, 0x06, 0x20, 0x8D, 0x05, 0x20, 0xA2, 0x00, 0x8A,
+       0x29, 0x07, 0x18, 0x69, 0x01, 0x8D, 0x07, 0x20, 0xA9, 0x00, 0x8D,
+       0x07, 0x20, 0xE8, 0xD0, 0xEF,
+       // TV palette 0, background 0 on it as hi-colour 16x16 tiles, NMI on
+       0xA9, 0x02, 0x8D, 0x0E, 0x20, 0xA9, 0x01, 0x8D, 0x0F, 0x20, 0xA9,
+       0x10, 0x8D, 0x12, 0x20, 0xA9, 0x81, 0x8D, 0x13, 0x20, 0xA9, 0x01,
+       0x8D, 0x00, 0x20, 0x4C, 0x34, 0xE0},
+      // LDA $2129 (A); CLC; ADC $10; STA $10; STA $2010 (X scroll)
+      {0xAD, 0x29, 0x21, 0x18, 0x65, 0x10, 0x85, 0x10, 0x8D, 0x10, 0x20});
+  // Tile v is at v * 0x200
+  for (uint32_t i = 0x200; i < 0x1200; i += 2) {
+    uint16_t px = ((i * 0x0C63) >> 4) & 0x7FFF;
+    rom[i] = px & 0xFF;
+    rom[i + 1] = px >> 8;
+  }
+  return rom;
+}
+
+// Two environments, stepped with different buttons, must each match the same
+// run in this process, in their own part of the observation and RAM buffers
+static void test_vec() {
+  const vector<uint8_t> rom = make_scroll_rom();
+  const int n = 2, frames = 30;
+  const size_t frame_size = 256 * 240 * sizeof(uint32_t);
+  const uint8_t buttons[n] = {OPENVTX_BTN_A, 0};
+  // The expected observations and RAM of each environment after the frames
+  vector<uint8_t> expect_obs[n], expect_ram[n];
+  for (int e = 0; e < n; e++) {
+    boot(rom);
+    for (int f = 0; f < frames; f++) {
+      vt168_set_input(buttons[e]);
+      vt168_run_frame();
+    }
+    const uint8_t *fb = reinterpret_cast<uint8_t *>(get_render_buffer());
+    expect_obs[e].assign(fb, fb + frame_size);
+    expect_ram[e].assign(cpu_ram, cpu_ram + sizeof(cpu_ram));
+  }
+  check(expect_obs[0] != expect_obs[1], "buttons didn't change the output");
+
+  openvtx_vec *vec = openvtx_vec_create("vt168", OPENVTX_TIMING_DEFAULT,
+                                        rom.data(), rom.size(), n,
+                                        OPENVTX_OBS_ARGB, 1);
+  if (vec == nullptr) {
+    check(false, "create failed");
+    return;
+  }
+  size_t size;
+  const uint8_t *obs = openvtx_vec_obs(vec, &size);
+  const uint8_t *ram = openvtx_vec_ram(vec);
+  check(size == frame_size, "wrong observation size");
+  for (int f = 0; f < frames; f++)
+    check(openvtx_vec_step(vec, buttons) == 0, "step failed");
+  for (int e = 0; e < n; e++) {
+    string env = "environment " + to_string(e);
+    check(equal(obs + e * size, obs + (e + 1) * size, expect_obs[e].begin()),
+          env + ": wrong observation");
+    check(equal(ram + e * sizeof(cpu_ram), ram + (e + 1) * sizeof(cpu_ram),
+                expect_ram[e].begin()),
+          env + ": wrong RAM");
+  }
+
+  // Reset the first, which goes back to a black frame and leaves the second
+  check(openvtx_vec_reset(vec, 0) == 0, "reset failed");
+  const uint32_t *obs0 = reinterpret_cast<const uint32_t *>(obs);
+  check(all_of(obs0, obs0 + 256 * 240,
+               [](uint32_t px) { return px == 0xFF000000; }),
+        "reset didn't clear the observation");
+  check(equal(obs + size, obs + 2 * size, expect_obs[1].begin()),
+        "reset changed the other environment");
+  for (int f = 0; f < frames; f++)
+    openvtx_vec_step(vec, buttons);
+  check(equal(obs, obs + size, expect_obs[0].begin()),
+        "run after reset differs");
+  openvtx_vec_destroy(vec);
+
+  vec = openvtx_vec_create("vt168", OPENVTX_TIMING_DEFAULT, rom.data(),
+                           rom.size(), n, OPENVTX_OBS_GREY, 2);
+  openvtx_vec_obs(vec, &size);
+  check(size == 128 * 120, "wrong downsampled greyscale size");
+  openvtx_vec_destroy(vec);
+}
+
+struct TestCase {
+  const char *name;
+  void (*fn)();
+};
+
+static const TestCase tests[] = {
+    {"break-fused", test_break_fused},
+    {"snapshot", test_snapshot},
+    {"fused-timing", test_fused_timing},
+    {"break-timing", test_break_timing},
+    {"save-restore", test_save_restore},
+    {"save-state", test_save_state},
+    {"vec", test_vec},
+};
+
+int main(int argc, const char *argv[]) {
+  // The core logs to cout, keep the report readable
+  cout.setstate(ios::failbit);
+  int passed = 0, n_failed = 0;
+  for (const TestCase &t : tests) {
+    bool picked = (argc < 2);
+    for (int i = 1; i < argc; i++)
+      picked = picked || (argv[i] == string(t.name));
+    if (!picked)
+      continue;
+    failed = false;
+    t.fn();
+    cerr << t.name << ": " << (failed ? "FAIL" : "PASS") << endl;
+    (failed ? n_failed : passed)++;
+  }
+  cerr << passed << " passed, " << n_failed << " failed" << endl;
+  return n_failed ? 1 : 0;
+}
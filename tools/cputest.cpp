@@ -0,0 +1,511 @@
+// 6502 conformance and timing tests for the CPU core. Test images, such as
+// Klaus Dormann's 6502 functional and decimal mode tests, are loaded into a
+// flat 64k memory and run one instruction at a time on the interpreter,
+// checking every instruction's cycle count against a reference table. Other
+// engines are run in lockstep with a checked interpreter, and must match it
+// after each step. Each image is then run again scrambled (with the opcodes
+// remapped as on the MiWi2), and timed without checks to give instructions
+// per second. --random runs random programs made of documented opcodes, for
+// when no test images are at hand
+#include "../src/6502/mos6502.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+typedef mos6502::mos6502 CPU;
+
+struct Image {
+  string kind, file;
+  uint16_t load, start;
+  // PC of the success trap, if the test has one
+  bool has_success;
+  uint16_t success;
+  // Address of a result byte that must be zero at the end, if the test has one
+  bool has_result;
+  uint16_t result;
+};
+
+struct Outcome {
+  bool trapped, halted;
+  bool diverged; // an engine didn't match the interpreter
+  uint16_t pc;
+  uint64_t insts, cycles;
+  uint64_t bad_cycles; // instructions whose cycle count was wrong
+};
+
+// Stop runaway tests, the functional test needs around 30 million
+static const uint64_t max_insts = 500000000;
+
+static uint8_t mem[0x10000];
+// Memory for the interpreter that other engines are checked against
+static uint8_t ref_mem[0x10000];
+
+// How each address was accessed by the last checked run
+enum { MEM_CODE = 1, MEM_DATA = 2, MEM_WRITTEN = 4 };
+static uint8_t mem_use[0x10000];
+// Set before each checked step, as the first read is the opcode fetch
+static bool fetch_next = false;
+
+static uint8_t scramble_op(uint8_t op) {
+  return (op & 0x7B) | ((op & 0x04) << 5) | ((op & 0x80) >> 5);
+}
+
+static uint8_t fast_read(uint16_t a) { return mem[a]; }
+static void fast_write(uint16_t a, uint8_t d) { mem[a] = d; }
+
+static uint8_t checked_read(uint16_t a) {
+  if (fetch_next) {
+    fetch_next = false;
+    mem_use[a] |= MEM_CODE;
+  } else {
+    mem_use[a] |= MEM_DATA;
+  }
+  return mem[a];
+}
+
+static void checked_write(uint16_t a, uint8_t d) {
+  mem_use[a] |= MEM_WRITTEN;
+  mem[a] = d;
+}
+
+static uint8_t ref_read(uint16_t a) {
+  fetch_next = false;
+  return ref_mem[a];
+}
+
+static void ref_write(uint16_t a, uint8_t d) { ref_mem[a] = d; }
+
+// Reference NMOS 6502 cycle counts, from the datasheet, with '.' for the
+// undocumented opcodes
+static const char *const ref_cycles[16] = {
+    "76...35.322..46.", "25...46.24...47.", "66..335.422.446.",
+    "25...46.24...47.", "66...35.322.346.", "25...46.24...47.",
+    "66...35.422.546.", "25...46.24...47.", ".6..333.2.2.444.",
+    "26..444.252..5..", "262.333.222.444.", "25..444.242.444.",
+    "26..335.222.446.", "25...46.24...47.", "26..335.222.446.",
+    "25...46.24...47.",
+};
+
+static int ref_base(uint8_t op) {
+  char c = ref_cycles[op >> 4][op & 0x0F];
+  return (c == '.' || c == '\0') ? 0 : c - '0';
+}
+
+// Expected cycles for the instruction about to run from state s over memory
+// m, or 0 for an undocumented opcode
+static int expected_cycles(const uint8_t *m, const CPU::State &s,
+                           bool scrambled) {
+  uint8_t op = m[s.pc];
+  if (scrambled)
+    op = scramble_op(op);
+  int n = ref_base(op);
+  if (n == 0)
+    return 0;
+  uint8_t lo = m[uint16_t(s.pc + 1)], hi = m[uint16_t(s.pc + 2)];
+  if ((op & 0x1F) == 0x10) {
+    // Branches, on N, V, C or Z being clear or set
+    static const uint8_t flags[4] = {0x80, 0x40, 0x01, 0x02};
+    bool set = (s.status & flags[op >> 6]) != 0;
+    if (set == bool(op & 0x20)) {
+      uint16_t next = s.pc + 2;
+      uint16_t target = next + int8_t(lo);
+      n += ((target ^ next) & 0xFF00) ? 2 : 1;
+    }
+    return n;
+  }
+  // Reads that take longer when indexing crosses a page
+  uint16_t base;
+  uint8_t index;
+  if ((op & 0x1F) == 0x11 && op != 0x91) { // (zp),Y
+    base = m[lo] | (m[uint8_t(lo + 1)] << 8);
+    index = s.Y;
+  } else if (((op & 0x1F) == 0x19 && op != 0x99) || op == 0xBE) { // abs,Y
+    base = lo | (hi << 8);
+    index = s.Y;
+  } else if (((op & 0x1F) == 0x1D && op != 0x9D) || op == 0xBC) { // abs,X
+    base = lo | (hi << 8);
+    index = s.X;
+  } else {
+    return n;
+  }
+  if (((base + index) ^ base) & 0xFF00)
+    n++;
+  return n;
+}
+
+static bool same_state(const CPU::State &a, const CPU::State &b) {
+  return a.A == b.A && a.X == b.X && a.Y == b.Y && a.sp == b.sp &&
+         a.status == b.status && a.pc == b.pc && a.cycles == b.cycles;
+}
+
+static CPU::State initial_state(uint16_t pc) {
+  CPU::State s;
+  s.A = s.X = s.Y = 0;
+  s.sp = 0xFD;
+  s.status = 0x24; // I set, and the unused bit
+  s.pc = pc;
+  s.cycles = 0;
+  return s;
+}
+
+static bool load_image(const Image &img, vector<uint8_t> &data) {
+  ifstream in(img.file, ios::binary);
+  if (!in)
+    return false;
+  data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  return !data.empty() && img.load + data.size() <= 0x10000;
+}
+
+static void print_hex(ostream &os, unsigned x, int w) {
+  char buf[8];
+  snprintf(buf, sizeof(buf), "%0*X", w, x);
+  os << buf;
+}
+
+static void setup_cpu(CPU &cpu, mos6502::Engine engine, bool scrambled) {
+  cpu.engine = engine;
+  cpu.assertOnTrap = false;
+  cpu.scramble = scrambled;
+  cpu.cycleMethod = mos6502::CYCLE_COUNT;
+}
+
+// Run one instruction on an interpreter over memory m, checking its cycles.
+// Returns false at a trap (an instruction that jumps or branches to itself)
+// or an illegal opcode
+static bool checked_step(CPU &cpu, const uint8_t *m, bool scrambled,
+                         Outcome &o) {
+  CPU::State pre = cpu.GetState();
+  int expected = expected_cycles(m, pre, scrambled);
+  fetch_next = true;
+  cpu.Run(1);
+  CPU::State post = cpu.GetState();
+  if (cpu.IsHalted()) {
+    o.halted = true;
+    return false;
+  }
+  o.insts++;
+  uint32_t got = post.cycles - pre.cycles;
+  if (int(got) != expected) {
+    if (o.bad_cycles < 10) {
+      cerr << "  at ";
+      print_hex(cerr, pre.pc, 4);
+      cerr << " opcode ";
+      print_hex(cerr, m[pre.pc], 2);
+      cerr << " took " << got << " cycles, expected " << expected << endl;
+    }
+    o.bad_cycles++;
+  }
+  if (post.pc == pre.pc) {
+    o.trapped = true;
+    return false;
+  }
+  return true;
+}
+
+// Run up to n instructions from the current memory contents, stopping at a
+// trap or an illegal opcode. If restart is given, traps instead continue
+// from a random address
+static Outcome run_checked(mos6502::Engine engine, const CPU::State &start,
+                           bool scrambled, uint64_t n, mt19937 *restart) {
+  CPU cpu(checked_read, checked_write);
+  setup_cpu(cpu, engine, scrambled);
+  cpu.SetState(start);
+  memset(mem_use, 0, sizeof(mem_use));
+  Outcome o = Outcome();
+  if (engine == mos6502::ENGINE_INTERP) {
+    while (o.insts < n) {
+      if (checked_step(cpu, mem, scrambled, o))
+        continue;
+      if (o.halted || restart == nullptr)
+        break;
+      o.trapped = false;
+      CPU::State s = cpu.GetState();
+      s.pc = (*restart)();
+      cpu.SetState(s);
+    }
+  } else {
+    // Each step of the engine may be a block of instructions, so the checked
+    // interpreter runs until it has caught up, then they must match
+    memcpy(ref_mem, mem, sizeof(mem));
+    CPU ref(ref_read, ref_write);
+    setup_cpu(ref, mos6502::ENGINE_INTERP, scrambled);
+    ref.SetState(start);
+    while (o.insts < n) {
+      CPU::State pre = cpu.GetState();
+      cpu.Run(1);
+      CPU::State post = cpu.GetState();
+      bool more = true;
+      while (more && ref.GetState().cycles < post.cycles)
+        more = checked_step(ref, ref_mem, scrambled, o);
+      if (more && cpu.IsHalted())
+        more = checked_step(ref, ref_mem, scrambled, o);
+      if (!same_state(ref.GetState(), post) ||
+          cpu.IsHalted() != ref.IsHalted()) {
+        cerr << "  step from ";
+        print_hex(cerr, pre.pc, 4);
+        cerr << " doesn't match the interpreter" << endl;
+        o.diverged = true;
+        break;
+      }
+      if (more)
+        continue;
+      if (o.halted || restart == nullptr)
+        break;
+      o.trapped = false;
+      post.pc = (*restart)();
+      cpu.SetState(post);
+      ref.SetState(post);
+    }
+    if (!o.diverged && memcmp(mem, ref_mem, sizeof(mem)) != 0) {
+      cerr << "  memory doesn't match the interpreter" << endl;
+      o.diverged = true;
+    }
+  }
+  o.pc = cpu.GetPC();
+  o.cycles = cpu.GetState().cycles;
+  return o;
+}
+
+static bool check_outcome(const Image &img, const Outcome &o, string &why) {
+  ostringstream ss;
+  if (o.diverged) {
+    ss << "differs from the interpreter";
+  } else if (!o.trapped && !o.halted) {
+    ss << "no trap after " << o.insts << " instructions";
+  } else if (img.has_success && (!o.trapped || o.pc != img.success)) {
+    ss << (o.halted ? "halted" : "trapped") << " at ";
+    print_hex(ss, o.pc, 4);
+  } else if (img.has_result && mem[img.result] != 0) {
+    ss << "result byte is " << int(mem[img.result]);
+  } else if (o.bad_cycles > 0) {
+    ss << o.bad_cycles << " instructions with wrong cycle counts";
+  }
+  why = ss.str();
+  return why.empty();
+}
+
+static void report(const string &name, const Outcome &o, bool ok,
+                   const string &why) {
+  cout << "  " << name << ": " << (ok ? "PASS" : "FAIL") << ", " << o.insts
+       << " instructions, " << o.cycles << " cycles";
+  if (!ok)
+    cout << ", " << why;
+  cout << endl;
+}
+
+// Instructions per second running n instructions from the start of the
+// image, without any checks
+static double time_run(mos6502::Engine engine, const Image &img,
+                       const vector<uint8_t> &data, bool scrambled,
+                       uint64_t n) {
+  memcpy(mem + img.load, data.data(), data.size());
+  CPU cpu(fast_read, fast_write);
+  cpu.engine = engine;
+  cpu.assertOnTrap = false;
+  cpu.scramble = scrambled;
+  cpu.SetState(initial_state(img.start));
+  auto t0 = chrono::steady_clock::now();
+  for (uint64_t done = 0; done < n;) {
+    uint32_t step = uint32_t(min<uint64_t>(n - done, 1u << 30));
+    cpu.Run(step);
+    done += step;
+  }
+  double secs =
+      chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+  return n / secs;
+}
+
+static bool run_image(const Image &img) {
+  cout << img.kind << " " << img.file << endl;
+  vector<uint8_t> data, remapped;
+  if (!load_image(img, data)) {
+    cout << "  FAIL, can't load image" << endl;
+    return false;
+  }
+  bool all_ok = true;
+  for (int e = 0; e < mos6502::ENGINE_COUNT; e++) {
+    mos6502::Engine engine = mos6502::Engine(e);
+    const char *name = mos6502::EngineName(engine);
+    memset(mem, 0, sizeof(mem));
+    memcpy(mem + img.load, data.data(), data.size());
+    Outcome plain = run_checked(engine, initial_state(img.start), false,
+                                max_insts, nullptr);
+    string why;
+    bool ok = check_outcome(img, plain, why);
+    report(name, plain, ok, why);
+    all_ok = all_ok && ok;
+
+    if (engine == mos6502::ENGINE_INTERP) {
+      // Remap every opcode the interpreter fetched. Anything also used as
+      // data or written by the test would change meaning, so is left alone
+      remapped = data;
+      int shared = 0;
+      for (size_t i = 0; i < data.size(); i++) {
+        uint8_t use = mem_use[img.load + i];
+        if (use == MEM_CODE)
+          remapped[i] = scramble_op(data[i]);
+        else if (use & MEM_CODE)
+          shared++;
+      }
+      if (shared > 0)
+        cout << "  " << shared
+             << " opcode bytes also used as data, not remapped" << endl;
+    }
+    memset(mem, 0, sizeof(mem));
+    memcpy(mem + img.load, remapped.data(), remapped.size());
+    Outcome scr = run_checked(engine, initial_state(img.start), true,
+                              max_insts, nullptr);
+    ok = check_outcome(img, scr, why);
+    if (ok && (scr.insts != plain.insts || scr.cycles != plain.cycles)) {
+      ok = false;
+      why = "differs from the unscrambled run";
+    }
+    report(string(name) + " scrambled", scr, ok, why);
+    all_ok = all_ok && ok;
+
+    if (plain.insts > 0) {
+      double ips = time_run(engine, img, data, false, plain.insts);
+      double ips_scr = time_run(engine, img, remapped, true, plain.insts);
+      printf("  %s: %.1fM instructions/s, %.1fM scrambled\n", name,
+             ips / 1e6, ips_scr / 1e6);
+      fflush(stdout);
+    }
+  }
+  return all_ok;
+}
+
+// Random programs of documented opcodes, starting from a random state. A trap
+// continues from a random address. The scrambled run uses the same programs
+// with every byte remapped, so runs different code
+static bool run_random(uint64_t n, uint32_t seed) {
+  cout << "random " << n << " instructions, seed " << seed << endl;
+  vector<uint8_t> legal;
+  for (int op = 0; op < 256; op++)
+    if (ref_base(op) != 0)
+      legal.push_back(op);
+  bool all_ok = true;
+  for (int e = 0; e < mos6502::ENGINE_COUNT; e++) {
+    mos6502::Engine engine = mos6502::Engine(e);
+    const char *name = mos6502::EngineName(engine);
+    for (int scrambled = 0; scrambled < 2; scrambled++) {
+      mt19937 rng(seed);
+      for (int a = 0; a < 0x10000; a++) {
+        uint8_t op = legal[rng() % legal.size()];
+        mem[a] = scrambled ? scramble_op(op) : op;
+      }
+      CPU::State s = initial_state(rng());
+      s.A = rng();
+      s.X = rng();
+      s.Y = rng();
+      s.sp = rng();
+      s.status = rng() | 0x20;
+      Outcome o = run_checked(engine, s, scrambled, n, &rng);
+      string why;
+      if (o.diverged)
+        why = "differs from the interpreter";
+      else if (o.halted)
+        why = "halted";
+      else if (o.bad_cycles > 0)
+        why = to_string(o.bad_cycles) + " instructions with wrong cycle counts";
+      report(string(name) + (scrambled ? " scrambled" : ""), o, why.empty(),
+             why);
+      all_ok = all_ok && why.empty();
+    }
+  }
+  return all_ok;
+}
+
+static bool parse_hex(const string &s, uint16_t &x) {
+  char *end;
+  unsigned long v = strtoul(s.c_str(), &end, 16);
+  if (s.empty() || *end != '\0' || v > 0xFFFF)
+    return false;
+  x = v;
+  return true;
+}
+
+static void usage() {
+  cerr << "Usage: " << endl;
+  cerr << "openvtx-cputest [options]" << endl;
+  cerr << "  --functional=FILE  6502_functional_test.bin, loaded at 0000,"
+       << endl;
+  cerr << "                     started at 0400, succeeding at 3469" << endl;
+  cerr << "  --decimal=FILE     6502_decimal_test.bin, loaded and started at"
+       << endl;
+  cerr << "                     0200, with the ERROR byte at 000B" << endl;
+  cerr << "  --image=FILE:LOAD:START:SUCCESS" << endl;
+  cerr << "                     any image, with the addresses in hex" << endl;
+  cerr << "  --random=N         run N random instructions" << endl;
+  cerr << "  --seed=S           seed for --random" << endl;
+}
+
+int main(int argc, const char *argv[]) {
+  vector<Image> images;
+  uint64_t random_n = 0;
+  uint32_t seed = 1;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    Image img = {"", "", 0, 0, false, 0, false, 0};
+    bool ok = true;
+    if (arg.substr(0, 13) == "--functional=") {
+      img.kind = "functional";
+      img.file = arg.substr(13);
+      img.start = 0x0400;
+      img.has_success = true;
+      img.success = 0x3469;
+      images.push_back(img);
+    } else if (arg.substr(0, 10) == "--decimal=") {
+      img.kind = "decimal";
+      img.file = arg.substr(10);
+      img.load = img.start = 0x0200;
+      img.has_result = true;
+      img.result = 0x000B;
+      images.push_back(img);
+    } else if (arg.substr(0, 8) == "--image=") {
+      // The file name may contain colons, so take the addresses from the end
+      string spec = arg.substr(8);
+      string parts[3];
+      for (int j = 2; j >= 0 && ok; j--) {
+        size_t colon = spec.rfind(':');
+        ok = colon != string::npos;
+        if (ok) {
+          parts[j] = spec.substr(colon + 1);
+          spec = spec.substr(0, colon);
+        }
+      }
+      img.kind = "image";
+      img.file = spec;
+      img.has_success = true;
+      ok = ok && parse_hex(parts[0], img.load) &&
+           parse_hex(parts[1], img.start) && parse_hex(parts[2], img.success);
+      images.push_back(img);
+    } else if (arg.substr(0, 9) == "--random=") {
+      random_n = strtoull(arg.substr(9).c_str(), nullptr, 10);
+    } else if (arg.substr(0, 7) == "--seed=") {
+      seed = strtoul(arg.substr(7).c_str(), nullptr, 10);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      usage();
+      return 2;
+    }
+  }
+  if (images.empty() && random_n == 0) {
+    usage();
+    return 2;
+  }
+  bool ok = true;
+  if (random_n > 0)
+    ok = run_random(random_n, seed) && ok;
+  for (const auto &img : images)
+    ok = run_image(img) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,469 @@
+// Coverage-guided input fuzzer. Input movies are mutated and run on a ROM,
+// each run starting from a snapshot taken after booting, and inputs that
+// reach new code are kept to mutate further. Coverage is the edges between
+// instructions run by either CPU, hashed into a map shared by all the
+// workers. An illegal opcode stops a run and is reported by the worker
+// itself. A worker that crashes, such as on an assertion in the memory
+// decoding, or hangs is reported by the parent with the input it was running,
+// and restarted.
+//
+// The core is a single global machine, so each worker is a forked process.
+// They share the coverage map, but each keeps its own corpus
+#include "../src/6502/mos6502.hpp"
+#include "../src/mmu.hpp"
+#include "../src/movie.hpp"
+#include "../src/platform.hpp"
+#include "../src/ppu.hpp"
+#include "../src/util.hpp"
+#include "../src/vt168.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+typedef mos6502::mos6502 CPU;
+
+static const size_t map_size = 65536;
+static const uint64_t max_frames = 100000;
+
+struct Options {
+  const PlatformDesc *plat;
+  VideoTiming timing;
+  string rom, out_dir;
+  uint64_t boot = 60, frames = 600;
+  uint64_t seed = 1;
+  vector<InputMovie> seeds;
+};
+
+// Shared between the parent and a worker. Only the worker writes to it
+struct WorkerShared {
+  // Set once booted and fuzzing
+  atomic<bool> ready;
+  atomic<uint64_t> execs;
+  // The input of the run in progress, for reporting a crash
+  uint64_t cur_frames;
+  uint8_t cur_input[max_frames];
+};
+
+// Shared by everything: the edges any worker has seen, and the workers
+static uint8_t *global_map;
+static WorkerShared *workers;
+
+// Edges seen in the current run
+static uint8_t run_map[map_size];
+static uint32_t prev_loc[2];
+static bool halted[2];
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_sigint(int) { stop_requested = 1; }
+
+static uint32_t loc_hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  return x;
+}
+
+// Mark the edge from the last instruction run by a CPU to the next
+static inline void mark_edge(int which, uint32_t loc) {
+  uint32_t cur = loc_hash(loc + which * 0x1000000);
+  run_map[(cur ^ prev_loc[which]) & (map_size - 1)] = 1;
+  prev_loc[which] = cur >> 1;
+}
+
+static uint32_t fuzz_cpu_step(CPU &cpu) {
+  uint16_t pc = cpu.GetPC();
+  mark_edge(0, pc >= 0x4000 ? decode_address(pc) : pc);
+  uint32_t ran = cpu.Run(1);
+  halted[0] = halted[0] || cpu.IsHalted();
+  return ran;
+}
+
+static uint32_t fuzz_scpu_step(CPU &cpu) {
+  mark_edge(1, cpu.GetPC());
+  uint32_t ran = cpu.Run(1);
+  halted[1] = halted[1] || cpu.IsHalted();
+  return ran;
+}
+
+static string hex_str(uint32_t x) {
+  ostringstream s;
+  s << hex << x;
+  return s.str();
+}
+
+// Save an input as a movie, with the frames counted from reset so that it
+// plays back with openvtx --play-input
+static bool save_input(const Options &o, const string &file,
+                       const uint8_t *input, uint64_t frames) {
+  InputMovie m;
+  for (uint64_t f = 0; f < frames; f++)
+    m.record(o.boot + f, input[f]);
+  return m.save(file);
+}
+
+static void write_report(const string &file, const string &text) {
+  ofstream out(file);
+  out << text << endl;
+}
+
+// Run an input from the snapshot, returning the index of the CPU that hit an
+// illegal opcode, or -1
+static int run_input(const vector<uint8_t> &input) {
+  vt168_restore();
+  fill(run_map, run_map + map_size, 0);
+  prev_loc[0] = prev_loc[1] = 0;
+  halted[0] = halted[1] = false;
+  for (uint64_t f = 0; f < input.size(); f++) {
+    vt168_set_input(input[f]);
+    vt168_run_frame();
+    if (halted[0] || halted[1])
+      return halted[0] ? 0 : 1;
+  }
+  return -1;
+}
+
+// Add the run's edges to the global map, returning true if any were new
+static bool merge_coverage() {
+  bool found = false;
+  for (size_t i = 0; i < map_size; i++) {
+    if (run_map[i] && !global_map[i]) {
+      global_map[i] = 1;
+      found = true;
+    }
+  }
+  return found;
+}
+
+static void mutate(vector<uint8_t> &in, const vector<vector<uint8_t>> &corpus,
+                   mt19937_64 &rng) {
+  size_t n = in.size();
+  int count = 1 + rng() % 4;
+  for (int i = 0; i < count; i++) {
+    size_t at = rng() % n;
+    size_t len = 1 + rng() % min<size_t>(n - at, 64);
+    switch (rng() % 5) {
+    case 0: // flip a button for a span
+      for (size_t j = at; j < at + len; j++)
+        in[j] ^= 1 << (rng() % 8);
+      break;
+    case 1: // hold one state for a span
+      fill(in.begin() + at, in.begin() + at + len, uint8_t(rng()));
+      break;
+    case 2: // press a single button for a span
+      fill(in.begin() + at, in.begin() + at + len, uint8_t(1 << (rng() % 8)));
+      break;
+    case 3: // release everything for a span
+      fill(in.begin() + at, in.begin() + at + len, 0);
+      break;
+    case 4: { // splice in a span from another input
+      const vector<uint8_t> &other = corpus[rng() % corpus.size()];
+      size_t from = rng() % n;
+      len = min(len, n - from);
+      copy(other.begin() + from, other.begin() + from + len, in.begin() + at);
+      break;
+    }
+    }
+  }
+}
+
+static void worker(const Options &o, int idx) {
+  // Keep the log to what a crash prints
+  cout.setstate(ios::failbit);
+  WorkerShared &shared = workers[idx];
+  vt168_init(o.plat->id, o.timing, o.rom, false);
+  // Rendering doesn't affect the emulation, and isn't needed here
+  ppu_set_render(false);
+  for (uint64_t f = 0; f < o.boot; f++)
+    vt168_run_frame();
+  // Report illegal opcodes rather than stopping on them
+  vt168_cpu().assertOnTrap = false;
+  vt168_scpu().assertOnTrap = false;
+  vt168_set_cpu_step(fuzz_cpu_step);
+  vt168_set_scpu_step(fuzz_scpu_step);
+  vt168_snapshot();
+  shared.ready = true;
+
+  mt19937_64 rng(o.seed * 1000003 + idx);
+  vector<vector<uint8_t>> corpus;
+  corpus.push_back(vector<uint8_t>(o.frames, 0));
+  for (InputMovie m : o.seeds) {
+    vector<uint8_t> in(o.frames);
+    for (uint64_t f = 0; f < o.frames; f++)
+      in[f] = m.buttons_at(o.boot + f);
+    corpus.push_back(in);
+  }
+  // Run the seeds as they are first
+  size_t seeds_left = corpus.size();
+  vector<uint8_t> in;
+  while (true) {
+    if (seeds_left > 0) {
+      in = corpus[--seeds_left];
+    } else {
+      in = corpus[rng() % corpus.size()];
+      mutate(in, corpus, rng);
+    }
+    shared.cur_frames = in.size();
+    copy(in.begin(), in.end(), shared.cur_input);
+    int bad = run_input(in);
+    shared.execs++;
+    if (bad >= 0) {
+      CPU &c = bad ? vt168_scpu() : vt168_cpu();
+      uint16_t pc = c.GetPC();
+      uint32_t loc = (bad == 0 && pc >= 0x4000) ? decode_address(pc) : pc;
+      string name = o.out_dir + "/illegal-" + (bad ? "scpu-" : "cpu-") +
+                    hex_str(loc);
+      struct stat st;
+      if (stat((name + ".txt").c_str(), &st) != 0) {
+        save_input(o, name + ".inp", in.data(), in.size());
+        write_report(name + ".txt", string("illegal opcode on the ") +
+                                        (bad ? "SCPU" : "main CPU") +
+                                        " at pc " + hex_str(pc) + " (" +
+                                        hex_str(loc) + ")");
+      }
+    }
+    if (merge_coverage()) {
+      corpus.push_back(in);
+      save_input(o, o.out_dir + "/corpus/w" + to_string(idx) + "-" +
+                        to_string(corpus.size()) + ".inp",
+                 in.data(), in.size());
+    }
+  }
+}
+
+static pid_t start_worker(const Options &o, int idx) {
+  cerr.flush();
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+  // A crash prints to stderr, keep that for the report
+  string log = o.out_dir + "/.worker" + to_string(idx) + ".log";
+  int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd >= 0) {
+    dup2(fd, 2);
+    close(fd);
+  }
+  signal(SIGINT, SIG_IGN);
+  worker(o, idx);
+  _exit(0);
+}
+
+// The last line a worker printed, which for an assertion is the message
+static string last_log_line(const Options &o, int idx) {
+  ifstream in(o.out_dir + "/.worker" + to_string(idx) + ".log");
+  string line, last;
+  while (getline(in, line))
+    if (!line.empty())
+      last = line;
+  return last;
+}
+
+// Report a worker that crashed or hung, with the input it was running
+static void report_crash(const Options &o, int idx, const string &why,
+                         bool hang) {
+  WorkerShared &w = workers[idx];
+  uint64_t frames = min(w.cur_frames, max_frames);
+  string msg = why;
+  string log = last_log_line(o, idx);
+  if (!log.empty())
+    msg += ": " + log;
+  // Name a crash by the message, so each distinct failure is kept once. Hangs
+  // all have the same message, so name them by the input instead
+  string name =
+      hang ? o.out_dir + "/hang-" +
+                 hex_str(uint32_t(fnv1a64(w.cur_input, frames)))
+           : o.out_dir + "/crash-" +
+                 hex_str(uint32_t(fnv1a64(msg.data(), msg.size())));
+  struct stat st;
+  if (stat((name + ".txt").c_str(), &st) == 0)
+    return;
+  save_input(o, name + ".inp", w.cur_input, frames);
+  write_report(name + ".txt", msg);
+  cerr << "worker " << idx << ": " << msg << " (" << name << ".inp)" << endl;
+}
+
+static void usage() {
+  cerr << "Usage: " << endl;
+  cerr << "openvtx-fuzz [options] platform filename.bin" << endl;
+  cerr << "  --jobs=N       workers (one per CPU)" << endl;
+  cerr << "  --boot=N       frames to run before the snapshot runs start from "
+          "(60)"
+       << endl;
+  cerr << "  --frames=N     frames in each run (600)" << endl;
+  cerr << "  --input=FILE   a movie to start from, may be given more than once"
+       << endl;
+  cerr << "  --time=SEC     stop after this long, 0 for Ctrl-C (0)" << endl;
+  cerr << "  --timeout=SEC  time a run may take before it's a hang (60)"
+       << endl;
+  cerr << "  --seed=N       random seed (1)" << endl;
+  cerr << "  --out=DIR      where to write findings (fuzz-out)" << endl;
+  cerr << "  --pal, --ntsc  video timing" << endl;
+}
+
+int main(int argc, const char *argv[]) {
+  Options o;
+  o.out_dir = "fuzz-out";
+  int n_workers = thread::hardware_concurrency();
+  double run_time = 0, timeout = 60;
+  bool timing_set = false;
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool ok = true;
+    if (arg.substr(0, 7) == "--jobs=") {
+      n_workers = atoi(arg.substr(7).c_str());
+      ok = n_workers > 0;
+    } else if (arg.substr(0, 7) == "--boot=") {
+      o.boot = strtoull(arg.substr(7).c_str(), nullptr, 10);
+    } else if (arg.substr(0, 9) == "--frames=") {
+      o.frames = strtoull(arg.substr(9).c_str(), nullptr, 10);
+      ok = o.frames > 0 && o.frames <= max_frames;
+    } else if (arg.substr(0, 8) == "--input=") {
+      InputMovie m;
+      ok = m.load(arg.substr(8));
+      o.seeds.push_back(m);
+    } else if (arg.substr(0, 7) == "--time=") {
+      run_time = atof(arg.substr(7).c_str());
+    } else if (arg.substr(0, 10) == "--timeout=") {
+      timeout = atof(arg.substr(10).c_str());
+      ok = timeout > 0;
+    } else if (arg.substr(0, 7) == "--seed=") {
+      o.seed = strtoull(arg.substr(7).c_str(), nullptr, 10);
+    } else if (arg.substr(0, 6) == "--out=") {
+      o.out_dir = arg.substr(6);
+    } else if (arg == "--pal" || arg == "--ntsc") {
+      timing_set = true;
+      o.timing = (arg == "--pal") ? VideoTiming::PAL : VideoTiming::NTSC;
+    } else if (arg.substr(0, 2) == "--") {
+      ok = false;
+    } else {
+      args.push_back(arg);
+    }
+    if (!ok) {
+      usage();
+      return 2;
+    }
+  }
+  if (args.size() != 2) {
+    usage();
+    return 2;
+  }
+  o.plat = find_platform(args[0]);
+  if (o.plat == nullptr) {
+    cerr << "Unknown platform " << args[0] << ", expected one of "
+         << platform_names() << endl;
+    return 2;
+  }
+  o.rom = args[1];
+  if (access(o.rom.c_str(), R_OK) != 0) {
+    cerr << "Can't read " << o.rom << endl;
+    return 2;
+  }
+  if (!timing_set && !detect_rom_timing(o.rom, o.timing))
+    o.timing = o.plat->default_timing;
+  mkdir(o.out_dir.c_str(), 0777);
+  mkdir((o.out_dir + "/corpus").c_str(), 0777);
+
+  size_t shared_size = map_size + n_workers * sizeof(WorkerShared);
+  void *p = mmap(nullptr, shared_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  global_map = static_cast<uint8_t *>(p);
+  workers = reinterpret_cast<WorkerShared *>(global_map + map_size);
+  signal(SIGINT, on_sigint);
+
+  vector<pid_t> pids(n_workers);
+  // Exec count at the last check, and when it last changed, for hangs
+  vector<uint64_t> last_execs(n_workers, 0);
+  vector<chrono::steady_clock::time_point> last_progress(n_workers);
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < n_workers; i++) {
+    pids[i] = start_worker(o, i);
+    last_progress[i] = start;
+  }
+  uint64_t base_execs = 0; // from workers since restarted
+  int n_crashes = 0;
+  auto last_status = start;
+  while (!stop_requested) {
+    this_thread::sleep_for(chrono::milliseconds(100));
+    auto now = chrono::steady_clock::now();
+    double elapsed = chrono::duration<double>(now - start).count();
+    for (int i = 0; i < n_workers; i++) {
+      uint64_t e = workers[i].execs;
+      if (e != last_execs[i]) {
+        last_execs[i] = e;
+        last_progress[i] = now;
+      }
+      int status;
+      string why;
+      bool hang = false;
+      if (waitpid(pids[i], &status, WNOHANG) == pids[i]) {
+        why = WIFSIGNALED(status)
+                  ? "crashed with signal " + to_string(WTERMSIG(status))
+                  : "exited with status " + to_string(WEXITSTATUS(status));
+      } else if (chrono::duration<double>(now - last_progress[i]).count() >
+                 timeout) {
+        kill(pids[i], SIGKILL);
+        waitpid(pids[i], &status, 0);
+        why = "hung";
+        hang = true;
+      } else {
+        continue;
+      }
+      // A worker that can't boot the ROM never will
+      if (!workers[i].ready) {
+        cerr << "worker " << i << " failed to start: " << last_log_line(o, i)
+             << endl;
+        stop_requested = 1;
+        break;
+      }
+      report_crash(o, i, why, hang);
+      n_crashes++;
+      base_execs += e;
+      workers[i].ready = false;
+      workers[i].execs = 0;
+      last_execs[i] = 0;
+      last_progress[i] = now;
+      pids[i] = start_worker(o, i);
+    }
+    bool done = run_time > 0 && elapsed >= run_time;
+    if (done || chrono::duration<double>(now - last_status).count() >= 2) {
+      last_status = now;
+      uint64_t execs = base_execs;
+      for (int i = 0; i < n_workers; i++)
+        execs += workers[i].execs;
+      size_t edges = count_if(global_map, global_map + map_size,
+                              [](uint8_t x) { return x != 0; });
+      cerr << int(elapsed) << "s: " << execs << " runs, "
+           << int(execs / max(elapsed, 0.001)) << " runs/s, "
+           << int(execs * o.frames / max(elapsed, 0.001)) << " frames/s, "
+           << edges << " edges, " << n_crashes << " crashes" << endl;
+    }
+    if (done)
+      break;
+  }
+  for (int i = 0; i < n_workers; i++) {
+    kill(pids[i], SIGKILL);
+    waitpid(pids[i], nullptr, 0);
+    unlink((o.out_dir + "/.worker" + to_string(i) + ".log").c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,310 @@
+// Lockstep differential testing of the CPU engines. A ROM runs headless, on
+// recorded input, with the main CPU using one engine. After every step it
+// takes, a second CPU using another engine is run from the same starting
+// state, with its bus reads answered from those the first made. The registers
+// and the sequence of bus accesses, including all writes, must match. On a
+// divergence the last steps and both CPU states are dumped
+#include "../src/6502/mos6502.hpp"
+#include "../src/movie.hpp"
+#include "../src/platform.hpp"
+#include "../src/vt168.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+typedef mos6502::mos6502 CPU;
+
+struct BusOp {
+  uint16_t addr;
+  uint8_t data;
+  bool write;
+};
+
+// One step of the engine under test. A step may be more than one instruction
+// if the engine runs blocks
+struct Step {
+  uint64_t seq;
+  CPU::State pre, post;
+  static const int max_ops = 32;
+  BusOp ops[max_ops];
+  int n_ops;
+  bool overflow;
+};
+
+static vector<Step> ring;
+static uint64_t steps = 0;
+static Step *cur = nullptr;
+
+static ReadHandler real_read;
+static WriteHandler real_write;
+static CPU *shadow = nullptr;
+
+// Where the shadow CPU is in the current step's accesses, and the first
+// mismatch
+static int replay_pos;
+static string replay_err;
+
+static void print_hex(ostream &os, unsigned x, int w) {
+  char buf[8];
+  snprintf(buf, sizeof(buf), "%0*X", w, x);
+  os << buf;
+}
+
+static void log_op(uint16_t addr, uint8_t data, bool write) {
+  if (cur->n_ops == Step::max_ops) {
+    cur->overflow = true;
+    return;
+  }
+  BusOp &op = cur->ops[cur->n_ops++];
+  op.addr = addr;
+  op.data = data;
+  op.write = write;
+}
+
+static uint8_t rec_read(uint16_t addr) {
+  uint8_t d = real_read(addr);
+  log_op(addr, d, false);
+  return d;
+}
+
+static void rec_write(uint16_t addr, uint8_t data) {
+  log_op(addr, data, true);
+  real_write(addr, data);
+}
+
+static void replay_mismatch(uint16_t addr, uint8_t data, bool write) {
+  if (!replay_err.empty())
+    return;
+  ostringstream ss;
+  ss << "access " << replay_pos << " was " << (write ? "W " : "R ");
+  print_hex(ss, addr, 4);
+  if (write) {
+    ss << "=";
+    print_hex(ss, data, 2);
+  }
+  if (replay_pos < cur->n_ops) {
+    const BusOp &op = cur->ops[replay_pos];
+    ss << ", expected " << (op.write ? "W " : "R ");
+    print_hex(ss, op.addr, 4);
+    if (op.write) {
+      ss << "=";
+      print_hex(ss, op.data, 2);
+    }
+  } else {
+    ss << ", expected no more";
+  }
+  replay_err = ss.str();
+}
+
+static uint8_t replay_read(uint16_t addr) {
+  if (replay_pos < cur->n_ops) {
+    const BusOp &op = cur->ops[replay_pos];
+    if (!op.write && op.addr == addr) {
+      replay_pos++;
+      return op.data;
+    }
+  }
+  replay_mismatch(addr, 0, false);
+  replay_pos++;
+  return 0xFF;
+}
+
+static void replay_write(uint16_t addr, uint8_t data) {
+  if (replay_pos < cur->n_ops) {
+    const BusOp &op = cur->ops[replay_pos];
+    if (op.write && op.addr == addr && op.data == data) {
+      replay_pos++;
+      return;
+    }
+  }
+  replay_mismatch(addr, data, true);
+  replay_pos++;
+}
+
+static bool same_state(const CPU::State &a, const CPU::State &b) {
+  return a.A == b.A && a.X == b.X && a.Y == b.Y && a.sp == b.sp &&
+         a.status == b.status && a.pc == b.pc && a.cycles == b.cycles;
+}
+
+static void print_state(ostream &os, const CPU::State &s) {
+  os << "PC=";
+  print_hex(os, s.pc, 4);
+  os << " A=";
+  print_hex(os, s.A, 2);
+  os << " X=";
+  print_hex(os, s.X, 2);
+  os << " Y=";
+  print_hex(os, s.Y, 2);
+  os << " S=";
+  print_hex(os, s.sp, 2);
+  os << " P=";
+  print_hex(os, s.status, 2);
+  os << " n=" << s.cycles;
+}
+
+static void dump_trace(const string &why) {
+  cerr << "DIVERGED at step " << (steps - 1) << ": " << why << endl;
+  cerr << "last steps, oldest first:" << endl;
+  uint64_t n = min<uint64_t>(steps, ring.size());
+  for (uint64_t i = steps - n; i < steps; i++) {
+    const Step &s = ring[i % ring.size()];
+    cerr << "  #" << s.seq << " ";
+    print_state(cerr, s.pre);
+    cerr << " |";
+    for (int j = 0; j < s.n_ops; j++) {
+      cerr << (s.ops[j].write ? " W" : " R");
+      print_hex(cerr, s.ops[j].addr, 4);
+      cerr << "=";
+      print_hex(cerr, s.ops[j].data, 2);
+    }
+    if (s.overflow)
+      cerr << " ...";
+    cerr << endl;
+  }
+  cerr << "primary: ";
+  print_state(cerr, cur->post);
+  cerr << endl << "shadow:  ";
+  print_state(cerr, shadow->GetState());
+  cerr << endl;
+}
+
+static uint32_t lockstep_step(CPU &cpu) {
+  cur = &ring[steps % ring.size()];
+  cur->seq = steps++;
+  cur->n_ops = 0;
+  cur->overflow = false;
+  cur->pre = cpu.GetState();
+  uint32_t ran = cpu.Run(1);
+  cur->post = cpu.GetState();
+
+  // Interrupts are taken between steps, so always start the shadow from the
+  // primary's state rather than from where its last step left it
+  shadow->SetState(cur->pre);
+  replay_pos = 0;
+  replay_err.clear();
+  while (shadow->GetState().cycles < cur->post.cycles && !shadow->IsHalted())
+    shadow->Run(1);
+
+  string why;
+  if (cur->overflow)
+    why = "too many bus accesses in one step to compare";
+  else if (!replay_err.empty())
+    why = replay_err;
+  else if (replay_pos != cur->n_ops)
+    why = "shadow made " + to_string(replay_pos) + " bus accesses, expected " +
+          to_string(cur->n_ops);
+  else if (!same_state(shadow->GetState(), cur->post))
+    why = "registers differ";
+  if (!why.empty()) {
+    dump_trace(why);
+    cerr.flush();
+    _Exit(1);
+  }
+  return ran;
+}
+
+static void usage() {
+  cerr << "Usage: " << endl;
+  cerr << "openvtx-lockstep [options] platform filename.bin" << endl;
+  cerr << "  --engine=NAME    engine under test, interp or fused (fused)"
+       << endl;
+  cerr << "  --against=NAME   engine to compare with (interp)" << endl;
+  cerr << "  --frames=N       frames to run, 0 to run until a divergence"
+       << endl;
+  cerr << "                   (3600)" << endl;
+  cerr << "  --input=FILE     play back recorded input" << endl;
+  cerr << "  --trace=N        steps to keep for the dump (256)" << endl;
+  cerr << "  --pal, --ntsc    video timing" << endl;
+}
+
+int main(int argc, const char *argv[]) {
+  mos6502::Engine engine = mos6502::ENGINE_FUSED;
+  mos6502::Engine against = mos6502::ENGINE_INTERP;
+  uint64_t frames = 3600;
+  size_t trace_len = 256;
+  string input;
+  bool timing_set = false;
+  VideoTiming timing = VideoTiming::PAL;
+  vector<string> args;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool ok = true;
+    if (arg.substr(0, 9) == "--engine=") {
+      ok = mos6502::ParseEngine(arg.substr(9), engine);
+    } else if (arg.substr(0, 10) == "--against=") {
+      ok = mos6502::ParseEngine(arg.substr(10), against);
+    } else if (arg.substr(0, 9) == "--frames=") {
+      frames = strtoull(arg.substr(9).c_str(), nullptr, 10);
+    } else if (arg.substr(0, 8) == "--input=") {
+      input = arg.substr(8);
+    } else if (arg.substr(0, 8) == "--trace=") {
+      trace_len = strtoul(arg.substr(8).c_str(), nullptr, 10);
+      ok = trace_len > 0;
+    } else if (arg == "--pal" || arg == "--ntsc") {
+      timing_set = true;
+      timing = (arg == "--pal") ? VideoTiming::PAL : VideoTiming::NTSC;
+    } else if (arg.substr(0, 2) == "--") {
+      ok = false;
+    } else {
+      args.push_back(arg);
+    }
+    if (!ok) {
+      usage();
+      return 2;
+    }
+  }
+  if (args.size() != 2) {
+    usage();
+    return 2;
+  }
+  const PlatformDesc *plat = find_platform(args[0]);
+  if (plat == nullptr) {
+    cerr << "Unknown platform " << args[0] << ", expected one of "
+         << platform_names() << endl;
+    return 2;
+  }
+  if (!timing_set && !detect_rom_timing(args[1], timing))
+    timing = plat->default_timing;
+  InputMovie movie;
+  if (!input.empty() && !movie.load(input)) {
+    cerr << "Can't load input " << input << endl;
+    return 2;
+  }
+
+  // The core logs to cout, keep the report readable
+  cout.setstate(ios::failbit);
+  vt168_init(plat->id, timing, args[1], false, engine);
+  CPU &cpu = vt168_cpu();
+  real_read = plat->cpu_read;
+  real_write = plat->cpu_write;
+  cpu.SetBus(rec_read, rec_write);
+  shadow = new CPU(replay_read, replay_write);
+  shadow->engine = against;
+  shadow->scramble = cpu.scramble;
+  // Report the divergence rather than stopping on a trap the primary didn't
+  // hit
+  shadow->assertOnTrap = false;
+  ring.resize(trace_len);
+  vt168_set_cpu_step(lockstep_step);
+
+  cerr << "Comparing " << mos6502::EngineName(engine) << " against "
+       << mos6502::EngineName(against) << endl;
+  auto t0 = chrono::steady_clock::now();
+  for (uint64_t f = 0; frames == 0 || f < frames; f++) {
+    vt168_set_input(movie.buttons_at(f));
+    vt168_run_frame();
+    if ((f + 1) % 3000 == 0)
+      cerr << "frame " << (f + 1) << ", " << steps << " steps" << endl;
+  }
+  double secs =
+      chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+  cerr << "OK, " << frames << " frames, " << steps << " steps matched in "
+       << secs << "s" << endl;
+  return 0;
+}
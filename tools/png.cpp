@@ -0,0 +1,151 @@
+#include "png.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <zlib.h>
+
+static const uint8_t png_sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+static void put_be32(vector<uint8_t> &v, uint32_t x) {
+  for (int i = 3; i >= 0; i--)
+    v.push_back((x >> (8 * i)) & 0xFF);
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+  return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void write_chunk(ofstream &out, const char *type,
+                        const vector<uint8_t> &data) {
+  vector<uint8_t> c;
+  put_be32(c, data.size());
+  c.insert(c.end(), type, type + 4);
+  c.insert(c.end(), data.begin(), data.end());
+  put_be32(c, crc32(crc32(0, nullptr, 0), &c[4], c.size() - 4));
+  out.write(reinterpret_cast<const char *>(c.data()), c.size());
+}
+
+bool write_png(const string &filename, const uint32_t *argb, int w, int h) {
+  // Each row is a filter type byte (0, none) then the RGB pixels
+  vector<uint8_t> raw;
+  raw.reserve(h * (1 + 3 * w));
+  for (int y = 0; y < h; y++) {
+    raw.push_back(0);
+    for (int x = 0; x < w; x++) {
+      uint32_t p = argb[y * w + x];
+      raw.push_back((p >> 16) & 0xFF);
+      raw.push_back((p >> 8) & 0xFF);
+      raw.push_back(p & 0xFF);
+    }
+  }
+  uLongf zlen = compressBound(raw.size());
+  vector<uint8_t> z(zlen);
+  if (compress2(z.data(), &zlen, raw.data(), raw.size(), 9) != Z_OK)
+    return false;
+  z.resize(zlen);
+
+  vector<uint8_t> ihdr;
+  put_be32(ihdr, w);
+  put_be32(ihdr, h);
+  ihdr.push_back(8); // bit depth
+  ihdr.push_back(2); // colour type RGB
+  ihdr.push_back(0); // compression
+  ihdr.push_back(0); // filter
+  ihdr.push_back(0); // no interlace
+
+  ofstream out(filename, ios::binary);
+  if (!out)
+    return false;
+  out.write(reinterpret_cast<const char *>(png_sig), sizeof(png_sig));
+  write_chunk(out, "IHDR", ihdr);
+  write_chunk(out, "IDAT", z);
+  write_chunk(out, "IEND", vector<uint8_t>());
+  return bool(out);
+}
+
+static uint8_t paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return (pb <= pc) ? b : c;
+}
+
+bool read_png(const string &filename, vector<uint32_t> &argb, int &w, int &h) {
+  ifstream in(filename, ios::binary);
+  if (!in)
+    return false;
+  vector<uint8_t> f((istreambuf_iterator<char>(in)),
+                    istreambuf_iterator<char>());
+  if (f.size() < 8 || memcmp(f.data(), png_sig, 8) != 0)
+    return false;
+  vector<uint8_t> z;
+  int bpp = 0;
+  w = h = 0;
+  for (size_t pos = 8; pos + 12 <= f.size();) {
+    uint32_t len = get_be32(&f[pos]);
+    if (pos + 12 + len > f.size())
+      return false;
+    const uint8_t *type = &f[pos + 4], *data = &f[pos + 8];
+    if (memcmp(type, "IHDR", 4) == 0) {
+      w = get_be32(data);
+      h = get_be32(data + 4);
+      // 8-bit RGB or RGBA, not interlaced
+      if (data[8] != 8 || (data[9] != 2 && data[9] != 6) || data[12] != 0)
+        return false;
+      bpp = (data[9] == 6) ? 4 : 3;
+    } else if (memcmp(type, "IDAT", 4) == 0) {
+      z.insert(z.end(), data, data + len);
+    } else if (memcmp(type, "IEND", 4) == 0) {
+      break;
+    }
+    pos += 12 + len;
+  }
+  if (bpp == 0)
+    return false;
+  size_t stride = 1 + size_t(w) * bpp;
+  uLongf rawlen = stride * h;
+  vector<uint8_t> raw(rawlen);
+  if (uncompress(raw.data(), &rawlen, z.data(), z.size()) != Z_OK ||
+      rawlen != stride * h)
+    return false;
+  // Undo the row filters
+  for (int y = 0; y < h; y++) {
+    uint8_t *row = &raw[y * stride + 1];
+    const uint8_t *prev = (y > 0) ? &raw[(y - 1) * stride + 1] : nullptr;
+    uint8_t filter = row[-1];
+    for (size_t i = 0; i < stride - 1; i++) {
+      int a = (i >= size_t(bpp)) ? row[i - bpp] : 0;
+      int b = prev ? prev[i] : 0;
+      int c = (prev && i >= size_t(bpp)) ? prev[i - bpp] : 0;
+      switch (filter) {
+      case 0:
+        break;
+      case 1:
+        row[i] += a;
+        break;
+      case 2:
+        row[i] += b;
+        break;
+      case 3:
+        row[i] += (a + b) / 2;
+        break;
+      case 4:
+        row[i] += paeth(a, b, c);
+        break;
+      default:
+        return false;
+      }
+    }
+  }
+  argb.resize(size_t(w) * h);
+  for (int y = 0; y < h; y++) {
+    const uint8_t *row = &raw[y * stride + 1];
+    for (int x = 0; x < w; x++) {
+      const uint8_t *p = row + x * bpp;
+      argb[y * w + x] = 0xFF000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+    }
+  }
+  return true;
+}
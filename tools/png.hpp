@@ -0,0 +1,17 @@
+#ifndef PNG_HPP
+#define PNG_HPP
+#include <cstdint>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Minimal PNG support for the test tools, using zlib
+
+// Write an ARGB8888 image as an 8-bit RGB PNG, returning false on failure
+bool write_png(const string &filename, const uint32_t *argb, int w, int h);
+
+// Read an 8-bit RGB or RGBA non-interlaced PNG into ARGB8888, returning false
+// if it can't be read
+bool read_png(const string &filename, vector<uint32_t> &argb, int &w, int &h);
+
+#endif /* end of include guard: PNG_HPP */
@@ -0,0 +1,419 @@
+// Golden-frame regression tests for the renderer. Each test runs a ROM
+// headless, with synchronous rendering and optionally recorded input, for a
+// fixed number of frames. The output (and optionally each layer) is hashed
+// every frame and compared against the stored golden hashes, writing PNGs of
+// the actual output and of the differences on a mismatch. See
+// regress/README.md for the test format
+#include "../src/mmu.hpp"
+#include "../src/movie.hpp"
+#include "../src/platform.hpp"
+#include "../src/ppu.hpp"
+#include "../src/util.hpp"
+#include "../src/vt168.hpp"
+#include "png.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+using namespace VTxx;
+
+struct Test {
+  string path, name, dir; // test file, name without .test and its directory
+  string rom, platform = "vt168", input;
+  bool timing_set = false;
+  VideoTiming timing = VideoTiming::PAL;
+  uint64_t frames = 0;
+  bool layers = false;
+  vector<uint64_t> snapshots;
+  // ROM image built by code and fill lines, instead of a ROM file
+  vector<uint8_t> image;
+};
+
+struct FrameHash {
+  uint64_t frame;
+  uint64_t out;
+  bool has_layers;
+  uint64_t layers[4];
+};
+
+// Result codes, also used as the child exit status
+enum { TEST_PASS = 0, TEST_FAIL = 1, TEST_SKIP = 2, TEST_ERROR = 3 };
+
+static const int frame_w = 256, frame_h = 240;
+static const uint32_t image_size = 0x80000;
+
+static bool file_exists(const string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static bool is_dir(const string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Resolve a path from a test file, relative to the test's directory, then to
+// $OPENVTX_ROMS. Returns an empty string if not found
+static string find_file(const Test &t, const string &file) {
+  if (!file.empty() && file[0] == '/')
+    return file_exists(file) ? file : "";
+  if (file_exists(t.dir + "/" + file))
+    return t.dir + "/" + file;
+  const char *roms = getenv("OPENVTX_ROMS");
+  if (roms != nullptr && file_exists(string(roms) + "/" + file))
+    return string(roms) + "/" + file;
+  return "";
+}
+
+static bool parse_hex(const string &s, uint32_t &val) {
+  char *end;
+  val = strtoul(s.c_str(), &end, 16);
+  return !s.empty() && *end == '\0';
+}
+
+// Read hex bytes to the end of a line
+static bool parse_bytes(istringstream &ls, vector<uint8_t> &bytes) {
+  string val;
+  uint32_t b;
+  while (ls >> val) {
+    if (!parse_hex(val, b) || b > 0xFF)
+      return false;
+    bytes.push_back(b);
+  }
+  return !bytes.empty();
+}
+
+static bool parse_test(const string &path, Test &t) {
+  ifstream in(path);
+  if (!in) {
+    cerr << path << ": can't open" << endl;
+    return false;
+  }
+  t.path = path;
+  size_t slash = path.find_last_of('/');
+  t.dir = (slash == string::npos) ? "." : path.substr(0, slash);
+  string base = path.substr(slash == string::npos ? 0 : slash + 1);
+  t.name = base.substr(0, base.rfind(".test"));
+  string line;
+  int line_no = 0;
+  while (getline(in, line)) {
+    line_no++;
+    line = line.substr(0, line.find('#'));
+    istringstream ls(line);
+    string key, val;
+    if (!(ls >> key))
+      continue;
+    bool ok = true;
+    uint32_t addr, end;
+    vector<uint8_t> bytes;
+    if (key == "rom") {
+      ok = bool(ls >> t.rom);
+    } else if (key == "platform") {
+      ok = bool(ls >> t.platform);
+    } else if (key == "timing") {
+      ok = (ls >> val) && parse_timing(val, t.timing);
+      t.timing_set = true;
+    } else if (key == "frames") {
+      ok = (ls >> t.frames) && t.frames > 0;
+    } else if (key == "input") {
+      ok = bool(ls >> t.input);
+    } else if (key == "code") {
+      ok = (ls >> val) && parse_hex(val, addr) && parse_bytes(ls, bytes) &&
+           addr + bytes.size() <= image_size;
+      if (ok) {
+        t.image.resize(image_size);
+        copy(bytes.begin(), bytes.end(), t.image.begin() + addr);
+      }
+    } else if (key == "fill") {
+      ok = (ls >> val) && parse_hex(val, addr) && (ls >> val) &&
+           parse_hex(val, end) && parse_bytes(ls, bytes) && addr < end &&
+           end <= image_size;
+      if (ok) {
+        t.image.resize(image_size);
+        for (uint32_t a = addr; a < end; a++)
+          t.image[a] = bytes[(a - addr) % bytes.size()];
+      }
+    } else if (key == "layers") {
+      t.layers = true;
+    } else if (key == "snapshots") {
+      uint64_t f;
+      while (ls >> f)
+        t.snapshots.push_back(f);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      cerr << path << ":" << line_no << ": bad line" << endl;
+      return false;
+    }
+  }
+  if (t.rom.empty() == t.image.empty() || t.frames == 0) {
+    cerr << path << ": frames and either rom or code are required" << endl;
+    return false;
+  }
+  // The last frame is always kept
+  t.snapshots.push_back(t.frames - 1);
+  return true;
+}
+
+static string golden_file(const Test &t) {
+  return t.dir + "/" + t.name + ".golden";
+}
+
+static string snapshot_file(const string &dir, const Test &t, uint64_t frame,
+                            const string &suffix) {
+  return dir + "/" + t.name + "." + to_string(frame) + suffix + ".png";
+}
+
+static bool load_golden(const Test &t, vector<FrameHash> &golden) {
+  ifstream in(golden_file(t));
+  if (!in)
+    return false;
+  string line;
+  while (getline(in, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    istringstream ls(line);
+    FrameHash h;
+    if (!(ls >> dec >> h.frame >> hex >> h.out))
+      return false;
+    h.has_layers = true;
+    for (int i = 0; i < 4; i++)
+      h.has_layers = h.has_layers && (ls >> h.layers[i]);
+    golden.push_back(h);
+  }
+  return true;
+}
+
+static bool save_golden(const Test &t, const vector<FrameHash> &hashes) {
+  ofstream out(golden_file(t));
+  out << "# frame output [layer0 layer1 layer2 layer3]" << endl;
+  for (const auto &h : hashes) {
+    out << dec << h.frame << hex << " " << h.out;
+    if (h.has_layers)
+      for (int i = 0; i < 4; i++)
+        out << " " << h.layers[i];
+    out << endl;
+  }
+  return bool(out);
+}
+
+static FrameHash hash_frame(uint64_t frame, bool layers) {
+  FrameHash h;
+  h.frame = frame;
+  h.out = fnv1a64(get_render_buffer(), frame_w * frame_h * sizeof(uint32_t));
+  h.has_layers = layers;
+  for (int i = 0; i < 4 && layers; i++) {
+    size_t len;
+    const uint8_t *data = ppu_get_layer(i, len);
+    h.layers[i] = fnv1a64(data, len);
+  }
+  return h;
+}
+
+static bool hash_matches(const FrameHash &a, const FrameHash &b) {
+  if (a.out != b.out)
+    return false;
+  if (a.has_layers && b.has_layers)
+    return equal(a.layers, a.layers + 4, b.layers);
+  return true;
+}
+
+// Highlight differing pixels in red over a dimmed copy of the actual frame
+static void write_diff(const string &file, const uint32_t *actual,
+                       const vector<uint32_t> &expected) {
+  vector<uint32_t> diff(frame_w * frame_h);
+  for (int i = 0; i < frame_w * frame_h; i++) {
+    if (actual[i] != expected[i])
+      diff[i] = 0xFFFF0000;
+    else
+      diff[i] = 0xFF000000 | ((actual[i] >> 2) & 0x3F3F3F);
+  }
+  write_png(file, diff.data(), frame_w, frame_h);
+}
+
+// Run a test in the current process, returning a TEST_* code
+static int run_test(const Test &t, bool record, const string &out_dir) {
+  const PlatformDesc *plat = find_platform(t.platform);
+  if (plat == nullptr) {
+    cerr << t.name << ": unknown platform " << t.platform << endl;
+    return TEST_ERROR;
+  }
+  string rom;
+  if (t.image.empty()) {
+    rom = find_file(t, t.rom);
+    if (rom.empty()) {
+      cerr << t.name << ": SKIP, ROM " << t.rom << " not found" << endl;
+      return TEST_SKIP;
+    }
+  }
+  VideoTiming timing = t.timing;
+  if (!t.timing_set && (rom.empty() || !detect_rom_timing(rom, timing)))
+    timing = plat->default_timing;
+  InputMovie movie;
+  if (!t.input.empty() && !movie.load(find_file(t, t.input))) {
+    cerr << t.name << ": can't load input " << t.input << endl;
+    return TEST_ERROR;
+  }
+  vector<FrameHash> golden, hashes;
+  if (!record && !load_golden(t, golden)) {
+    cerr << t.name << ": no golden hashes, run with --record first" << endl;
+    return TEST_ERROR;
+  }
+
+  // The core logs to cout, keep the report readable
+  cout.setstate(ios::failbit);
+  if (!t.image.empty())
+    load_rom_data(t.image.data(), t.image.size());
+  vt168_init(plat->id, timing, rom, false);
+  uint64_t first_bad = t.frames, n_bad = 0;
+  for (uint64_t f = 0; f < t.frames; f++) {
+    vt168_set_input(movie.buttons_at(f));
+    vt168_run_frame();
+    FrameHash h = hash_frame(f, t.layers);
+    bool snap = find(t.snapshots.begin(), t.snapshots.end(), f) !=
+                t.snapshots.end();
+    const uint32_t *buf = get_render_buffer();
+    if (record) {
+      hashes.push_back(h);
+      if (snap)
+        write_png(snapshot_file(t.dir, t, f, ""), buf, frame_w, frame_h);
+      continue;
+    }
+    if (f < golden.size() && golden[f].frame == f && hash_matches(h, golden[f]))
+      continue;
+    n_bad++;
+    if (first_bad == t.frames) {
+      first_bad = f;
+      write_png(snapshot_file(out_dir, t, f, ".actual"), buf, frame_w,
+                frame_h);
+    }
+    vector<uint32_t> expected;
+    int w, h_;
+    if (snap && read_png(snapshot_file(t.dir, t, f, ""), expected, w, h_) &&
+        w == frame_w && h_ == frame_h) {
+      write_png(snapshot_file(out_dir, t, f, ".actual"), buf, frame_w,
+                frame_h);
+      write_diff(snapshot_file(out_dir, t, f, ".diff"), buf, expected);
+    }
+  }
+  if (record) {
+    if (!save_golden(t, hashes)) {
+      cerr << t.name << ": can't write golden hashes" << endl;
+      return TEST_ERROR;
+    }
+    cerr << t.name << ": recorded " << t.frames << " frames" << endl;
+    return TEST_PASS;
+  }
+  if (golden.size() != t.frames) {
+    cerr << t.name << ": FAIL, golden has " << golden.size()
+         << " frames, test has " << t.frames << endl;
+    return TEST_FAIL;
+  }
+  if (n_bad > 0) {
+    cerr << t.name << ": FAIL, " << n_bad << " frames differ, first at frame "
+         << first_bad << " (see " << out_dir << ")" << endl;
+    return TEST_FAIL;
+  }
+  cerr << t.name << ": PASS" << endl;
+  return TEST_PASS;
+}
+
+// Each test runs in its own process, so it starts from a fresh machine and a
+// crash only fails that test
+static int run_test_isolated(const Test &t, bool record,
+                             const string &out_dir) {
+  cerr.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return TEST_ERROR;
+  }
+  if (pid == 0) {
+    int res = run_test(t, record, out_dir);
+    cerr.flush();
+    _exit(res);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    perror("waitpid");
+    return TEST_ERROR;
+  }
+  if (WIFSIGNALED(status)) {
+    cerr << t.name << ": FAIL, crashed with signal " << WTERMSIG(status)
+         << endl;
+    return TEST_FAIL;
+  }
+  int res = WEXITSTATUS(status);
+  return (res <= TEST_ERROR) ? res : TEST_ERROR;
+}
+
+static void add_tests(const string &path, vector<string> &files) {
+  if (!is_dir(path)) {
+    files.push_back(path);
+    return;
+  }
+  DIR *d = opendir(path.c_str());
+  if (d == nullptr)
+    return;
+  vector<string> found;
+  while (dirent *e = readdir(d)) {
+    string n = e->d_name;
+    if (n.size() > 5 && n.substr(n.size() - 5) == ".test")
+      found.push_back(path + "/" + n);
+  }
+  closedir(d);
+  sort(found.begin(), found.end());
+  files.insert(files.end(), found.begin(), found.end());
+}
+
+static void usage() {
+  cerr << "Usage: " << endl;
+  cerr << "openvtx-regress [--record] [--out=DIR] test.test|dir..." << endl;
+  cerr << "  --record    record new golden hashes and snapshots" << endl;
+  cerr << "  --out=DIR   where to write PNGs on mismatch (regress-out)"
+       << endl;
+}
+
+int main(int argc, const char *argv[]) {
+  bool record = false;
+  string out_dir = "regress-out";
+  vector<string> files;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--record") {
+      record = true;
+    } else if (arg.substr(0, 6) == "--out=") {
+      out_dir = arg.substr(6);
+    } else if (arg.substr(0, 2) == "--") {
+      usage();
+      return 2;
+    } else {
+      add_tests(arg, files);
+    }
+  }
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  if (!record)
+    mkdir(out_dir.c_str(), 0777);
+  int counts[4] = {0};
+  for (const auto &f : files) {
+    Test t;
+    int res = parse_test(f, t) ? run_test_isolated(t, record, out_dir)
+                               : TEST_ERROR;
+    counts[res]++;
+  }
+  cerr << counts[TEST_PASS] << " passed, " << counts[TEST_FAIL] << " failed, "
+       << counts[TEST_SKIP] << " skipped, " << counts[TEST_ERROR] << " errors"
+       << endl;
+  return (counts[TEST_FAIL] + counts[TEST_ERROR]) ? 1 : 0;
+}